@@ -120,6 +120,32 @@ void CAddrMan::SwapRandom(unsigned int nRndPos1, unsigned int nRndPos2)
     vRandom[nRndPos2] = nId1;
 }
 
+/** Store nId in position nSlot of a table, adding the position to or removing it from the occupied ones */
+static void SetTableEntry(int* pTable, int* pSlotPos, std::vector<int>& vSlots, int nSlot, int nId)
+{
+    bool fWasUsed = pTable[nSlot] != -1;
+    pTable[nSlot] = nId;
+    if (nId != -1 && !fWasUsed) {
+        pSlotPos[nSlot] = vSlots.size();
+        vSlots.push_back(nSlot);
+    } else if (nId == -1 && fWasUsed) {
+        int nSlotLast = vSlots.back();
+        vSlots[pSlotPos[nSlot]] = nSlotLast;
+        pSlotPos[nSlotLast] = pSlotPos[nSlot];
+        vSlots.pop_back();
+    }
+}
+
+void CAddrMan::SetNew(int nUBucket, int nUBucketPos, int nId)
+{
+    SetTableEntry(&vvNew[0][0], &vvNewSlotPos[0][0], vNewSlots, nUBucket * ADDRMAN_BUCKET_SIZE + nUBucketPos, nId);
+}
+
+void CAddrMan::SetTried(int nKBucket, int nKBucketPos, int nId)
+{
+    SetTableEntry(&vvTried[0][0], &vvTriedSlotPos[0][0], vTriedSlots, nKBucket * ADDRMAN_BUCKET_SIZE + nKBucketPos, nId);
+}
+
 void CAddrMan::Delete(int nId)
 {
     assert(mapInfo.count(nId) != 0);
@@ -142,7 +168,7 @@ void CAddrMan::ClearNew(int nUBucket, int nUBucketPos)
         CAddrInfo& infoDelete = mapInfo[nIdDelete];
         assert(infoDelete.nRefCount > 0);
         infoDelete.nRefCount--;
-        vvNew[nUBucket][nUBucketPos] = -1;
+        SetNew(nUBucket, nUBucketPos, -1);
         if (infoDelete.nRefCount == 0) {
             Delete(nIdDelete);
         }
@@ -155,7 +181,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
     for (int bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
         int pos = info.GetBucketPosition(nKey, true, bucket);
         if (vvNew[bucket][pos] == nId) {
-            vvNew[bucket][pos] = -1;
+            SetNew(bucket, pos, -1);
             info.nRefCount--;
         }
     }
@@ -176,7 +202,7 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Remove the to-be-evicted item from the tried set.
         infoOld.fInTried = false;
-        vvTried[nKBucket][nKBucketPos] = -1;
+        SetTried(nKBucket, nKBucketPos, -1);
         nTried--;
 
         // find which new bucket it belongs to
@@ -187,12 +213,12 @@ void CAddrMan::MakeTried(CAddrInfo& info, int nId)
 
         // Enter it into the new set again.
         infoOld.nRefCount = 1;
-        vvNew[nUBucket][nUBucketPos] = nIdEvict;
+        SetNew(nUBucket, nUBucketPos, nIdEvict);
         nNew++;
     }
     assert(vvTried[nKBucket][nKBucketPos] == -1);
 
-    vvTried[nKBucket][nKBucketPos] = nId;
+    SetTried(nKBucket, nKBucketPos, nId);
     nTried++;
     info.fInTried = true;
 }
@@ -304,7 +330,7 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
         if (fInsert) {
             ClearNew(nUBucket, nUBucketPos);
             pinfo->nRefCount++;
-            vvNew[nUBucket][nUBucketPos] = nId;
+            SetNew(nUBucket, nUBucketPos, nId);
         } else {
             if (pinfo->nRefCount == 0) {
                 Delete(nId);
@@ -316,7 +342,8 @@ bool CAddrMan::Add_(const CAddress& addr, const CNetAddr& source, int64_t nTimeP
 
 void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
 {
-    CAddrInfo* pinfo = Find(addr);
+    int nId;
+    CAddrInfo* pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -329,50 +356,39 @@ void CAddrMan::Attempt_(const CService& addr, int64_t nTime)
         return;
 
     // update info
+    LOCK(csStripe[nId % ADDRMAN_LOCK_STRIPES]);
     info.nLastTry = nTime;
     info.nAttempts++;
 }
 
-CAddress CAddrMan::Select_()
+CAddress CAddrMan::Select_() const
 {
     if (size() == 0)
         return CAddress();
 
     // Use a 50% chance for choosing between tried and new table entries.
-    if (nTried > 0 && (nNew == 0 || GetRandInt(2) == 0)) {
-        // use a tried node
-        double fChanceFactor = 1.0;
-        while (1) {
-            int nKBucket = GetRandInt(ADDRMAN_TRIED_BUCKET_COUNT);
-            int nKBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            if (vvTried[nKBucket][nKBucketPos] == -1)
-                continue;
-            int nId = vvTried[nKBucket][nKBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
-            fChanceFactor *= 1.2;
-        }
-    } else {
-        // use a new node
-        double fChanceFactor = 1.0;
-        while (1) {
-            int nUBucket = GetRandInt(ADDRMAN_NEW_BUCKET_COUNT);
-            int nUBucketPos = GetRandInt(ADDRMAN_BUCKET_SIZE);
-            if (vvNew[nUBucket][nUBucketPos] == -1)
-                continue;
-            int nId = vvNew[nUBucket][nUBucketPos];
-            assert(mapInfo.count(nId) == 1);
-            CAddrInfo& info = mapInfo[nId];
-            if (GetRandInt(1 << 30) < fChanceFactor * info.GetChance() * (1 << 30))
-                return info;
-            fChanceFactor *= 1.2;
+    bool fTried = nTried > 0 && (nNew == 0 || GetRandInt(2) == 0);
+    const int* pTable = fTried ? &vvTried[0][0] : &vvNew[0][0];
+    const std::vector<int>& vSlots = fTried ? vTriedSlots : vNewSlots;
+    if (vSlots.empty())
+        return CAddress();
+
+    // Draw from the occupied positions only, which gives every entry the same
+    // odds as probing random positions does, however full the table is
+    double fChanceFactor = 1.0;
+    while (1) {
+        int nId = pTable[vSlots[GetRandInt(vSlots.size())]];
+        std::map<int, CAddrInfo>::const_iterator it = mapInfo.find(nId);
+        assert(it != mapInfo.end());
+        {
+            LOCK(csStripe[nId % ADDRMAN_LOCK_STRIPES]);
+            if (GetRandInt(1 << 30) < fChanceFactor * it->second.GetChance() * (1 << 30))
+                return it->second;
         }
+        fChanceFactor *= 1.2;
     }
 }
 
-#ifdef DEBUG_ADDRMAN
 int CAddrMan::Check_()
 {
     std::set<int> setTried;
@@ -411,6 +427,8 @@ int CAddrMan::Check_()
         return -9;
     if (mapNew.size() != nNew)
         return -10;
+    if (vTriedSlots.size() != nTried)
+        return -20;
 
     for (int n = 0; n < ADDRMAN_TRIED_BUCKET_COUNT; n++) {
         for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
@@ -446,34 +464,62 @@ int CAddrMan::Check_()
     if (nKey.IsNull())
         return -16;
 
+    // The occupied position lists hold exactly the used positions, each where vv*SlotPos says
+    int nNewUsed = 0;
+    for (int n = 0; n < ADDRMAN_NEW_BUCKET_COUNT; n++) {
+        for (int i = 0; i < ADDRMAN_BUCKET_SIZE; i++) {
+            if (vvNew[n][i] != -1)
+                nNewUsed++;
+        }
+    }
+    if (vNewSlots.size() != nNewUsed)
+        return -21;
+    for (unsigned int k = 0; k < vTriedSlots.size(); k++) {
+        int nSlot = vTriedSlots[k];
+        if (vvTried[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE] == -1)
+            return -22;
+        if (vvTriedSlotPos[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE] != k)
+            return -23;
+    }
+    for (unsigned int k = 0; k < vNewSlots.size(); k++) {
+        int nSlot = vNewSlots[k];
+        if (vvNew[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE] == -1)
+            return -24;
+        if (vvNewSlotPos[nSlot / ADDRMAN_BUCKET_SIZE][nSlot % ADDRMAN_BUCKET_SIZE] != k)
+            return -25;
+    }
+
     return 0;
 }
-#endif
 
-void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr)
+void CAddrMan::GetAddr_(std::vector<CAddress>& vAddr) const
 {
     unsigned int nNodes = ADDRMAN_GETADDR_MAX_PCT * vRandom.size() / 100;
     if (nNodes > ADDRMAN_GETADDR_MAX)
         nNodes = ADDRMAN_GETADDR_MAX;
 
-    // gather a list of random nodes, skipping those of low quality
-    for (unsigned int n = 0; n < vRandom.size(); n++) {
+    // gather a list of random nodes, skipping those of low quality; shuffle a
+    // copy of vRandom, as the tables are only locked for reading
+    std::vector<int> vIds(vRandom);
+    for (unsigned int n = 0; n < vIds.size(); n++) {
         if (vAddr.size() >= nNodes)
             break;
 
-        int nRndPos = GetRandInt(vRandom.size() - n) + n;
-        SwapRandom(n, nRndPos);
-        assert(mapInfo.count(vRandom[n]) == 1);
+        int nRndPos = GetRandInt(vIds.size() - n) + n;
+        std::swap(vIds[n], vIds[nRndPos]);
+        std::map<int, CAddrInfo>::const_iterator it = mapInfo.find(vIds[n]);
+        assert(it != mapInfo.end());
 
-        const CAddrInfo& ai = mapInfo[vRandom[n]];
-        if (!ai.IsTerrible())
-            vAddr.push_back(ai);
+        LOCK(csStripe[vIds[n] % ADDRMAN_LOCK_STRIPES]);
+        if (!it->second.IsTerrible())
+            vAddr.push_back(it->second);
     }
 }
 
 void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 {
-    CAddrInfo* pinfo = Find(addr);
+    int nId;
+    CAddrInfo* pinfo = Find(addr, &nId);
 
     // if not found, bail out
     if (!pinfo)
@@ -487,6 +533,30 @@ void CAddrMan::Connected_(const CService& addr, int64_t nTime)
 
     // update info
     int64_t nUpdateInterval = 20 * 60;
+    LOCK(csStripe[nId % ADDRMAN_LOCK_STRIPES]);
     if (nTime - info.nTime > nUpdateInterval)
         info.nTime = nTime;
 }
+
+void CAddrMan::GetSnapshot(CAddrMan& addr) const
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs);
+    boost::unique_lock<boost::shared_mutex> lockSnapshot(addr.cs);
+    addr.nKey = nKey;
+    addr.nIdCount = nIdCount;
+    addr.mapInfo.clear();
+    for (std::map<int, CAddrInfo>::const_iterator it = mapInfo.begin(); it != mapInfo.end(); it++) {
+        LOCK(csStripe[it->first % ADDRMAN_LOCK_STRIPES]);
+        addr.mapInfo.insert(addr.mapInfo.end(), *it);
+    }
+    addr.mapAddr = mapAddr;
+    addr.vRandom = vRandom;
+    addr.nTried = nTried;
+    addr.nNew = nNew;
+    memcpy(addr.vvTried, vvTried, sizeof(vvTried));
+    memcpy(addr.vvNew, vvNew, sizeof(vvNew));
+    addr.vTriedSlots = vTriedSlots;
+    addr.vNewSlots = vNewSlots;
+    memcpy(addr.vvTriedSlotPos, vvTriedSlotPos, sizeof(vvTriedSlotPos));
+    memcpy(addr.vvNewSlotPos, vvNewSlotPos, sizeof(vvNewSlotPos));
+}
@@ -19,6 +19,9 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
 /** 
  * Extended statistics about a CAddress 
  */
@@ -126,6 +129,9 @@ public:
  *      be observable by adversaries.
  *    * Several indexes are kept for high performance. Defining DEBUG_ADDRMAN will introduce frequent (and expensive)
  *      consistency checks for the entire data structure.
+ *  * Adding addresses and marking them good change the tables and lock them exclusively. Selecting, sampling and
+ *    recording connection attempts only read the tables, and share the lock; the few fields of an entry they read
+ *    or update are protected by one of ADDRMAN_LOCK_STRIPES smaller locks, chosen by the entry's id.
  */
 
 //! total number of buckets for tried addresses
@@ -158,6 +164,9 @@ public:
 //! ... in at least this many days
 #define ADDRMAN_MIN_FAIL_DAYS 7
 
+//! number of locks over which the entries' connection statistics are spread
+#define ADDRMAN_LOCK_STRIPES 16
+
 //! the maximum percentage of nodes to return in a getaddr call
 #define ADDRMAN_GETADDR_MAX_PCT 23
 
@@ -170,8 +179,12 @@ public:
 class CAddrMan
 {
 private:
-    //! critical section to protect the inner data structures
-    mutable CCriticalSection cs;
+    //! protects the inner data structures: exclusive to change them, shared to read them
+    mutable boost::shared_mutex cs;
+
+    //! protect the time and attempt fields of the entries with id equal to their index modulo ADDRMAN_LOCK_STRIPES,
+    //! for callers holding cs shared; only ever taken after cs
+    mutable CCriticalSection csStripe[ADDRMAN_LOCK_STRIPES];
 
     //! secret key to randomize bucket select with
     uint256 nKey;
@@ -200,6 +213,14 @@ private:
     //! list of "new" buckets
     int vvNew[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
 
+    //! occupied positions (bucket * ADDRMAN_BUCKET_SIZE + position) of the "tried" and "new" tables, in any order
+    std::vector<int> vTriedSlots;
+    std::vector<int> vNewSlots;
+
+    //! where each occupied position is in vTriedSlots and vNewSlots
+    int vvTriedSlotPos[ADDRMAN_TRIED_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+    int vvNewSlotPos[ADDRMAN_NEW_BUCKET_COUNT][ADDRMAN_BUCKET_SIZE];
+
 protected:
     //! Find an entry.
     CAddrInfo* Find(const CNetAddr& addr, int* pnId = NULL);
@@ -211,6 +232,10 @@ protected:
     //! Swap two elements in vRandom.
     void SwapRandom(unsigned int nRandomPos1, unsigned int nRandomPos2);
 
+    //! Store nId (-1 to empty it) at a position of the "new" or "tried" table.
+    void SetNew(int nUBucket, int nUBucketPos, int nId);
+    void SetTried(int nKBucket, int nKBucketPos, int nId);
+
     //! Move an entry from the "new" table(s) to the "tried" table
     void MakeTried(CAddrInfo& info, int nId);
 
@@ -231,15 +256,14 @@ protected:
 
     //! Select an address to connect to.
     //! nUnkBias determines how much to favor new addresses over tried ones (min=0, max=100)
-    CAddress Select_();
+    CAddress Select_() const;
 
-#ifdef DEBUG_ADDRMAN
     //! Perform consistency check. Returns an error code or zero.
+    //! Only run by Check() when DEBUG_ADDRMAN is defined; tests call it directly.
     int Check_();
-#endif
 
     //! Select several addresses at once.
-    void GetAddr_(std::vector<CAddress>& vAddr);
+    void GetAddr_(std::vector<CAddress>& vAddr) const;
 
     //! Mark an entry as currently-connected-to.
     void Connected_(const CService& addr, int64_t nTime);
@@ -277,7 +301,7 @@ public:
     template <typename Stream>
     void Serialize(Stream& s, int nType, int nVersionDummy) const
     {
-        LOCK(cs);
+        boost::unique_lock<boost::shared_mutex> lock(cs);
 
         unsigned char nVersion = 1;
         s << nVersion;
@@ -327,7 +351,7 @@ public:
     template <typename Stream>
     void Unserialize(Stream& s, int nType, int nVersionDummy)
     {
-        LOCK(cs);
+        boost::unique_lock<boost::shared_mutex> lock(cs);
 
         Clear();
 
@@ -358,7 +382,7 @@ public:
                 int nUBucket = info.GetNewBucket(nKey);
                 int nUBucketPos = info.GetBucketPosition(nKey, true, nUBucket);
                 if (vvNew[nUBucket][nUBucketPos] == -1) {
-                    vvNew[nUBucket][nUBucketPos] = n;
+                    SetNew(nUBucket, nUBucketPos, n);
                     info.nRefCount++;
                 }
             }
@@ -378,7 +402,7 @@ public:
                 vRandom.push_back(nIdCount);
                 mapInfo[nIdCount] = info;
                 mapAddr[info] = nIdCount;
-                vvTried[nKBucket][nKBucketPos] = nIdCount;
+                SetTried(nKBucket, nKBucketPos, nIdCount);
                 nIdCount++;
             } else {
                 nLost++;
@@ -398,7 +422,7 @@ public:
                     int nUBucketPos = info.GetBucketPosition(nKey, true, bucket);
                     if (nVersion == 1 && nUBuckets == ADDRMAN_NEW_BUCKET_COUNT && vvNew[bucket][nUBucketPos] == -1 && info.nRefCount < ADDRMAN_NEW_BUCKETS_PER_ADDRESS) {
                         info.nRefCount++;
-                        vvNew[bucket][nUBucketPos] = nIndex;
+                        SetNew(bucket, nUBucketPos, nIndex);
                     }
                 }
             }
@@ -430,6 +454,8 @@ public:
     void Clear()
     {
         std::vector<int>().swap(vRandom);
+        std::vector<int>().swap(vTriedSlots);
+        std::vector<int>().swap(vNewSlots);
         nKey = GetRandHash();
         for (size_t bucket = 0; bucket < ADDRMAN_NEW_BUCKET_COUNT; bucket++) {
             for (size_t entry = 0; entry < ADDRMAN_BUCKET_SIZE; entry++) {
@@ -445,6 +471,8 @@ public:
         nIdCount = 0;
         nTried = 0;
         nNew = 0;
+        mapInfo.clear();
+        mapAddr.clear();
     }
 
     CAddrMan()
@@ -458,17 +486,16 @@ public:
     }
 
     //! Return the number of (unique) addresses in all tables.
-    int size()
+    int size() const
     {
         return vRandom.size();
     }
 
-    //! Consistency check
+    //! Consistency check. Requires cs held exclusively.
     void Check()
     {
 #ifdef DEBUG_ADDRMAN
         {
-            LOCK(cs);
             int err;
             if ((err = Check_()))
                 LogPrintf("ADDRMAN CONSISTENCY CHECK FAILED!!! err=%i\n", err);
@@ -481,7 +508,7 @@ public:
     {
         bool fRet = false;
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             fRet |= Add_(addr, source, nTimePenalty);
             Check();
@@ -496,7 +523,7 @@ public:
     {
         int nAdd = 0;
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             for (std::vector<CAddress>::const_iterator it = vAddr.begin(); it != vAddr.end(); it++)
                 nAdd += Add_(*it, source, nTimePenalty) ? 1 : 0;
@@ -511,7 +538,7 @@ public:
     void Good(const CService& addr, int64_t nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
+            boost::unique_lock<boost::shared_mutex> lock(cs);
             Check();
             Good_(addr, nTime);
             Check();
@@ -522,10 +549,8 @@ public:
     void Attempt(const CService& addr, int64_t nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
-            Check();
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             Attempt_(addr, nTime);
-            Check();
         }
     }
 
@@ -537,10 +562,8 @@ public:
     {
         CAddress addrRet;
         {
-            LOCK(cs);
-            Check();
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             addrRet = Select_();
-            Check();
         }
         return addrRet;
     }
@@ -548,13 +571,11 @@ public:
     //! Return a bunch of addresses, selected at random.
     std::vector<CAddress> GetAddr()
     {
-        Check();
         std::vector<CAddress> vAddr;
         {
-            LOCK(cs);
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             GetAddr_(vAddr);
         }
-        Check();
         return vAddr;
     }
 
@@ -562,12 +583,13 @@ public:
     void Connected(const CService& addr, int64_t nTime = GetAdjustedTime())
     {
         {
-            LOCK(cs);
-            Check();
+            boost::shared_lock<boost::shared_mutex> lock(cs);
             Connected_(addr, nTime);
-            Check();
         }
     }
+
+    //! Copy all tables into addr, so they can be serialized without holding up other callers.
+    void GetSnapshot(CAddrMan& addr) const;
 };
 
 #endif // BITCOIN_ADDRMAN_H
@@ -0,0 +1,190 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Copyright (c) 2018 The VELES developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <unordered_map>
+
+/** The smallest a transaction can be serialized, used to bound the number of transactions in a block */
+static const size_t MIN_SERIALIZABLE_TRANSACTION_SIZE = 10;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) : nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+                                                                             vchBlockSig(block.vchBlockSig),
+                                                                             header(block.GetBlockHeader())
+{
+    // The receiver can't have the coinbase, nor the coinstake of a proof-of-stake block
+    size_t nPrefilled = std::min(block.vtx.size(), (size_t)(block.IsProofOfStake() ? 2 : 1));
+    prefilledtxn.resize(nPrefilled);
+    for (size_t i = 0; i < nPrefilled; i++) {
+        // Consecutive prefilled transactions have a differential index of 0
+        prefilledtxn[i].index = 0;
+        prefilledtxn[i].tx = *block.vtx[i];
+    }
+
+    FillShortTxIDSelector();
+    shorttxids.resize(block.vtx.size() - nPrefilled);
+    for (size_t i = nPrefilled; i < block.vtx.size(); i++)
+        shorttxids[i - nPrefilled] = GetShortID(block.vtx[i]->GetHash());
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    CSHA256 hasher;
+    hasher.Write((unsigned char*)&(*stream.begin()), stream.end() - stream.begin());
+    uint256 shorttxidhash;
+    hasher.Finalize(shorttxidhash.begin());
+    shorttxidk0 = shorttxidhash.Get64(0);
+    shorttxidk1 = shorttxidhash.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
+}
+
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<CTransactionRef>& vExtraTxn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.shorttxids.size() + cmpctblock.prefilledtxn.size() > MAX_BLOCK_SIZE_CURRENT / MIN_SERIALIZABLE_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    vchBlockSig = cmpctblock.vchBlockSig;
+    txn_available.resize(cmpctblock.BlockTxCount());
+
+    int32_t lastprefilledindex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        if (cmpctblock.prefilledtxn[i].tx.IsNull())
+            return READ_STATUS_INVALID;
+
+        lastprefilledindex += cmpctblock.prefilledtxn[i].index + 1; // index is a uint16_t, so can't overflow here
+        if (lastprefilledindex > std::numeric_limits<uint16_t>::max())
+            return READ_STATUS_INVALID;
+        if ((uint32_t)lastprefilledindex > cmpctblock.shorttxids.size() + i) {
+            // A transaction at an index beyond all short IDs and the prefilled
+            // transactions so far leaves a gap we have neither for
+            return READ_STATUS_INVALID;
+        }
+        txn_available[lastprefilledindex] = MakeTransactionRef(cmpctblock.prefilledtxn[i].tx);
+    }
+    prefilled_count = cmpctblock.prefilledtxn.size();
+
+    // Map short IDs to their position in the block. Well-formed short IDs are
+    // spread evenly, so a very uneven distribution over the buckets can only
+    // come from a collision attempt and is treated as a failure (a full block
+    // is requested instead). With up to 12 entries per bucket allowed, honest
+    // blocks of up to 16000 transactions fail about once in a million.
+    std::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    uint16_t index_offset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (txn_available[i + index_offset])
+            index_offset++;
+        shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
+        if (shorttxids.bucket_size(shorttxids.bucket(cmpctblock.shorttxids[i])) > 12)
+            return READ_STATUS_FAILED;
+    }
+    if (shorttxids.size() != cmpctblock.shorttxids.size())
+        return READ_STATUS_FAILED; // Short ID collision within the block
+
+    std::vector<bool> have_txn(txn_available.size());
+    {
+        LOCK(pool->cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); it++) {
+            std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(cmpctblock.GetShortID(it->first));
+            if (idit != shorttxids.end()) {
+                if (!have_txn[idit->second]) {
+                    txn_available[idit->second] = it->second.GetSharedTx();
+                    have_txn[idit->second] = true;
+                    mempool_count++;
+                } else if (txn_available[idit->second]) {
+                    // Two mempool transactions match the short ID; just request it
+                    txn_available[idit->second].reset();
+                    mempool_count--;
+                }
+            }
+            // Stop once everything was found, though that misses a later double match
+            if (mempool_count == shorttxids.size())
+                break;
+        }
+    }
+
+    for (size_t i = 0; i < vExtraTxn.size() && mempool_count + extra_count < shorttxids.size(); i++) {
+        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(cmpctblock.GetShortID(vExtraTxn[i]->GetHash()));
+        if (idit != shorttxids.end()) {
+            if (!have_txn[idit->second]) {
+                txn_available[idit->second] = vExtraTxn[i];
+                have_txn[idit->second] = true;
+                extra_count++;
+            } else if (txn_available[idit->second] && txn_available[idit->second]->GetHash() != vExtraTxn[i]->GetHash()) {
+                // The same transaction may be both in the mempool and an extra, but anything else is a collision
+                txn_available[idit->second].reset();
+                extra_count--;
+            }
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < txn_available.size());
+    return txn_available[index] ? true : false;
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing)
+{
+    assert(!header.IsNull());
+    uint256 hash = header.GetHash();
+    block = header;
+    block.vtx.resize(txn_available.size());
+    block.vchBlockSig = vchBlockSig;
+
+    size_t tx_missing_offset = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (!txn_available[i]) {
+            if (vtx_missing.size() <= tx_missing_offset)
+                return READ_STATUS_INVALID;
+            block.vtx[i] = MakeTransactionRef(vtx_missing[tx_missing_offset++]);
+        } else
+            block.vtx[i] = txn_available[i];
+    }
+
+    // Make sure we can't call FillBlock again.
+    header.SetNull();
+    txn_available.clear();
+
+    if (vtx_missing.size() != tx_missing_offset)
+        return READ_STATUS_INVALID;
+
+    // A wrong merkle root most likely means a short ID matched the wrong mempool transaction
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != block.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool, %lu txn from extra pool and %lu txn requested\n", hash.ToString(), prefilled_count, mempool_count, extra_count, vtx_missing.size());
+    if (vtx_missing.size() < 5) {
+        BOOST_FOREACH (const CTransaction& tx, vtx_missing)
+            LogPrint("cmpctblock", "Reconstructed block %s required tx %s\n", hash.ToString(), tx.GetHash().ToString());
+    }
+
+    return READ_STATUS_OK;
+}
@@ -34,7 +34,7 @@ bool SignBlock(CBlock& block, const CKeyStore& keystore)
     CKeyID keyID;
     if (block.IsProofOfWork()) {
         bool fFoundID = false;
-        for (const CTxOut& txout :block.vtx[0].vout) {
+        for (const CTxOut& txout :block.vtx[0]->vout) {
             if (!GetKeyIDFromUTXO(txout, keyID))
                 continue;
             fFoundID = true;
@@ -43,7 +43,7 @@ bool SignBlock(CBlock& block, const CKeyStore& keystore)
         if (!fFoundID)
             return error("%s: failed to find key for PoW", __func__);
     } else {
-        if (!GetKeyIDFromUTXO(block.vtx[1].vout[1], keyID))
+        if (!GetKeyIDFromUTXO(block.vtx[1]->vout[1], keyID))
             return error("%s: failed to find key for PoS", __func__);
     }
 
@@ -67,14 +67,14 @@ bool CheckBlockSignature(const CBlock& block)
      *  UTXO: The public key that signs must match the public key associated with the first utxo of the coinstake tx.
      */
     CPubKey pubkey;
-    bool fzVLSStake = block.vtx[1].IsZerocoinSpend();
+    bool fzVLSStake = block.vtx[1]->IsZerocoinSpend();
     if (fzVLSStake) {
-        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(block.vtx[1].vin[0]);
+        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(block.vtx[1]->vin[0]);
         pubkey = spend.getPubKey();
     } else {
         txnouttype whichType;
         std::vector<valtype> vSolutions;
-        const CTxOut& txout = block.vtx[1].vout[1];
+        const CTxOut& txout = block.vtx[1]->vout[1];
         if (!Solver(txout.scriptPubKey, whichType, vSolutions))
             return false;
         if (whichType == TX_PUBKEY || whichType == TX_PUBKEYHASH) {
@@ -14,6 +14,7 @@
 #include "util.h"
 #include "libzerocoin/Denominations.h"
 
+#include <stdexcept>
 #include <vector>
 
 #include <boost/foreach.hpp>
@@ -100,6 +101,83 @@ enum BlockStatus {
     BLOCK_FAILED_MASK = BLOCK_FAILED_VALID | BLOCK_FAILED_CHILD,
 };
 
+/**
+ * Zerocoin supply per denomination, kept inline in every CBlockIndex.
+ * Replaces a std::map that cost one heap node per denomination per block;
+ * serializes identically to std::map<CoinDenomination, int64_t>.
+ */
+class CZerocoinSupply
+{
+private:
+    static const unsigned int nDenominations = 8;
+    int64_t vSupply[nDenominations]; // in zerocoinDenomList order
+
+    static int GetIndex(libzerocoin::CoinDenomination denom)
+    {
+        for (unsigned int i = 0; i < nDenominations; i++) {
+            if (libzerocoin::zerocoinDenomList[i] == denom)
+                return i;
+        }
+        return -1;
+    }
+
+public:
+    CZerocoinSupply()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        for (unsigned int i = 0; i < nDenominations; i++)
+            vSupply[i] = 0;
+    }
+
+    int64_t& at(libzerocoin::CoinDenomination denom)
+    {
+        int nIndex = GetIndex(denom);
+        if (nIndex < 0)
+            throw std::out_of_range("CZerocoinSupply::at() : invalid denomination");
+        return vSupply[nIndex];
+    }
+
+    const int64_t& at(libzerocoin::CoinDenomination denom) const
+    {
+        return const_cast<CZerocoinSupply*>(this)->at(denom);
+    }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const
+    {
+        return GetSizeOfCompactSize(nDenominations) + nDenominations * (sizeof(int) + sizeof(int64_t));
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const
+    {
+        WriteCompactSize(s, nDenominations);
+        for (unsigned int i = 0; i < nDenominations; i++) {
+            ::Serialize(s, libzerocoin::zerocoinDenomList[i], nType, nVersion);
+            ::Serialize(s, vSupply[i], nType, nVersion);
+        }
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion)
+    {
+        SetNull();
+        unsigned int nSize = ReadCompactSize(s);
+        for (unsigned int i = 0; i < nSize; i++) {
+            libzerocoin::CoinDenomination denom;
+            int64_t nSupply;
+            ::Unserialize(s, denom, nType, nVersion);
+            ::Unserialize(s, nSupply, nType, nVersion);
+            int nIndex = GetIndex(denom);
+            if (nIndex >= 0)
+                vSupply[nIndex] = nSupply;
+        }
+    }
+};
+
 /** The block chain is a tree shaped structure starting with the
  * genesis block at the root, with each block potentially having multiple
  * candidates to be the next block. A blockindex may have multiple pprev pointing
@@ -120,9 +198,6 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
-    //ppcoin: trust score of block chain
-    uint256 bnChainTrust;
-
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
@@ -179,7 +254,7 @@ public:
     uint32_t nSequenceId;
     
     //! zerocoin specific fields
-    std::map<libzerocoin::CoinDenomination, int64_t> mapZerocoinSupply;
+    CZerocoinSupply mapZerocoinSupply;
     std::vector<libzerocoin::CoinDenomination> vMintDenominationsInBlock;
     
     void SetNull()
@@ -212,9 +287,7 @@ public:
         nNonce = 0;
         nAccumulatorCheckpoint = 0;
         // Start supply of each denomination with 0s
-        for (auto& denom : libzerocoin::zerocoinDenomList) {
-            mapZerocoinSupply.insert(make_pair(denom, 0));
-        }
+        mapZerocoinSupply.SetNull();
         vMintDenominationsInBlock.clear();
     }
 
@@ -236,7 +309,6 @@ public:
             nAccumulatorCheckpoint = block.nAccumulatorCheckpoint;
 
         //Proof of Stake
-        bnChainTrust = uint256();
         nMint = 0;
         nMoneySupply = 0;
         nFlags = 0;
@@ -246,7 +318,7 @@ public:
 
         if (block.IsProofOfStake()) {
             SetProofOfStake();
-            prevoutStake = block.vtx[1].vin[0].prevout;
+            prevoutStake = block.vtx[1]->vin[0].prevout;
             nStakeTime = block.nTime;
         } else {
             prevoutStake.SetNull();
@@ -5,10 +5,16 @@
 #ifndef BITCOIN_CHECKQUEUE_H
 #define BITCOIN_CHECKQUEUE_H
 
+#include "utiltime.h"
+
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <stdint.h>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -16,7 +22,33 @@
 template <typename T>
 class CCheckQueueControl;
 
-/** 
+/** Statistics about the verifications run through a CCheckQueue */
+struct CCheckQueueStats
+{
+    //! Number of verifications queued
+    uint64_t nChecks;
+    //! Microseconds from the start of the control session until all verifications completed
+    int64_t nWallTime;
+    //! Microseconds the workers (including the master) spent waiting for work
+    int64_t nIdleTime;
+    //! Number of batches a worker took from another worker's deque
+    uint64_t nSteals;
+    //! Number of threads (including the master) that could take work
+    int nWorkers;
+
+    CCheckQueueStats() : nChecks(0), nWallTime(0), nIdleTime(0), nSteals(0), nWorkers(0) {}
+
+    void Add(const CCheckQueueStats& other)
+    {
+        nChecks += other.nChecks;
+        nWallTime += other.nWallTime;
+        nIdleTime += other.nIdleTime;
+        nSteals += other.nSteals;
+        nWorkers = other.nWorkers;
+    }
+};
+
+/**
  * Queue for verifications that have to be performed.
   * The verifications are represented by a type T, which must provide an
   * operator(), returning a bool.
@@ -25,12 +57,28 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker owns a deque of pending verifications, protected by its
+  * own mutex. The master spreads added work over the deques; a worker
+  * takes batches from the back of its own deque and, once that is empty,
+  * steals half of another worker's deque from the front. The shared mutex
+  * is only taken to sleep, to wake sleepers and to finish a session.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
+    /** One worker's share of the pending verifications */
+    struct CWorkerQueue {
+        boost::mutex mutex;
+        std::deque<T> deque;
+        //! When this worker went to sleep, or 0 if it is awake. Protected by the shared mutex.
+        int64_t nSleepStart;
+
+        CWorkerQueue() : nSleepStart(0) {}
+    };
+
+    //! Mutex to protect the sleep/wake state and the statistics
     boost::mutex mutex;
 
     //! Worker threads block on this when out of work
@@ -39,25 +87,31 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! Per-worker deques; slot 0 belongs to the master
+    boost::scoped_array<CWorkerQueue> vWorkers;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of worker deques.
+    unsigned int nSlots;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of worker threads that registered (excluding the master).
+    std::atomic<unsigned int> nThreads;
+
+    //! Slot to receive the next batch added by the master.
+    unsigned int nNextAddSlot;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
 
     /**
      * Number of verifications that haven't completed yet.
-     * This includes elements that are not anymore in queue, but still in
+     * This includes elements that are not anymore in a deque, but still in
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
+
+    //! Number of verifications sitting in the deques. Can briefly go
+    //! negative while a worker takes elements the master has not counted yet.
+    std::atomic<int> nQueued;
 
     //! Whether we're shutting down.
     bool fQuit;
@@ -65,98 +119,199 @@ private:
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Whether a control session is running, since when, and whether it counts towards the statistics
+    bool fActive;
+    int64_t nStartTime;
+    bool fRecordSession;
+
+    //! Statistics of the running session, the previous one and all of them
+    CCheckQueueStats stats;
+    CCheckQueueStats statsLast;
+    CCheckQueueStats statsTotal;
+    uint64_t nSessions;
+    std::atomic<uint64_t> nSteals;
+
+    /** Move up to nMax elements from the back (or front) of a deque into vChecks */
+    static void TakeFrom(std::deque<T>& deque, std::vector<T>& vChecks, unsigned int nMax, bool fFront)
+    {
+        unsigned int nNow = std::min(nMax, (unsigned int)deque.size());
+        vChecks.resize(nNow);
+        for (unsigned int i = 0; i < nNow; i++) {
+            // Swap instead of copying to keep the deque locked as briefly as possible
+            if (fFront) {
+                vChecks[i].swap(deque.front());
+                deque.pop_front();
+            } else {
+                vChecks[i].swap(deque.back());
+                deque.pop_back();
+            }
+        }
+    }
+
+    /** Fill vChecks with a batch from our own deque or, failing that, from another worker's */
+    bool TakeWork(unsigned int nSlot, std::vector<T>& vChecks)
+    {
+        {
+            CWorkerQueue& worker = vWorkers[nSlot];
+            boost::unique_lock<boost::mutex> lock(worker.mutex);
+            if (!worker.deque.empty()) {
+                // Leave part of a large deque behind so idle workers can steal it
+                TakeFrom(worker.deque, vChecks, std::max(1U, std::min(nBatchSize, (unsigned int)worker.deque.size() / 2)), false);
+            }
+        }
+        for (unsigned int i = 1; vChecks.empty() && i < nSlots; i++) {
+            CWorkerQueue& victim = vWorkers[(nSlot + i) % nSlots];
+            boost::unique_lock<boost::mutex> lock(victim.mutex);
+            if (!victim.deque.empty()) {
+                TakeFrom(victim.deque, vChecks, std::max(1U, std::min(nBatchSize, ((unsigned int)victim.deque.size() + 1) / 2)), true);
+                nSteals++;
+            }
+        }
+        if (vChecks.empty())
+            return false;
+        nQueued -= vChecks.size();
+        return true;
+    }
+
+    /** Close the statistics of the running session. Requires the shared mutex. */
+    void FinishSession()
+    {
+        if (!fActive)
+            return;
+        int64_t nNow = GetTimeMicros();
+        for (unsigned int i = 0; i < nSlots; i++) {
+            if (vWorkers[i].nSleepStart)
+                stats.nIdleTime += nNow - std::max(vWorkers[i].nSleepStart, nStartTime);
+        }
+        stats.nWallTime = nNow - nStartTime;
+        stats.nSteals = nSteals;
+        stats.nWorkers = nThreads + 1;
+        if (fRecordSession) {
+            statsLast = stats;
+            statsTotal.Add(stats);
+            nSessions++;
+        }
+        fActive = false;
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSlot, bool fMaster = false)
     {
         boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        CWorkerQueue& worker = vWorkers[nSlot];
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master he can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
-                }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
+            if (TakeWork(nSlot, vChecks)) {
                 // Check whether we need to do work at all
-                fOk = fAllOk;
+                bool fOk = fAllOk;
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk = false;
+                unsigned int nNow = vChecks.size();
+                vChecks.clear();
+                if (nTodo.fetch_sub(nNow) == nNow) {
+                    // We processed the last element; inform the master he can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    condMaster.notify_one();
+                }
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutex);
+            if (fMaster && nTodo == 0) {
+                FinishSession();
+                bool fRet = fAllOk;
+                // reset the status for new work later
+                fAllOk = true;
+                // return the current status
+                return fRet;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
+            if (!fMaster && fQuit)
+                return false;
+            // Work is still being handed out; try again rather than sleep
+            if (nQueued > 0)
+                continue;
+            worker.nSleepStart = GetTimeMicros();
+            cond.wait(lock); // wait
+            if (fActive)
+                stats.nIdleTime += GetTimeMicros() - std::max(worker.nSleepStart, nStartTime);
+            worker.nSleepStart = 0;
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue with room for nMaxWorkersIn workers (including the master)
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nMaxWorkersIn) : vWorkers(new CWorkerQueue[std::max(1U, nMaxWorkersIn)]), nSlots(std::max(1U, nMaxWorkersIn)), nThreads(0), nNextAddSlot(0), fAllOk(true), nTodo(0), nQueued(0), fQuit(false), nBatchSize(nBatchSizeIn), fActive(false), nStartTime(0), fRecordSession(false), nSessions(0), nSteals(0) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        // Threads beyond the number of slots share a deque with an earlier one
+        unsigned int nThread = nThreads++;
+        Loop(nSlots > 1 ? 1 + nThread % (nSlots - 1) : 0);
     }
 
     //! Wait until execution finishes, and return whether all evaluations where successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
+
+        // Spread the batch over the deques of the workers that exist, in
+        // contiguous chunks, starting where the previous batch ended
+        unsigned int nActive = std::min(nSlots, (unsigned int)nThreads + 1);
+        unsigned int nChunk = (vChecks.size() + nActive - 1) / nActive;
+        unsigned int nPos = 0;
+        while (nPos < vChecks.size()) {
+            unsigned int nEnd = std::min((unsigned int)vChecks.size(), nPos + nChunk);
+            CWorkerQueue& worker = vWorkers[nNextAddSlot];
+            nNextAddSlot = (nNextAddSlot + 1) % nActive;
+            boost::unique_lock<boost::mutex> lock(worker.mutex);
+            for (; nPos < nEnd; nPos++) {
+                worker.deque.push_back(T());
+                vChecks[nPos].swap(worker.deque.back());
+            }
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nQueued += vChecks.size();
+        stats.nChecks += vChecks.size();
         if (vChecks.size() == 1)
             condWorker.notify_one();
-        else if (vChecks.size() > 1)
+        else
             condWorker.notify_all();
     }
 
+    //! Start a new control session; only recorded sessions show up in GetStats
+    void StartSession(bool fRecord)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        stats = CCheckQueueStats();
+        nSteals = 0;
+        nStartTime = GetTimeMicros();
+        fActive = true;
+        fRecordSession = fRecord;
+    }
+
+    //! Statistics of the last completed session and the totals over all of them
+    void GetStats(CCheckQueueStats& last, CCheckQueueStats& total, uint64_t& nSessionsOut)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        last = statsLast;
+        total = statsTotal;
+        nSessionsOut = nSessions;
+    }
+
     ~CCheckQueue()
     {
     }
@@ -164,11 +319,11 @@ public:
     bool IsIdle()
     {
         boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return (nTodo == 0 && nQueued == 0 && fAllOk == true);
     }
 };
 
-/** 
+/**
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
  */
@@ -180,12 +335,13 @@ private:
     bool fDone;
 
 public:
-    CCheckQueueControl(CCheckQueue<T>* pqueueIn) : pqueue(pqueueIn), fDone(false)
+    CCheckQueueControl(CCheckQueue<T>* pqueueIn, bool fRecordStats = true) : pqueue(pqueueIn), fDone(false)
     {
         // passed queue is supposed to be unused, or NULL
         if (pqueue != NULL) {
             bool isIdle = pqueue->IsIdle();
             assert(isIdle);
+            pqueue->StartSession(fRecordStats);
         }
     }
 
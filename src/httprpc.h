@@ -34,4 +34,13 @@ void InterruptREST();
  */
 void StopREST();
 
+/** Start serving network statistics to Prometheus on /metrics.
+ * Precondition; HTTP has been started.
+ */
+bool StartMetrics();
+/** Stop serving /metrics.
+ * Precondition; HTTP has been stopped.
+ */
+void StopMetrics();
+
 #endif
@@ -4,8 +4,12 @@
 
 #include "leveldbwrapper.h"
 
+#include "sync.h"
 #include "util.h"
 
+#include <algorithm>
+#include <set>
+
 #include <boost/filesystem.hpp>
 
 #include <leveldb/cache.h>
@@ -27,14 +31,49 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+/** Databases currently open, for GetLevelDBStats */
+static CCriticalSection cs_openDatabases;
+static std::set<const CLevelDBWrapper*> setOpenDatabases;
+
+/**
+ * Look up a LevelDB tuning option. A per-database setting such as
+ * -dbcompression-zerocoin takes precedence over the global -dbcompression.
+ * Values outside [nMin, nMax] are clamped.
+ */
+static int64_t GetDBArg(const std::string& strOption, const std::string& strName, int64_t nDefault, int64_t nMin, int64_t nMax)
+{
+    int64_t nValue = GetArg("-" + strOption, nDefault);
+    if (!strName.empty())
+        nValue = GetArg("-" + strOption + "-" + strName, nValue);
+    if (nValue < nMin || nValue > nMax) {
+        int64_t nClamped = std::min(std::max(nValue, nMin), nMax);
+        LogPrintf("Database %s: -%s=%d is out of range, using %d\n", strName, strOption, nValue, nClamped);
+        nValue = nClamped;
+    }
+    return nValue;
+}
+
+/** Look up a LevelDB on/off option, a bare -dbcompression means on; see GetDBArg */
+static bool GetDBBoolArg(const std::string& strOption, const std::string& strName, bool fDefault)
+{
+    bool fValue = GetBoolArg("-" + strOption, fDefault);
+    if (!strName.empty())
+        fValue = GetBoolArg("-" + strOption + "-" + strName, fValue);
+    return fValue;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const std::string& strName)
 {
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
-    options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    // up to two write buffers may be held in memory simultaneously
+    int64_t nWriteBufferDefault = std::min(std::max((int64_t)(nCacheSize / 4) >> 10, MIN_DB_WRITE_BUFFER_KB), MAX_DB_WRITE_BUFFER_KB);
+    options.write_buffer_size = (size_t)GetDBArg("dbwritebuffer", strName, nWriteBufferDefault, MIN_DB_WRITE_BUFFER_KB, MAX_DB_WRITE_BUFFER_KB) << 10;
+    options.block_size = GetDBArg("dbblocksize", strName, DEFAULT_DB_BLOCK_SIZE, MIN_DB_BLOCK_SIZE, MAX_DB_BLOCK_SIZE);
+    int nBloomBits = GetDBArg("dbbloombits", strName, DEFAULT_DB_BLOOM_BITS, 0, MAX_DB_BLOOM_BITS);
+    options.filter_policy = nBloomBits > 0 ? leveldb::NewBloomFilterPolicy(nBloomBits) : NULL;
+    options.compression = GetDBBoolArg("dbcompression", strName, DEFAULT_DB_COMPRESSION) ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = GetDBArg("dbmaxopenfiles", strName, DEFAULT_DB_MAX_OPEN_FILES, MIN_DB_MAX_OPEN_FILES, MAX_DB_MAX_OPEN_FILES);
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +82,14 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const std::string& strNameIn) : strName(strNameIn)
 {
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, strName);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -65,11 +104,18 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
     }
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
-    LogPrintf("Opened LevelDB successfully\n");
+    LogPrintf("Opened LevelDB successfully (%s)\n", GetOptionsString());
+
+    LOCK(cs_openDatabases);
+    setOpenDatabases.insert(this);
 }
 
 CLevelDBWrapper::~CLevelDBWrapper()
 {
+    {
+        LOCK(cs_openDatabases);
+        setOpenDatabases.erase(this);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -86,3 +132,47 @@ bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb
     HandleError(status);
     return true;
 }
+
+bool CLevelDBWrapper::GetProperty(const std::string& strProperty, std::string& strValue) const
+{
+    return pdb->GetProperty(strProperty, &strValue);
+}
+
+uint64_t CLevelDBWrapper::GetApproximateSize() const
+{
+    // Every key used by the node starts with a single type character
+    leveldb::Range range(leveldb::Slice("", 0), leveldb::Slice("\xff\xff", 2));
+    uint64_t nSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &nSize);
+    return nSize;
+}
+
+std::string CLevelDBWrapper::GetOptionsString() const
+{
+    return strprintf("compression=%s, block_size=%u, write_buffer_size=%u, max_open_files=%d, bloom=%s",
+        options.compression == leveldb::kSnappyCompression ? "snappy" : "none",
+        options.block_size, options.write_buffer_size, options.max_open_files,
+        options.filter_policy ? options.filter_policy->Name() : "none");
+}
+
+static bool CompareLevelDBStatsByName(const CLevelDBStats& a, const CLevelDBStats& b)
+{
+    return a.strName < b.strName;
+}
+
+void GetLevelDBStats(std::vector<CLevelDBStats>& vStats, bool fTables)
+{
+    LOCK(cs_openDatabases);
+    for (const CLevelDBWrapper* pdb : setOpenDatabases) {
+        CLevelDBStats stats;
+        stats.strName = pdb->GetName();
+        stats.strOptions = pdb->GetOptionsString();
+        stats.nApproximateSize = pdb->GetApproximateSize();
+        pdb->GetProperty("leveldb.stats", stats.strStats);
+        if (fTables)
+            pdb->GetProperty("leveldb.sstables", stats.strTables);
+        vStats.push_back(stats);
+    }
+    // The set is ordered by address, which changes from run to run
+    std::sort(vStats.begin(), vStats.end(), CompareLevelDBStatsByName);
+}
@@ -16,6 +16,20 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+//! Default LevelDB tuning, overridable per database (see GetDBArg)
+static const bool DEFAULT_DB_COMPRESSION = false;
+static const int DEFAULT_DB_BLOCK_SIZE = 4096;
+static const int DEFAULT_DB_MAX_OPEN_FILES = 64;
+static const int DEFAULT_DB_BLOOM_BITS = 10;
+//! Ranges the tuning options are clamped to
+static const int64_t MIN_DB_WRITE_BUFFER_KB = 64;
+static const int64_t MAX_DB_WRITE_BUFFER_KB = 1 << 20;
+static const int64_t MIN_DB_BLOCK_SIZE = 1024;
+static const int64_t MAX_DB_BLOCK_SIZE = 1 << 22;
+static const int64_t MIN_DB_MAX_OPEN_FILES = 16;
+static const int64_t MAX_DB_MAX_OPEN_FILES = 50000;
+static const int64_t MAX_DB_BLOOM_BITS = 64;
+
 class leveldb_error : public std::runtime_error
 {
 public:
@@ -64,6 +78,9 @@ public:
 class CLevelDBWrapper
 {
 private:
+    //! name of the database, used to look up per-database options
+    std::string strName;
+
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
 
@@ -86,9 +103,20 @@ private:
     leveldb::DB* pdb;
 
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const std::string& strNameIn = "");
     ~CLevelDBWrapper();
 
+    const std::string& GetName() const { return strName; }
+
+    //! Query one of LevelDB's internal properties, e.g. "leveldb.stats"
+    bool GetProperty(const std::string& strProperty, std::string& strValue) const;
+
+    //! Approximate on-disk size of the whole key range
+    uint64_t GetApproximateSize() const;
+
+    //! Human readable summary of the options this database was opened with
+    std::string GetOptionsString() const;
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const throw(leveldb_error)
     {
@@ -170,4 +198,16 @@ public:
     }
 };
 
+/** Snapshot of the state of one open database, see GetLevelDBStats */
+struct CLevelDBStats {
+    std::string strName;
+    std::string strOptions;
+    uint64_t nApproximateSize;
+    std::string strStats;
+    std::string strTables;
+};
+
+/** Collect statistics of every open database ordered by name, optionally including the sstable listing. */
+void GetLevelDBStats(std::vector<CLevelDBStats>& vStats, bool fTables = false);
+
 #endif // BITCOIN_LEVELDBWRAPPER_H
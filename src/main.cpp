@@ -12,10 +12,13 @@
 #include "accumulatormap.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockencodings.h"
 #include "blocksignature.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "crypto/common.h"
+#include "crypto/sha256.h"
 #include "init.h"
 #include "kernel.h"
 #include "masternode-budget.h"
@@ -25,6 +28,8 @@
 #include "net.h"
 #include "obfuscation.h"
 #include "pow.h"
+#include "random.h"
+#include "script/sigcache.h"
 #include "spork.h"
 #include "sporkdb.h"
 #include "swifttx.h"
@@ -40,12 +45,21 @@
 #include "libzerocoin/Denominations.h"
 #include "invalid.h"
 
+#include <atomic>
 #include <sstream>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace boost;
@@ -63,10 +77,11 @@ using namespace libzerocoin;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
-map<uint256, uint256> mapProofOfStake;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 map<unsigned int, unsigned int> mapHashedBlocks;
 CChain chainActive;
+/** Height of the tip of chainActive, readable without cs_main (-1 while there is no tip) */
+static std::atomic<int> nCachedTipHeight(-1);
 CBlockIndex* pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
@@ -93,11 +108,23 @@ CFeeRate minRelayTxFee = CFeeRate(10000);
 CTxMemPool mempool(::minRelayTxFee);
 
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+/** Orphans held on behalf of one peer, oldest first */
+struct COrphanPeerUsage {
+    size_t nBytes;
+    set<pair<int64_t, uint256> > setOrphans;
+
+    COrphanPeerUsage() : nBytes(0) {}
+};
+static map<NodeId, COrphanPeerUsage> mapOrphanPeerUsage;
+static set<pair<int64_t, uint256> > setOrphansByExpiry;
+static size_t nOrphanTxBytes = 0;
 map<uint256, int64_t> mapRejectedBlocks;
 map<uint256, int64_t> mapZerocoinspends; //txid, time received
 
@@ -105,6 +132,7 @@ map<uint256, int64_t> mapZerocoinspends; //txid, time received
 void EraseOrphansFor(NodeId peer);
 
 static void CheckBlockIndex();
+static bool SetStakeData(CBlockIndex* pindex, const CBlock& block, CValidationState& state);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -144,6 +172,8 @@ CBlockIndex* pindexBestInvalid;
 set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexCandidates;
 /** Number of nodes with fSyncStarted. */
 int nSyncStarted = 0;
+/** Number of nodes with fSyncStarted and fHeadersSync. */
+int nHeadersSyncStarted = 0;
 /** All pairs A->B, where A (or one if its ancestors) misses transactions, but B has transactions. */
 multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
@@ -228,12 +258,22 @@ struct CNodeState {
     CBlockIndex* pindexLastCommonBlock;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
+    //! Whether that synchronization uses "getheaders" rather than "getblocks".
+    bool fHeadersSync;
     //! Since when we're stalling block download progress (in microseconds), or 0.
     int64_t nStallingSince;
     list<QueuedBlock> vBlocksInFlight;
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer sends and accepts compact blocks.
+    bool fProvidesHeaderAndIDs;
+    //! Whether this peer wants new blocks announced as a "cmpctblock" instead of an inv.
+    bool fPreferHeaderAndIDs;
+    //! Compact blocks from this peer waiting for a "blocktxn" with their missing transactions.
+    std::map<uint256, boost::shared_ptr<PartiallyDownloadedBlock> > mapPartialBlocks;
+    //! Whether we stopped asking this peer for headers until the blocks catch up with them.
+    bool fHeadersPaused;
 
     CNodeState()
     {
@@ -244,15 +284,28 @@ struct CNodeState {
         hashLastUnknownBlock = uint256(0);
         pindexLastCommonBlock = NULL;
         fSyncStarted = false;
+        fHeadersSync = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fProvidesHeaderAndIDs = false;
+        fPreferHeaderAndIDs = false;
+        fHeadersPaused = false;
     }
 };
 
 /** Map maintaining per-node state. Requires cs_main. */
 map<NodeId, CNodeState> mapNodeState;
 
+/** Whether we download blocks from pnode after their headers, rather than from "getblocks" inventory */
+bool CanSyncHeadersFrom(const CNode* pnode)
+{
+    return Params().HeadersFirstSyncingActive() && pnode->nVersion >= HEADERS_FIRST_VERSION;
+}
+
+/** Peers we asked to announce new blocks as a "cmpctblock", least recently useful first. Requires cs_main. */
+list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
 // Requires cs_main.
 CNodeState* State(NodeId pnode)
 {
@@ -297,8 +350,10 @@ void FinalizeNode(NodeId nodeid)
     LOCK(cs_main);
     CNodeState* state = State(nodeid);
 
-    if (state->fSyncStarted)
+    if (state->fSyncStarted) {
         nSyncStarted--;
+        nHeadersSyncStarted -= state->fHeadersSync;
+    }
 
     if (state->nMisbehavior == 0 && state->fCurrentlyConnected) {
         AddressCurrentlyConnected(state->address);
@@ -308,12 +363,13 @@ void FinalizeNode(NodeId nodeid)
         mapBlocksInFlight.erase(entry.hash);
     EraseOrphansFor(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 }
 
-// Requires cs_main.
-void MarkBlockAsReceived(const uint256& hash)
+// Requires cs_main. Returns whether the block was in flight.
+bool MarkBlockAsReceived(const uint256& hash)
 {
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
     if (itInFlight != mapBlocksInFlight.end()) {
@@ -323,7 +379,9 @@ void MarkBlockAsReceived(const uint256& hash)
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
         mapBlocksInFlight.erase(itInFlight);
+        return true;
     }
+    return false;
 }
 
 // Requires cs_main.
@@ -560,13 +618,22 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = MakeTransactionRef(tx);
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
     BOOST_FOREACH (const CTxIn& txin, tx.vin)
         mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
 
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    COrphanPeerUsage& usage = mapOrphanPeerUsage[peer];
+    usage.nBytes += sz;
+    usage.setOrphans.insert(make_pair(orphan.nTimeExpire, hash));
+    setOrphansByExpiry.insert(make_pair(orphan.nTimeExpire, hash));
+    nOrphanTxBytes += sz;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+        mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTxBytes);
     return true;
 }
 
@@ -575,7 +642,7 @@ void static EraseOrphanTx(uint256 hash)
     map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
     if (it == mapOrphanTransactions.end())
         return;
-    BOOST_FOREACH (const CTxIn& txin, it->second.tx.vin) {
+    BOOST_FOREACH (const CTxIn& txin, it->second.tx->vin) {
         map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
         if (itPrev == mapOrphanTransactionsByPrev.end())
             continue;
@@ -583,28 +650,59 @@ void static EraseOrphanTx(uint256 hash)
         if (itPrev->second.empty())
             mapOrphanTransactionsByPrev.erase(itPrev);
     }
+    const COrphanTx& orphan = it->second;
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanPeerUsage.find(orphan.fromPeer);
+    if (itPeer != mapOrphanPeerUsage.end()) {
+        itPeer->second.nBytes -= orphan.nTxSize;
+        itPeer->second.setOrphans.erase(make_pair(orphan.nTimeExpire, hash));
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanPeerUsage.erase(itPeer);
+    }
+    setOrphansByExpiry.erase(make_pair(orphan.nTimeExpire, hash));
+    nOrphanTxBytes -= orphan.nTxSize;
     mapOrphanTransactions.erase(it);
 }
 
 void EraseOrphansFor(NodeId peer)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end()) {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer) {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
-        }
-    }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    map<NodeId, COrphanPeerUsage>::iterator itPeer = mapOrphanPeerUsage.find(peer);
+    if (itPeer == mapOrphanPeerUsage.end())
+        return;
+    // Copy, as erasing the peer's last orphan also erases its usage entry
+    set<pair<int64_t, uint256> > setOrphans = itPeer->second.setOrphans;
+    for (set<pair<int64_t, uint256> >::iterator it = setOrphans.begin(); it != setOrphans.end(); ++it)
+        EraseOrphanTx(it->second);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", setOrphans.size(), peer);
 }
 
 
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes)
 {
     unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans) {
+
+    // Drop orphans whose parents did not show up in time
+    int64_t nNow = GetTime();
+    while (!setOrphansByExpiry.empty() && setOrphansByExpiry.begin()->first <= nNow) {
+        EraseOrphanTx(setOrphansByExpiry.begin()->second);
+        ++nEvicted;
+    }
+
+    // A single peer may only fill its share of the pool, losing its oldest orphans first
+    unsigned int nMaxPeerOrphans = std::max(1U, nMaxOrphans / ORPHAN_TX_PEER_SHARE);
+    size_t nMaxPeerBytes = nMaxOrphanBytes / ORPHAN_TX_PEER_SHARE;
+    vector<NodeId> vPeers;
+    for (map<NodeId, COrphanPeerUsage>::iterator it = mapOrphanPeerUsage.begin(); it != mapOrphanPeerUsage.end(); ++it)
+        vPeers.push_back(it->first);
+    BOOST_FOREACH (NodeId peer, vPeers) {
+        map<NodeId, COrphanPeerUsage>::iterator itPeer;
+        while ((itPeer = mapOrphanPeerUsage.find(peer)) != mapOrphanPeerUsage.end() &&
+               (itPeer->second.setOrphans.size() > nMaxPeerOrphans || itPeer->second.nBytes > nMaxPeerBytes)) {
+            EraseOrphanTx(itPeer->second.setOrphans.begin()->second);
+            ++nEvicted;
+        }
+    }
+
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTxBytes > nMaxOrphanBytes) {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
         map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
@@ -981,6 +1079,140 @@ bool ContextualCheckZerocoinSpend(const CTransaction& tx, const CoinSpend& spend
     return true;
 }
 
+/**
+ * Cache of zerocoin spend proofs that verified, to avoid running
+ * CoinSpend::Verify twice for every spend (once when it is accepted into the
+ * memory pool, and again when its block is checked). Entries are keyed by a
+ * salted hash of the serialized spend and the accumulator value and
+ * parameters it was verified against.
+ */
+class CZerocoinSpendCache
+{
+private:
+    uint256 nonce;
+    CCuckooKeyCache setValid;
+    boost::shared_mutex cs_spendcache;
+
+public:
+    CZerocoinSpendCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void ComputeEntry(uint256& entry, const CTxIn& txin, const CBigNum& bnAccumulatorValue, bool fUseV1Params)
+    {
+        std::vector<unsigned char> vchAccumulator = bnAccumulatorValue.getvch();
+        unsigned char chParams = fUseV1Params ? 1 : 0;
+        CSHA256()
+            .Write(nonce.begin(), 32)
+            .Write(&txin.scriptSig[0], txin.scriptSig.size())
+            .Write(vchAccumulator.empty() ? NULL : &vchAccumulator[0], vchAccumulator.size())
+            .Write(&chParams, 1)
+            .Finalize(entry.begin());
+    }
+
+    bool Get(const uint256& entry)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_spendcache);
+        return setValid.Contains(entry, false);
+    }
+
+    void Set(const uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_spendcache);
+        setValid.Insert(entry);
+    }
+
+    size_t Setup(size_t nBytes)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_spendcache);
+        return setValid.Setup(nBytes);
+    }
+};
+
+static CZerocoinSpendCache zerocoinSpendCache;
+
+void InitZerocoinSpendCache()
+{
+    int64_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-zerocoinspendcachesize", DEFAULT_ZEROCOIN_SPEND_CACHE_SIZE)), MAX_MAX_SIG_CACHE_SIZE);
+    size_t nEntries = zerocoinSpendCache.Setup(nMaxCacheSize * ((size_t)1 << 20));
+    LogPrintf("Using %d MiB for the zerocoin spend cache, able to store %u elements\n", nMaxCacheSize, nEntries);
+}
+
+/**
+ * Transactions whose scripts all passed with a given set of verification flags,
+ * so that ConnectBlock does not re-run every CScriptCheck for a transaction that
+ * was already validated when it entered the mempool.
+ */
+class CScriptExecutionCache
+{
+private:
+    //! Entries are keyed by a salted hash of (transaction hash, script flags)
+    uint256 nonce;
+    CCuckooKeyCache setValid;
+    boost::shared_mutex cs_scriptcache;
+
+public:
+    CScriptExecutionCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void ComputeEntry(uint256& entry, const uint256& txHash, unsigned int flags)
+    {
+        unsigned char vchFlags[4];
+        WriteLE32(vchFlags, flags);
+        CSHA256()
+            .Write(nonce.begin(), 32)
+            .Write(txHash.begin(), 32)
+            .Write(vchFlags, sizeof(vchFlags))
+            .Finalize(entry.begin());
+    }
+
+    bool Get(const uint256& entry, bool fErase)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_scriptcache);
+        return setValid.Contains(entry, fErase);
+    }
+
+    void Set(const uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_scriptcache);
+        setValid.Insert(entry);
+    }
+
+    size_t Setup(size_t nBytes)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_scriptcache);
+        return setValid.Setup(nBytes);
+    }
+};
+
+static CScriptExecutionCache scriptExecutionCache;
+
+void InitScriptExecutionCache()
+{
+    int64_t nMaxCacheSize = std::min(std::max((int64_t)0, GetArg("-scriptexeccachesize", DEFAULT_SCRIPT_EXEC_CACHE_SIZE)), MAX_MAX_SIG_CACHE_SIZE);
+    size_t nEntries = scriptExecutionCache.Setup(nMaxCacheSize * ((size_t)1 << 20));
+    LogPrintf("Using %d MiB for the script execution cache, able to store %u elements\n", nMaxCacheSize, nEntries);
+}
+
+/** Verify a zerocoin spend proof against an accumulator value, consulting the spend cache first */
+static bool VerifyZerocoinSpend(const CTxIn& txin, const CoinSpend& spend, const CBigNum& bnAccumulatorValue, bool fUseV1Params)
+{
+    uint256 entry;
+    zerocoinSpendCache.ComputeEntry(entry, txin, bnAccumulatorValue, fUseV1Params);
+    if (zerocoinSpendCache.Get(entry))
+        return true;
+
+    Accumulator accumulator(Params().Zerocoin_Params(fUseV1Params), spend.getDenomination(), bnAccumulatorValue);
+    if (!spend.Verify(accumulator))
+        return false;
+
+    zerocoinSpendCache.Set(entry);
+    return true;
+}
+
 bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state)
 {
     //max needed non-mint outputs should be 2 - one for redemption address and a possible 2nd for change
@@ -1036,11 +1268,9 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
                 return state.DoS(100, error("%s: Zerocoinspend could not find accumulator associated with checksum %s", __func__, HexStr(BEGIN(nChecksum), END(nChecksum))));
             }
 
-            Accumulator accumulator(Params().Zerocoin_Params(chainActive.Height() < Params().Zerocoin_Block_V2_Start()),
-                                    newSpend.getDenomination(), bnAccumulatorValue);
-
             //Check that the coin has been accumulated
-            if(!newSpend.Verify(accumulator))
+            bool fUseV1Params = chainActive.Height() < Params().Zerocoin_Block_V2_Start();
+            if (!VerifyZerocoinSpend(txin, newSpend, bnAccumulatorValue, fUseV1Params))
                     return state.DoS(100, error("CheckZerocoinSpend(): zerocoin spend did not verify"));
         }
 
@@ -1061,7 +1291,7 @@ bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidati
     return fValidated;
 }
 
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state)
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fSkipZerocoinProofs)
 {
     // Basic checks that don't depend on any context
     if (tx.vin.empty())
@@ -1116,7 +1346,8 @@ bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fReject
             }
 
             // Do not require signature verification if this is initial sync and a block over 24 hours old
-            bool fVerifySignature = !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
+            // nor when the proofs were already verified, see AcceptToMemoryPoolBatch
+            bool fVerifySignature = !fSkipZerocoinProofs && !IsInitialBlockDownload() && (GetTime() - chainActive.Tip()->GetBlockTime() < (60*60*24));
             if (!CheckZerocoinSpend(tx, fVerifySignature, state))
                 return state.DoS(100, error("CheckTransaction() : invalid zerocoin spend"));
         }
@@ -1210,8 +1441,18 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
     return nMinFee;
 }
 
+/** Expire old transactions and evict the cheapest packages until the pool fits -maxmempool */
+static void LimitMempoolSize(CTxMemPool& pool)
+{
+    int nExpired = pool.Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+    if (nExpired != 0)
+        LogPrint("mempool", "Expired %i transactions from the memory pool\n", nExpired);
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+    pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+}
+
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees, int64_t nAcceptTime, bool fPrechecked)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1221,7 +1462,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     if (GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins())
         return state.DoS(10, error("AcceptToMemoryPool : Zerocoin transactions are temporarily disabled for maintenance"), REJECT_INVALID, "bad-tx");
 
-    if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), true, state))
+    if (!CheckTransaction(tx, chainActive.Height() >= Params().Zerocoin_StartHeight(), true, state, fPrechecked))
         return state.DoS(100, error("AcceptToMemoryPool: : CheckTransaction failed"), REJECT_INVALID, "bad-tx");
 
     // Coinbase is only valid in a block, not as a loose transaction
@@ -1376,7 +1617,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         if (!tx.IsZerocoinSpend())
             view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height());
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height());
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1398,6 +1639,13 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
             }
 
+            // Once the pool has been trimmed, require more than the evicted packages paid
+            CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+            if (fLimitFree && mempoolRejectFee > 0 && nFees < mempoolRejectFee && !tx.IsZerocoinSpend())
+                return state.DoS(0, error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                                        hash.ToString(), nFees, mempoolRejectFee),
+                    REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
             // Continuously rate-limit free (really, very-low-fee) transactions
             // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
             // be annoying or make others' transactions take longer to confirm.
@@ -1427,14 +1675,30 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
                 hash.ToString(),
                 nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
 
+        // Calculate in-mempool ancestors, up to a limit, so long unconfirmed
+        // chains cannot make every later mempool update walk them
+        std::set<uint256> setAncestors;
+        {
+            size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+            size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+            size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+            size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+            std::string errString;
+            LOCK(pool.cs);
+            if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+                return state.DoS(0, error("AcceptToMemoryPool : too-long-mempool-chain %s, %s", hash.ToString(), errString),
+                    REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
+        // Prechecked transactions had their scripts verified by AcceptToMemoryPoolBatch.
+        if (!CheckInputs(tx, state, view, !fPrechecked, STANDARD_SCRIPT_VERIFY_FLAGS, true)) {
             return error("AcceptToMemoryPool: : ConnectInputs failed %s", hash.ToString());
         }
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
+        // Check again against just the consensus-critical script verification
+        // flags a block enforces, in case of bugs in the standard flags that cause
         // transactions to pass as valid when they're actually invalid. For
         // instance the STRICTENC flag was incorrectly allowing certain
         // CHECKSIG NOT scripts to pass, even though they were invalid.
@@ -1442,12 +1706,28 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true)) {
-            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
+        //
+        // AcceptToMemoryPoolBatch ran prechecked transactions with these flags
+        // as well; only record the pass so ConnectBlock can skip them later.
+        if (!CheckInputs(tx, state, view, !fPrechecked, BLOCK_SCRIPT_VERIFY_FLAGS, true)) {
+            return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against block but not STANDARD flags %s", hash.ToString());
+        }
+        if (fPrechecked && !tx.IsZerocoinSpend()) {
+            uint256 hashCacheEntry;
+            scriptExecutionCache.ComputeEntry(hashCacheEntry, hash, BLOCK_SCRIPT_VERIFY_FLAGS);
+            scriptExecutionCache.Set(hashCacheEntry);
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry);
+        pool.addUnchecked(hash, entry, setAncestors);
+
+        // Transactions resurrected from disconnected blocks are trimmed
+        // after the reorg instead, see DisconnectTip
+        if (fLimitFree) {
+            LimitMempoolSize(pool);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1459,6 +1739,260 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool ignoreFees)
+{
+    return AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fRejectInsaneFee, ignoreFees, GetTime(), false);
+}
+
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128, MAX_SCRIPTCHECK_THREADS);
+/** Held by the one master of a scriptcheckqueue session: ConnectBlock or AcceptToMemoryPoolBatch */
+static CCriticalSection cs_scriptcheckqueue;
+
+/** Expensive part of admitting one transaction, done outside cs_main by AcceptToMemoryPoolBatch */
+struct CTxPrecheck
+{
+    const CTransaction* ptx;
+    std::vector<CScriptCheck> vChecks; //! with the standard flags, then again with the block flags
+    bool fReady; //! every input was available, so the checks cover the whole transaction
+    bool fValid;
+
+    CTxPrecheck() : ptx(NULL), fReady(false), fValid(false) {}
+};
+
+/** Verify the zerocoin spend proofs of tx against the accumulators they reference */
+static bool VerifyZerocoinSpendProofs(const CTransaction& tx, bool fUseV1Params)
+{
+    BOOST_FOREACH (const CTxIn& txin, tx.vin) {
+        if (!txin.scriptSig.IsZerocoinSpend())
+            continue;
+        CoinSpend spend = TxInToZerocoinSpend(txin);
+        CBigNum bnAccumulatorValue = 0;
+        if (!zerocoinDB->ReadAccumulatorValue(spend.getAccumulatorChecksum(), bnAccumulatorValue))
+            return false;
+        if (!VerifyZerocoinSpend(txin, spend, bnAccumulatorValue, fUseV1Params))
+            return false;
+    }
+    return true;
+}
+
+/** Verify the prechecks of vPrecheck one after the other on this thread */
+static void PrecheckTransactions(std::vector<CTxPrecheck>& vPrecheck, bool fUseV1Params)
+{
+    BOOST_FOREACH (CTxPrecheck& precheck, vPrecheck) {
+        if (!precheck.fReady)
+            continue;
+        if (precheck.ptx->IsZerocoinSpend()) {
+            precheck.fValid = VerifyZerocoinSpendProofs(*precheck.ptx, fUseV1Params);
+            continue;
+        }
+        precheck.fValid = true;
+        BOOST_FOREACH (CScriptCheck& check, precheck.vChecks) {
+            if (!check()) {
+                precheck.fValid = false;
+                break;
+            }
+        }
+    }
+}
+
+int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, bool fLimitFree, const std::vector<int64_t>* pvAcceptTime, std::vector<bool>* pvMissingInputs)
+{
+    vState.assign(vtx.size(), CValidationState());
+    vAccepted.assign(vtx.size(), false);
+    if (pvMissingInputs)
+        pvMissingInputs->assign(vtx.size(), false);
+    std::vector<CTxPrecheck> vPrecheck(vtx.size());
+
+    // Collect the spent outputs while holding the locks briefly. Transactions
+    // spending outputs that are not available yet (e.g. created earlier in
+    // the same batch) are left to the sequential path.
+    bool fUseV1Params;
+    {
+        LOCK2(cs_main, pool.cs);
+        fUseV1Params = chainActive.Height() < Params().Zerocoin_Block_V2_Start();
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        CCoinsViewCache view(&viewMemPool);
+        for (size_t i = 0; i < vtx.size(); i++) {
+            const CTransaction& tx = vtx[i];
+            CTxPrecheck& precheck = vPrecheck[i];
+            precheck.ptx = &tx;
+            if (tx.IsCoinBase() || tx.IsCoinStake() || pool.exists(tx.GetHash()))
+                continue;
+            precheck.fReady = true;
+            if (tx.IsZerocoinSpend())
+                continue;
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                const CCoins* coins = view.AccessCoins(tx.vin[j].prevout.hash);
+                if (!coins || !coins->IsAvailable(tx.vin[j].prevout.n)) {
+                    precheck.fReady = false;
+                    precheck.vChecks.clear();
+                    break;
+                }
+                precheck.vChecks.push_back(CScriptCheck(*coins, tx, j, STANDARD_SCRIPT_VERIFY_FLAGS, true));
+            }
+            // The block flags pass from the signature cache once the standard ones did
+            for (unsigned int j = 0; precheck.fReady && j < tx.vin.size(); j++) {
+                const CCoins* coins = view.AccessCoins(tx.vin[j].prevout.hash);
+                precheck.vChecks.push_back(CScriptCheck(*coins, tx, j, BLOCK_SCRIPT_VERIFY_FLAGS, true));
+            }
+        }
+    }
+
+    // Verify scripts on the script check threads and zerocoin proofs on this
+    // one, without holding cs_main. The queue only reports whether every
+    // check passed; when one failed, none of the batch's scripts count as
+    // verified and the full checks below find the culprit.
+    if (nScriptCheckThreads) {
+        LOCK(cs_scriptcheckqueue);
+        CCheckQueueControl<CScriptCheck> control(&scriptcheckqueue, false);
+        BOOST_FOREACH (CTxPrecheck& precheck, vPrecheck) {
+            if (precheck.fReady && !precheck.ptx->IsZerocoinSpend())
+                control.Add(precheck.vChecks);
+        }
+        BOOST_FOREACH (CTxPrecheck& precheck, vPrecheck) {
+            if (precheck.fReady && precheck.ptx->IsZerocoinSpend())
+                precheck.fValid = VerifyZerocoinSpendProofs(*precheck.ptx, fUseV1Params);
+        }
+        bool fScriptsValid = control.Wait();
+        BOOST_FOREACH (CTxPrecheck& precheck, vPrecheck) {
+            if (precheck.fReady && !precheck.ptx->IsZerocoinSpend())
+                precheck.fValid = fScriptsValid;
+        }
+    } else {
+        PrecheckTransactions(vPrecheck, fUseV1Params);
+    }
+
+    // Conflict checks and insertion, in order. Anything that failed or was
+    // not prechecked goes through the full checks, so rejections report the
+    // same state as AcceptToMemoryPool.
+    int nAccepted = 0;
+    LOCK(cs_main);
+    bool fParamsUnchanged = fUseV1Params == (chainActive.Height() < Params().Zerocoin_Block_V2_Start());
+    for (size_t i = 0; i < vtx.size(); i++) {
+        bool fPrechecked = fParamsUnchanged && vPrecheck[i].fReady && vPrecheck[i].fValid;
+        int64_t nAcceptTime = pvAcceptTime ? (*pvAcceptTime)[i] : GetTime();
+        bool fMissingInputs = false;
+        vAccepted[i] = AcceptToMemoryPoolWorker(pool, vState[i], vtx[i], fLimitFree, &fMissingInputs, false, false, nAcceptTime, fPrechecked);
+        if (pvMissingInputs)
+            (*pvMissingInputs)[i] = fMissingInputs;
+        if (vAccepted[i])
+            nAccepted++;
+    }
+    return nAccepted;
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nCount = 0, nFailed = 0, nExpired = 0, nAlready = 0;
+    std::vector<std::pair<CTransaction, int64_t> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unsupported mempool file version %u (expected %u). Continuing anyway.\n", nVersion, MEMPOOL_DUMP_VERSION);
+            return false;
+        }
+        uint64_t nNumTx;
+        filein >> nNumTx;
+        for (uint64_t i = 0; i < nNumTx; i++) {
+            CTransaction tx;
+            int64_t nTime;
+            filein >> tx >> nTime;
+            vEntries.push_back(std::make_pair(tx, nTime));
+        }
+        filein >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator it;
+    for (it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+        mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+    // Re-validate in batches, verifying each batch on the script check
+    // threads, so that cs_main is released regularly while the node is
+    // already serving peers
+    int64_t nNow = GetTime();
+    for (size_t nBatchStart = 0; nBatchStart < vEntries.size(); nBatchStart += MEMPOOL_LOAD_BATCH_SIZE) {
+        if (ShutdownRequested())
+            return false;
+        size_t nBatchEnd = std::min(vEntries.size(), nBatchStart + MEMPOOL_LOAD_BATCH_SIZE);
+        std::vector<CTransaction> vtx;
+        std::vector<int64_t> vAcceptTime;
+        for (size_t i = nBatchStart; i < nBatchEnd; i++) {
+            if (vEntries[i].second + nExpiryTimeout <= nNow) {
+                ++nExpired;
+                continue;
+            }
+            if (mempool.exists(vEntries[i].first.GetHash())) {
+                ++nAlready;
+                continue;
+            }
+            vtx.push_back(vEntries[i].first);
+            vAcceptTime.push_back(vEntries[i].second);
+        }
+        std::vector<CValidationState> vState;
+        std::vector<bool> vAccepted;
+        // Same policy as relay, so the size limit and minimum fee hold while loading
+        int nAccepted = AcceptToMemoryPoolBatch(mempool, vtx, vState, vAccepted, true, &vAcceptTime);
+        nCount += nAccepted;
+        nFailed += vtx.size() - nAccepted;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired, %i already there (%dms)\n",
+        nCount, nFailed, nExpired, nAlready, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<std::pair<CTransactionRef, int64_t> > vEntries;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    {
+        LOCK(mempool.cs);
+        mapDeltas = mempool.mapDeltas;
+        vEntries.reserve(mempool.mapTx.size());
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(std::make_pair(it->second.GetSharedTx(), it->second.GetTime()));
+    }
+
+    try {
+        boost::filesystem::path pathNew = GetDataDir() / "mempool.dat.new";
+        CAutoFile file(fopen(pathNew.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return error("%s : failed to open %s", __func__, pathNew.string());
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << (uint64_t)vEntries.size();
+        for (size_t i = 0; i < vEntries.size(); i++)
+            file << *vEntries[i].first << vEntries[i].second;
+        file << mapDeltas;
+        FileCommit(file.Get());
+        file.fclose();
+        if (!RenameOver(pathNew, GetDataDir() / "mempool.dat"))
+            return error("%s : failed to rename %s", __func__, pathNew.string());
+    } catch (const std::exception& e) {
+        return error("%s : failed to dump mempool: %s", __func__, e.what());
+    }
+    LogPrintf("Dumped mempool: %u transactions (%dms)\n", vEntries.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee, bool isDSTX)
 {
     AssertLockHeld(cs_main);
@@ -1659,6 +2193,8 @@ bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransact
 }
 
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
+static bool ReadTransactionFromDisk(CTransaction& tx, CBlockHeader& header, const CDiskTxPos& postx);
+
 bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock, bool fAllowSlow)
 {
     CBlockIndex* pindexSlow = NULL;
@@ -1673,17 +2209,9 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
         if (fTxIndex) {
             CDiskTxPos postx;
             if (pblocktree->ReadTxIndex(hash, postx)) {
-                CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-                if (file.IsNull())
-                    return error("%s: OpenBlockFile failed", __func__);
                 CBlockHeader header;
-                try {
-                    file >> header;
-                    fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                    file >> txOut;
-                } catch (std::exception& e) {
-                    return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-                }
+                if (!ReadTransactionFromDisk(txOut, header, postx))
+                    return false;
                 hashBlock = header.GetHash();
                 if (txOut.GetHash() != hash)
                     return error("%s : txid mismatch", __func__);
@@ -1710,7 +2238,8 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
     if (pindexSlow) {
         CBlock block;
         if (ReadBlockFromDisk(block, pindexSlow)) {
-            BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+            BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+                const CTransaction& tx = *ptx;
                 if (tx.GetHash() == hash) {
                     txOut = tx;
                     hashBlock = pindexSlow->GetBlockHash();
@@ -1729,6 +2258,111 @@ bool GetTransaction(const uint256& hash, CTransaction& txOut, uint256& hashBlock
 // CBlock and CBlockIndex
 //
 
+/**
+ * Read-only memory mapping of a whole blk?????.dat or rev?????.dat file.
+ * A read error on a mapped page is delivered as SIGBUS rather than as an
+ * error return, so a failing disk terminates the node instead of failing
+ * the read; run with -blockmmap=0 to read through stdio on such systems.
+ * Records beyond the size seen when the file was mapped, and records that
+ * fail to deserialize from the mapping, are read through stdio instead.
+ */
+class CMappedDiskFile
+{
+public:
+    std::string strPrefix;
+    int nFile;
+    const char* pbegin;
+    size_t nSize;
+
+    CMappedDiskFile(const std::string& strPrefixIn, int nFileIn) : strPrefix(strPrefixIn), nFile(nFileIn), pbegin(NULL), nSize(0) {}
+
+    ~CMappedDiskFile()
+    {
+#ifndef WIN32
+        if (pbegin)
+            munmap((void*)pbegin, nSize);
+#endif
+    }
+
+    bool Map(const boost::filesystem::path& path)
+    {
+#ifndef WIN32
+        int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        pbegin = (const char*)p;
+        nSize = st.st_size;
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+/** Most recently used mapped files first, at most MAX_MAPPED_BLOCK_FILES */
+static CCriticalSection cs_mappedDiskFiles;
+static std::list<boost::shared_ptr<CMappedDiskFile> > listMappedDiskFiles;
+
+/**
+ * Locate the record at pos inside a memory-mapped blk/rev file. Records are
+ * preceded by the network magic and their serialized size; nTrailer bytes
+ * following the record (the undo checksum) are included in the range.
+ * The returned mapping keeps the memory valid while it is referenced.
+ */
+static bool GetMappedDiskRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer, boost::shared_ptr<CMappedDiskFile>& pmapped, const char*& pbegin, const char*& pend)
+{
+    static const bool fBlockMmap = GetBoolArg("-blockmmap", DEFAULT_BLOCK_MMAP) && sizeof(void*) > 4;
+    if (!fBlockMmap || pos.IsNull() || pos.nPos < 8)
+        return false;
+
+    LOCK(cs_mappedDiskFiles);
+    for (int nAttempt = 0; nAttempt < 2; nAttempt++) {
+        pmapped.reset();
+        for (std::list<boost::shared_ptr<CMappedDiskFile> >::iterator it = listMappedDiskFiles.begin(); it != listMappedDiskFiles.end(); ++it) {
+            if ((*it)->nFile == pos.nFile && (*it)->strPrefix == prefix) {
+                pmapped = *it;
+                listMappedDiskFiles.erase(it);
+                break;
+            }
+        }
+        if (!pmapped) {
+            pmapped.reset(new CMappedDiskFile(prefix, pos.nFile));
+            if (!pmapped->Map(GetBlockPosFilename(pos, prefix))) {
+                pmapped.reset();
+                return false;
+            }
+        }
+        listMappedDiskFiles.push_front(pmapped);
+        if (listMappedDiskFiles.size() > MAX_MAPPED_BLOCK_FILES)
+            listMappedDiskFiles.pop_back();
+
+        if (pos.nPos <= pmapped->nSize) {
+            unsigned int nSize;
+            memcpy(&nSize, pmapped->pbegin + pos.nPos - 4, sizeof(nSize));
+            uint64_t nEnd = (uint64_t)pos.nPos + nSize + nTrailer;
+            if (nEnd <= pmapped->nSize) {
+                pbegin = pmapped->pbegin + pos.nPos;
+                pend = pmapped->pbegin + nEnd;
+                return true;
+            }
+        }
+
+        // The file has grown since it was mapped; map it again
+        listMappedDiskFiles.pop_front();
+    }
+    pmapped.reset();
+    return false;
+}
+
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
 {
     // Open history file to append
@@ -1754,16 +2388,33 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
+    boost::shared_ptr<CMappedDiskFile> pmapped;
+    const char* pbegin;
+    const char* pend;
+    bool fRead = false;
+    if (GetMappedDiskRecord(pos, "blk", 0, pmapped, pbegin, pend)) {
+        // Deserialize straight from the mapped file
+        try {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+            fRead = true;
+        } catch (std::exception& e) {
+            LogPrintf("%s : mapped read failed, retrying from file - %s\n", __func__, e.what());
+            block.SetNull();
+        }
+    }
+    if (!fRead) {
+        // Open history file to read
+        CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("ReadBlockFromDisk : OpenBlockFile failed");
 
-    // Read block
-    try {
-        filein >> block;
-    } catch (std::exception& e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        // Read block
+        try {
+            filein >> block;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Check the header
@@ -1775,17 +2426,105 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
-bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+/** Read the transaction at postx, and the header of the block containing it */
+static bool ReadTransactionFromDisk(CTransaction& tx, CBlockHeader& header, const CDiskTxPos& postx)
 {
-    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
-        return false;
-    if (block.GetHash() != pindex->GetBlockHash()) {
-        LogPrintf("%s : block=%s index=%s\n", __func__, block.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
-        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
+    boost::shared_ptr<CMappedDiskFile> pmapped;
+    const char* pbegin;
+    const char* pend;
+    if (GetMappedDiskRecord(postx, "blk", 0, pmapped, pbegin, pend)) {
+        // Deserialize straight from the mapped file
+        try {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> header;
+            reader.ignore(postx.nTxOffset);
+            reader >> tx;
+            return true;
+        } catch (std::exception& e) {
+            LogPrintf("%s : mapped read failed, retrying from file - %s\n", __func__, e.what());
+        }
+    }
+
+    CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: OpenBlockFile failed", __func__);
+    try {
+        file >> header;
+        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+        file >> tx;
+    } catch (std::exception& e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
     }
     return true;
 }
 
+/** A block kept in memory by the recent block cache */
+struct CBlockCacheEntry {
+    uint256 hash;
+    boost::shared_ptr<const CBlock> pblock;
+    size_t nSize;
+};
+
+/** Recently read or connected blocks, most recently used first, limited to -blockcachesize MiB */
+static CCriticalSection cs_blockCache;
+typedef std::list<CBlockCacheEntry> BlockCacheList;
+static BlockCacheList listBlockCache;
+static std::map<uint256, BlockCacheList::iterator> mapBlockCache;
+static size_t nBlockCacheBytes = 0;
+
+void AddToBlockCache(const CBlock& block)
+{
+    static const size_t nMaxBytes = std::max((int64_t)0, GetArg("-blockcachesize", DEFAULT_BLOCK_CACHE_SIZE)) << 20;
+    CBlockCacheEntry entry;
+    entry.nSize = ::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION);
+    if (entry.nSize > nMaxBytes / 4)
+        return;
+    entry.hash = block.GetHash();
+
+    LOCK(cs_blockCache);
+    if (mapBlockCache.count(entry.hash))
+        return;
+    entry.pblock.reset(new CBlock(block));
+    listBlockCache.push_front(entry);
+    mapBlockCache.insert(std::make_pair(entry.hash, listBlockCache.begin()));
+    nBlockCacheBytes += entry.nSize;
+    while (nBlockCacheBytes > nMaxBytes) {
+        nBlockCacheBytes -= listBlockCache.back().nSize;
+        mapBlockCache.erase(listBlockCache.back().hash);
+        listBlockCache.pop_back();
+    }
+}
+
+static bool ReadBlockFromCache(CBlock& block, const uint256& hash)
+{
+    boost::shared_ptr<const CBlock> pblock;
+    {
+        LOCK(cs_blockCache);
+        std::map<uint256, BlockCacheList::iterator>::iterator it = mapBlockCache.find(hash);
+        if (it == mapBlockCache.end())
+            return false;
+        listBlockCache.splice(listBlockCache.begin(), listBlockCache, it->second);
+        pblock = it->second->pblock;
+    }
+    // Copy outside of the lock, the cached block itself is never modified
+    block = *pblock;
+    return true;
+}
+
+bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
+{
+    if (ReadBlockFromCache(block, pindex->GetBlockHash()))
+        return true;
+    if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
+        return false;
+    if (block.GetHash() != pindex->GetBlockHash()) {
+        LogPrintf("%s : block=%s index=%s\n", __func__, block.GetHash().ToString().c_str(), pindex->GetBlockHash().ToString().c_str());
+        return error("ReadBlockFromDisk(CBlock&, CBlockIndex*) : GetHash() doesn't match index");
+    }
+    AddToBlockCache(block);
+    return true;
+}
+
 
 double ConvertBitsToDouble(unsigned int nBits)
 {
@@ -2023,7 +2762,8 @@ map<COutPoint, COutPoint> mapInvalidOutPoints;
 map<CBigNum, CAmount> mapInvalidSerials;
 void AddInvalidSpendsToMap(const CBlock& block)
 {
-    for (const CTransaction tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if (!tx.ContainsZerocoins())
             continue;
 
@@ -2150,6 +2890,13 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // A transaction already fully validated with these flags needs no script
+            // checks. Entries used while connecting a block will not be needed again.
+            uint256 hashCacheEntry;
+            scriptExecutionCache.ComputeEntry(hashCacheEntry, tx.GetHash(), flags);
+            if (scriptExecutionCache.Get(hashCacheEntry, !cacheStore))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint& prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
@@ -2183,6 +2930,10 @@ bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsVi
                     return state.DoS(100, false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            // Deferred checks have not run yet, so only record inline passes
+            if (cacheStore && !pvChecks)
+                scriptExecutionCache.Set(hashCacheEntry);
         }
     }
 
@@ -2212,7 +2963,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
-        const CTransaction& tx = block.vtx[i];
+        const CTransaction& tx = *block.vtx[i];
 
         /** UNDO ZEROCOIN DATABASING
          * note we only undo zerocoin databasing in the following statement, value to and from VELES
@@ -2354,14 +3105,17 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState& state, int nFile, CDiskBlockPos& pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck()
 {
     RenameThread("veles-scriptch");
     scriptcheckqueue.Thread();
 }
 
+void GetScriptCheckQueueStats(CCheckQueueStats& last, CCheckQueueStats& total, uint64_t& nBlocks)
+{
+    scriptcheckqueue.GetStats(last, total, nBlocks);
+}
+
 void RecalculateZVLSMinted()
 {
     CBlockIndex *pindex = chainActive[Params().Zerocoin_StartHeight()];
@@ -2444,7 +3198,8 @@ bool RecalculateVLSSupply(int nHeightStart)
 
         CAmount nValueIn = 0;
         CAmount nValueOut = 0;
-        for (const CTransaction tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 if (tx.IsCoinBase())
                     break;
@@ -2575,7 +3330,8 @@ bool UpdateZVLSSupply(const CBlock& block, CBlockIndex* pindex)
                     pwalletMain->UpdateMint(m.GetValue(), pindex->nHeight, m.GetTxHash(), m.GetDenomination());
 
                     // Add the transaction to the wallet
-                    for (auto& tx : block.vtx) {
+                    for (const CTransactionRef& ptx : block.vtx) {
+                        const CTransaction& tx = *ptx;
                         uint256 txid = tx.GetHash();
                         if (setAddedToWallet.count(txid))
                             continue;
@@ -2659,7 +3415,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                          !((pindex->nHeight == 91842 && pindex->GetBlockHash() == uint256("0x00000000000a4d0a398161ffc163c503763b1f4360639393e0e4c8e300e0caec")) ||
                              (pindex->nHeight == 91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
     if (fEnforceBIP30) {
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
             const CCoins* coins = view.AccessCoins(tx.GetHash());
             if (coins && !coins->IsPruned())
                 return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"),
@@ -2667,7 +3424,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
+    // Blocks that are only tested (TestBlockValidity) stay out of the statistics
+    LOCK(cs_scriptcheckqueue);
+    CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL, !fJustCheck);
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
@@ -2686,7 +3445,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     vector<uint256> vSpendsInBlock;
     uint256 hashBlock = block.GetHash();
     for (unsigned int i = 0; i < block.vtx.size(); i++) {
-        const CTransaction& tx = block.vtx[i];
+        const CTransaction& tx = *block.vtx[i];
 
         nInputs += tx.vin.size();
         nSigOps += GetLegacySigOpCount(tx);
@@ -2781,9 +3540,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 nFees += view.GetValueIn(tx) - tx.GetValueOut();
             nValueIn += view.GetValueIn(tx);
 
+            // Keep the cache entries of a block that is only being tested
+            // (TestBlockValidity); connecting it for real uses them up
             std::vector<CScriptCheck> vChecks;
-            unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
+            if (!CheckInputs(tx, state, view, fScriptChecks, BLOCK_SCRIPT_VERIFY_FLAGS, fJustCheck, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
         }
@@ -2843,7 +3603,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         CScript DEV_SCRIPT = GetScriptForDestination(destination);
         bool DevPaid = false;
 
-    for (const auto& output : block.vtx[(block.IsProofOfWork()?0:1)].vout) 
+    for (const auto& output : block.vtx[(block.IsProofOfWork()?0:1)]->vout) 
     if (output.scriptPubKey == DEV_SCRIPT && output.nValue == devReward) {
 	DevPaid = true;
         break;
@@ -2865,6 +3625,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int64_t nTime2 = GetTimeMicros();
     nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs - 1), nTimeVerify * 0.000001);
+    if (fScriptChecks && nScriptCheckThreads && !fJustCheck && fDebug) {
+        CCheckQueueStats statsLast, statsTotal;
+        uint64_t nBlocks;
+        scriptcheckqueue.GetStats(statsLast, statsTotal, nBlocks);
+        LogPrint("bench", "    - Script checks: %u queued on %d threads, %.2fms wall, %.2fms idle, %u steals\n",
+            statsLast.nChecks, statsLast.nWorkers, 0.001 * statsLast.nWallTime, 0.001 * statsLast.nIdleTime, statsLast.nSteals);
+    }
 
     //IMPORTANT NOTE: Nothing before this point should actually store to disk (or even memory)
     if (fJustCheck)
@@ -2902,7 +3669,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     continue;
 
                 //Search block for matching tx, turn into wtx, set merkle branch, add to wallet
-                for (CTransaction tx : block.vtx) {
+                for (const CTransactionRef& ptx : block.vtx) {
+                    const CTransaction& tx = *ptx;
                     if (tx.GetHash() == pSpend.second) {
                         CWalletTx wtx(pwalletMain, tx);
                         wtx.nTimeReceived = pindex->GetBlockTime();
@@ -2936,7 +3704,7 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Watch for changes to the previous coinbase transaction.
     static uint256 hashPrevBestCoinBase;
     GetMainSignals().UpdatedTransaction(hashPrevBestCoinBase);
-    hashPrevBestCoinBase = block.vtx[0].GetHash();
+    hashPrevBestCoinBase = block.vtx[0]->GetHash();
 
     int64_t nTime4 = GetTimeMicros();
     nTimeCallbacks += nTime4 - nTime3;
@@ -3024,10 +3792,16 @@ void FlushStateToDisk()
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+int GetCachedTipHeight()
+{
+    return nCachedTipHeight;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex* pindexNew)
 {
     chainActive.SetTip(pindexNew);
+    nCachedTipHeight = chainActive.Height();
 
     // If turned on AutoZeromint will automatically convert VLS to zVLS
     if (pwalletMain->isZeromintEnabled ())
@@ -3088,7 +3862,8 @@ bool static DisconnectTip(CValidationState& state)
     if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
         return false;
     // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         // ignore validation errors in resurrected transactions
         list<CTransaction> removed;
         CValidationState stateDummy;
@@ -3096,12 +3871,14 @@ bool static DisconnectTip(CValidationState& state)
             mempool.remove(tx, removed, true);
     }
     mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+    LimitMempoolSize(mempool);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
     UpdateTip(pindexDelete->pprev);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         SyncWithWallets(tx, NULL);
     }
     return true;
@@ -3141,7 +3918,7 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
+        bool rv = SetStakeData(pindexNew, *pblock, state) && ConnectBlock(*pblock, state, pindexNew, view, false, fAlreadyChecked);
         GetMainSignals().BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -3149,6 +3926,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
             return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(inv.hash);
+        // Peers and RPC are about to ask for the new tip
+        AddToBlockCache(*pblock);
         nTime3 = GetTimeMicros();
         nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
@@ -3180,7 +3959,8 @@ bool static ConnectTip(CValidationState& state, CBlockIndex* pindexNew, CBlock*
         SyncWithWallets(tx, NULL);
     }
     // ... and about transactions that got confirmed:
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, pblock->vtx) {
+        const CTransaction& tx = *ptx;
         SyncWithWallets(tx, pblock);
     }
 
@@ -3242,7 +4022,8 @@ bool DisconnectBlockAndInputs(CValidationState& state, CTransaction txLock)
         // Queue memory transactions to resurrect.
         // We only do this for blocks after the last checkpoint (reorganisation before that
         // point should only happen with -reindex/-loadblock, or a misbehaving peer.
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
             if (!tx.IsCoinBase()) {
                 BOOST_FOREACH (const CTxIn& in1, txLock.vin) {
                     BOOST_FOREACH (const CTxIn& in2, tx.vin) {
@@ -3460,10 +4241,30 @@ bool ActivateBestChain(CValidationState& state, CBlock* pblock, bool fAlreadyChe
             // Relay inventory, but don't relay old inventory during initial block download.
             int nBlockEstimate = Checkpoints::GetTotalBlocksEstimate();
             {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH (CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                // Peers that asked for it get the block itself right away, compacted once for all of
+                // them and serialized once per send version
+                CInv inv(MSG_BLOCK, hashNewTip);
+                bool fCompact = pblock && pblock->GetHash() == hashNewTip;
+                boost::scoped_ptr<CBlockHeaderAndShortTxIDs> pcmpctblock(fCompact ? new CBlockHeaderAndShortTxIDs(*pblock) : NULL);
+                std::map<int, CSerializedNetMsg> mapCmpctBlockMsgs;
+                LOCK2(cs_main, cs_vNodes);
+                BOOST_FOREACH (CNode* pnode, vNodes) {
+                    if (chainActive.Height() <= (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
+                        continue;
+                    CNodeState* nodestate = State(pnode->GetId());
+                    if (fCompact && nodestate && nodestate->fPreferHeaderAndIDs) {
+                        LOCK(pnode->cs_inventory);
+                        if (!pnode->filterInventoryKnown.contains(CNode::InventoryKnownKey(inv))) {
+                            pnode->filterInventoryKnown.insert(CNode::InventoryKnownKey(inv));
+                            int nSendVersion = pnode->GetSendVersion();
+                            CSerializedNetMsg& msg = mapCmpctBlockMsgs[nSendVersion];
+                            if (!msg)
+                                msg = CreateNetMessage(nSendVersion, "cmpctblock", *pcmpctblock);
+                            pnode->PushSharedMessage(msg);
+                        }
+                    } else
+                        pnode->PushInventory(inv);
+                }
             }
             // Notify external listeners about the new tip.
             // Note: uiInterface, should switch main signals.
@@ -3558,6 +4359,30 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex* pindex)
     return true;
 }
 
+/** Compute the stake modifier of pindex, whose proof-of-stake fields and ancestors' stake modifiers are set */
+static void ComputeStakeModifier(CBlockIndex* pindex)
+{
+    // ppcoin: compute stake modifier
+    uint64_t nStakeModifier = 0;
+    bool fGeneratedStakeModifier = false;
+    if (!ComputeNextStakeModifier(pindex->pprev, nStakeModifier, fGeneratedStakeModifier))
+        LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
+    pindex->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
+    pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+    if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+        LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindex->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+}
+
+/**
+ * Whether the proof-of-stake fields and stake modifier of pindex are set. For
+ * blocks after the proof-of-work period this takes the block itself and all
+ * its ancestors, the proof-of-stake flag is only set once they were.
+ */
+static bool HasStakeData(const CBlockIndex* pindex)
+{
+    return pindex->nHeight <= Params().LAST_POW_BLOCK() || pindex->IsProofOfStake();
+}
+
 CBlockIndex* AddToBlockIndex(const CBlock& block)
 {
     // Check for duplicate
@@ -3575,9 +4400,12 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
     pindexNew->nSequenceId = 0;
     BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
 
-    //mark as PoS seen
-    if (pindexNew->IsProofOfStake())
-        setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+    // The proof-of-stake fields need the full block and those of all its
+    // ancestors, which with headers-first download may arrive long after the
+    // header; SetStakeData fills them in.
+    pindexNew->nFlags &= ~CBlockIndex::BLOCK_PROOF_OF_STAKE;
+    pindexNew->prevoutStake.SetNull();
+    pindexNew->nStakeTime = 0;
 
     pindexNew->phashBlock = &((*mi).first);
     BlockMap::iterator miPrev = mapBlockIndex.find(block.hashPrevBlock);
@@ -3589,29 +4417,13 @@ CBlockIndex* AddToBlockIndex(const CBlock& block)
         //update previous block pointer
         pindexNew->pprev->pnext = pindexNew;
 
-        // ppcoin: compute chain trust score
-        pindexNew->bnChainTrust = (pindexNew->pprev ? pindexNew->pprev->bnChainTrust : 0) + pindexNew->GetBlockTrust();
-
         // ppcoin: compute stake entropy bit for stake modifier
         if (!pindexNew->SetStakeEntropyBit(pindexNew->GetStakeEntropyBit()))
             LogPrintf("AddToBlockIndex() : SetStakeEntropyBit() failed \n");
 
-        // ppcoin: record proof-of-stake hash value
-        if (pindexNew->IsProofOfStake()) {
-            if (!mapProofOfStake.count(hash))
-                LogPrintf("AddToBlockIndex() : hashProofOfStake not found in map \n");
-            pindexNew->hashProofOfStake = mapProofOfStake[hash];
-        }
-
-        // ppcoin: compute stake modifier
-        uint64_t nStakeModifier = 0;
-        bool fGeneratedStakeModifier = false;
-        if (!ComputeNextStakeModifier(pindexNew->pprev, nStakeModifier, fGeneratedStakeModifier))
-            LogPrintf("AddToBlockIndex() : ComputeNextStakeModifier() failed \n");
-        pindexNew->SetStakeModifier(nStakeModifier, fGeneratedStakeModifier);
-        pindexNew->nStakeModifierChecksum = GetStakeModifierChecksum(pindexNew);
-        if (!CheckStakeModifierCheckpoints(pindexNew->nHeight, pindexNew->nStakeModifierChecksum))
-            LogPrintf("AddToBlockIndex() : Rejected by stake modifier checkpoint height=%d, modifier=%s \n", pindexNew->nHeight, boost::lexical_cast<std::string>(nStakeModifier));
+        // Proof-of-work blocks only need their header for the stake modifier
+        if (pindexNew->nHeight <= Params().LAST_POW_BLOCK())
+            ComputeStakeModifier(pindexNew);
     }
     pindexNew->nChainWork = (pindexNew->pprev ? pindexNew->pprev->nChainWork : 0) + GetBlockProof(*pindexNew);
     pindexNew->RaiseValidity(BLOCK_VALID_TREE);
@@ -3816,30 +4628,31 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
             REJECT_INVALID, "bad-blk-length");
 
     // First transaction must be coinbase, the rest must not be
-    if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
+    if (block.vtx.empty() || !block.vtx[0]->IsCoinBase())
         return state.DoS(100, error("CheckBlock() : first tx is not coinbase"),
             REJECT_INVALID, "bad-cb-missing");
     for (unsigned int i = 1; i < block.vtx.size(); i++)
-        if (block.vtx[i].IsCoinBase())
+        if (block.vtx[i]->IsCoinBase())
             return state.DoS(100, error("CheckBlock() : more than one coinbase"),
                 REJECT_INVALID, "bad-cb-multiple");
 
     if (block.IsProofOfStake()) {
         // Coinbase output should be empty if proof-of-stake block
-        if (block.vtx[0].vout.size() != 1 || !block.vtx[0].vout[0].IsEmpty())
+        if (block.vtx[0]->vout.size() != 1 || !block.vtx[0]->vout[0].IsEmpty())
             return state.DoS(100, error("CheckBlock() : coinbase output not empty for proof-of-stake block"));
 
         // Second transaction must be coinstake, the rest must not be
-        if (block.vtx.empty() || !block.vtx[1].IsCoinStake())
+        if (block.vtx.empty() || !block.vtx[1]->IsCoinStake())
             return state.DoS(100, error("CheckBlock() : second tx is not coinstake"));
         for (unsigned int i = 2; i < block.vtx.size(); i++)
-            if (block.vtx[i].IsCoinStake())
+            if (block.vtx[i]->IsCoinStake())
                 return state.DoS(100, error("CheckBlock() : more than one coinstake"));
     }
 
     // ----------- swiftTX transaction scanning -----------
     if (IsSporkActive(SPORK_3_SWIFTTX_BLOCK_FILTERING)) {
-        BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+        BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+            const CTransaction& tx = *ptx;
             if (!tx.IsCoinBase()) {
                 //only reject blocks when it's based on complete consensus
                 BOOST_FOREACH (const CTxIn& in, tx.vin) {
@@ -3891,7 +4704,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     // Check transactions
     bool fZerocoinActive = block.GetBlockTime() > Params().Zerocoin_StartTime();
     vector<CBigNum> vBlockSerials;
-    for (const CTransaction& tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if (!CheckTransaction(tx, fZerocoinActive, chainActive.Height() + 1 >= Params().Zerocoin_Block_EnforceSerialRange(), state))
             return error("CheckBlock() : CheckTransaction failed");
 
@@ -3911,7 +4725,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
 
 
     unsigned int nSigOps = 0;
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         nSigOps += GetLegacySigOpCount(tx);
     }
     unsigned int nMaxBlockSigOps = fZerocoinActive ? MAX_BLOCK_SIGOPS_CURRENT : MAX_BLOCK_SIGOPS_LEGACY;
@@ -4025,8 +4840,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const int nHeight = pindexPrev == NULL ? 0 : pindexPrev->nHeight + 1;
 
     // Check that all transactions are finalized
-    BOOST_FOREACH (const CTransaction& tx, block.vtx)
-        if (!IsFinalTx(tx, nHeight, block.GetBlockTime())) {
+    BOOST_FOREACH (const CTransactionRef& ptx, block.vtx)
+        if (!IsFinalTx(*ptx, nHeight, block.GetBlockTime())) {
             return state.DoS(10, error("%s : contains a non-final transaction", __func__), REJECT_INVALID, "bad-txns-nonfinal");
         }
 
@@ -4035,8 +4850,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     /*if (block.nVersion >= 2 &&
         CBlockIndex::IsSuperMajority(2, pindexPrev, Params().EnforceBlockUpgradeMajority())) {
         CScript expect = CScript() << nHeight;
-        if (block.vtx[0].vin[0].scriptSig.size() < expect.size() ||
-            !std::equal(expect.begin(), expect.end(), block.vtx[0].vin[0].scriptSig.begin())) {
+        if (block.vtx[0]->vin[0].scriptSig.size() < expect.size() ||
+            !std::equal(expect.begin(), expect.end(), block.vtx[0]->vin[0].scriptSig.begin())) {
             return state.DoS(100, error("%s : block height mismatch in coinbase", __func__), REJECT_INVALID, "bad-cb-height");
         }
     }*/
@@ -4096,6 +4911,11 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     if (!ContextualCheckBlockHeader(block, state, pindexPrev))
         return false;
 
+    // AcceptBlock already checked a full block's difficulty, do so for headers alone
+    if (block.vtx.empty() && pindexPrev && !CheckWork(block, pindexPrev))
+        return state.DoS(50, error("%s : incorrect difficulty for header %s", __func__, hash.ToString()),
+            REJECT_INVALID, "bad-diffbits");
+
     if (pindex == NULL)
         pindex = AddToBlockIndex(block);
 
@@ -4105,6 +4925,27 @@ bool AcceptBlockHeader(const CBlock& block, CValidationState& state, CBlockIndex
     return true;
 }
 
+/**
+ * Whether a header received on its own from the sync peer may be indexed ahead of its block. Unlike
+ * the proof-of-stake of later headers, which only the block can prove, the proof-of-work of headers
+ * in the proof-of-work period is checked in full, and the chain has to contain the last checkpoint.
+ * Requires cs_main.
+ */
+static bool CheckHeaderFromPeer(const CBlockHeader& header, const CBlockIndex* pindexPrev, CValidationState& state)
+{
+    int nHeight = pindexPrev->nHeight + 1;
+    if (nHeight <= Params().LAST_POW_BLOCK() && !CheckProofOfWork(header.GetHash(), header.nBits))
+        return state.DoS(50, error("%s : proof of work failed for header %s", __func__, header.GetHash().ToString()),
+            REJECT_INVALID, "high-hash");
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint();
+    if (pcheckpoint && nHeight > pcheckpoint->nHeight && pindexPrev->GetAncestor(pcheckpoint->nHeight) != pcheckpoint)
+        return state.DoS(100, error("%s : header %s does not connect to the last checkpoint", __func__, header.GetHash().ToString()),
+            REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    return true;
+}
+
 bool ContextualCheckZerocoinStake(int nHeight, CStakeInput* stake)
 {
     if (nHeight < Params().Zerocoin_Block_V2_Start())
@@ -4130,7 +4971,46 @@ bool ContextualCheckZerocoinStake(int nHeight, CStakeInput* stake)
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock)
+/**
+ * Check the stake of block and fill in the proof-of-stake fields of its index
+ * entry pindex, once those of its parent are known. Blocks downloaded ahead of
+ * their parent get here when they are connected. Requires cs_main.
+ */
+static bool SetStakeData(CBlockIndex* pindex, const CBlock& block, CValidationState& state)
+{
+    if (HasStakeData(pindex))
+        return true;
+    assert(pindex->pprev && HasStakeData(pindex->pprev));
+
+    if (!block.IsProofOfStake())
+        return state.DoS(100, error("%s : PoW period ended", __func__),
+            REJECT_INVALID, "PoW-ended");
+
+    uint256 hashProofOfStake = 0;
+    unique_ptr<CStakeInput> stake;
+
+    if (!CheckProofOfStake(block, hashProofOfStake, stake))
+        return state.DoS(100, error("%s: proof of stake check failed", __func__));
+
+    if (!stake)
+        return error("%s: null stake ptr", __func__);
+
+    if (stake->IsZVLS() && !ContextualCheckZerocoinStake(pindex->pprev->nHeight, stake.get()))
+        return state.DoS(100, error("%s: staked zVLS fails context checks", __func__));
+
+    pindex->SetProofOfStake();
+    pindex->prevoutStake = block.vtx[1]->vin[0].prevout;
+    pindex->nStakeTime = block.nTime;
+    pindex->hashProofOfStake = hashProofOfStake;
+    ComputeStakeModifier(pindex);
+    setDirtyBlockIndex.insert(pindex);
+
+    //mark as PoS seen
+    setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+    return true;
+}
+
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyCheckedBlock, bool fRequested)
 {
     AssertLockHeld(cs_main);
 
@@ -4159,27 +5039,16 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         }
     }
 
+    // The stake of a block whose parent has no stake data yet is only checked once it gets
+    // connected, so only blocks we asked for within the download window may be stored before
+    if (pindexPrev && !HasStakeData(pindexPrev) && !fRequested && dbp == NULL) {
+        LogPrint("net", "%s : not storing unrequested block %s ahead of its stake data\n", __func__, block.GetHash().ToString());
+        return true;
+    }
+
     if (block.GetHash() != Params().HashGenesisBlock() && !CheckWork(block, pindexPrev))
         return false;
 
-    if (block.IsProofOfStake()) {
-        uint256 hashProofOfStake = 0;
-        unique_ptr<CStakeInput> stake;
-
-        if (!CheckProofOfStake(block, hashProofOfStake, stake))
-            return state.DoS(100, error("%s: proof of stake check failed", __func__));
-
-        if (!stake)
-            return error("%s: null stake ptr", __func__);
-
-        if (stake->IsZVLS() && !ContextualCheckZerocoinStake(pindexPrev->nHeight, stake.get()))
-            return state.DoS(100, error("%s: staked zVLS fails context checks", __func__));
-
-        uint256 hash = block.GetHash();
-        if(!mapProofOfStake.count(hash)) // add to mapProofOfStake
-            mapProofOfStake.insert(make_pair(hash, hashProofOfStake));
-    }
-
     if (!AcceptBlockHeader(block, state, &pindex))
         return false;
 
@@ -4189,6 +5058,15 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
+    // The stake of a block that arrived ahead of its parent is checked when it gets connected
+    if (pindex->pprev && HasStakeData(pindex->pprev) && !SetStakeData(pindex, block, state)) {
+        if (state.IsInvalid() && !state.CorruptionPossible()) {
+            pindex->nStatus |= BLOCK_FAILED_VALID;
+            setDirtyBlockIndex.insert(pindex);
+        }
+        return false;
+    }
+
     if ((!fAlreadyCheckedBlock && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
@@ -4288,7 +5166,8 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
 
     int nMints = 0;
     int nSpends = 0;
-    for (const CTransaction tx : pblock->vtx) {
+    for (const CTransactionRef& ptx : pblock->vtx) {
+        const CTransaction& tx = *ptx;
         if (tx.ContainsZerocoins()) {
             for (const CTxIn in : tx.vin) {
                 if (in.scriptSig.IsZerocoinSpend())
@@ -4318,14 +5197,15 @@ bool ProcessNewBlock(CValidationState& state, CNode* pfrom, CBlock* pblock, CDis
     {
         LOCK(cs_main);   // Replaces the former TRY_LOCK loop because busy waiting wastes too much resources
 
-        MarkBlockAsReceived (pblock->GetHash ());
+        // Blocks we mined or loaded ourselves count as requested
+        bool fRequested = MarkBlockAsReceived(pblock->GetHash()) || pfrom == NULL;
         if (!checked) {
             return error ("%s : CheckBlock FAILED for block %s", __func__, pblock->GetHash().GetHex());
         }
 
         // Store to disk
         CBlockIndex* pindex = NULL;
-        bool ret = AcceptBlock (*pblock, state, &pindex, dbp, checked);
+        bool ret = AcceptBlock (*pblock, state, &pindex, dbp, checked, fRequested);
         if (pindex && pfrom) {
             mapBlockSource[pindex->GetBlockHash ()] = pfrom->GetId ();
         }
@@ -4478,7 +5358,8 @@ bool static LoadBlockIndexDB(string& strError)
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainWork
+    // Calculate nChainWork, skip pointers, stake modifier checksums and the set
+    // of referenced blk files in one pass by height
     vector<pair<int, CBlockIndex*> > vSortedByHeight;
     vSortedByHeight.reserve(mapBlockIndex.size());
     for (const PAIRTYPE(uint256, CBlockIndex*) & item : mapBlockIndex) {
@@ -4486,10 +5367,12 @@ bool static LoadBlockIndexDB(string& strError)
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    set<int> setBlkDataFiles;
     BOOST_FOREACH (const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
         CBlockIndex* pindex = item.second;
         pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
         if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            setBlkDataFiles.insert(pindex->nFile);
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -4507,6 +5390,12 @@ bool static LoadBlockIndexDB(string& strError)
             pindexBestInvalid = pindex;
         if (pindex->pprev)
             pindex->BuildSkip();
+        if (pindex->pprev || pindex->GetBlockHash() == Params().HashGenesisBlock()) {
+            // The checksum is not stored, chain it again from the parent
+            pindex->nStakeModifierChecksum = GetStakeModifierChecksum(pindex);
+            if (!CheckStakeModifierCheckpoints(pindex->nHeight, pindex->nStakeModifierChecksum))
+                LogPrintf("%s : Failed stake modifier checkpoint height=%d, modifier=%s\n", __func__, pindex->nHeight, boost::lexical_cast<std::string>(pindex->nStakeModifier));
+        }
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
@@ -4530,13 +5419,6 @@ bool static LoadBlockIndexDB(string& strError)
 
     // Check presence of blk files
     LogPrintf("Checking all blk files are present...\n");
-    set<int> setBlkDataFiles;
-    for (const PAIRTYPE(uint256, CBlockIndex*) & item : mapBlockIndex) {
-        CBlockIndex* pindex = item.second;
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
-            setBlkDataFiles.insert(pindex->nFile);
-        }
-    }
     for (std::set<int>::iterator it = setBlkDataFiles.begin(); it != setBlkDataFiles.end(); it++) {
         CDiskBlockPos pos(*it, 0);
         if (CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION).IsNull()) {
@@ -4566,6 +5448,7 @@ bool static LoadBlockIndexDB(string& strError)
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    nCachedTipHeight = chainActive.Height();
 
     PruneBlockIndexCandidates();
 
@@ -4669,6 +5552,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
+    nCachedTipHeight = -1;
     pindexBestInvalid = NULL;
 }
 
@@ -5086,6 +5970,63 @@ bool static AlreadyHave(const CInv& inv)
 }
 
 
+/**
+ * Recently sent getdata responses, serialized once and queued by reference to
+ * every peer asking for the same inventory; most peers ask for a new block or
+ * masternode broadcast within moments of each other. Keyed by the send version
+ * the response was serialized with, as peers on older protocol versions need
+ * their own serialization. Protected by cs_main.
+ */
+typedef std::pair<int, CInv> SharedResponseKey;
+static std::map<SharedResponseKey, CSerializedNetMsg> mapSharedResponses;
+static std::deque<std::pair<int64_t, SharedResponseKey> > vSharedResponsesExpiration;
+static size_t nSharedResponsesSize = 0;
+
+/** Drop the shared responses that expired or exceed the size limit */
+static void LimitSharedResponses()
+{
+    int64_t nNow = GetTime();
+    while (!vSharedResponsesExpiration.empty() &&
+           (vSharedResponsesExpiration.front().first < nNow || nSharedResponsesSize > MAX_SHARED_RESPONSES_SIZE)) {
+        std::map<SharedResponseKey, CSerializedNetMsg>::iterator it = mapSharedResponses.find(vSharedResponsesExpiration.front().second);
+        nSharedResponsesSize -= it->second->size();
+        mapSharedResponses.erase(it);
+        vSharedResponsesExpiration.pop_front();
+    }
+}
+
+static CSerializedNetMsg FindSharedResponse(int nVersion, const CInv& inv)
+{
+    LimitSharedResponses();
+    std::map<SharedResponseKey, CSerializedNetMsg>::const_iterator it = mapSharedResponses.find(std::make_pair(nVersion, inv));
+    if (it == mapSharedResponses.end())
+        return CSerializedNetMsg();
+    return it->second;
+}
+
+static void AddSharedResponse(int nVersion, const CInv& inv, const CSerializedNetMsg& msg)
+{
+    SharedResponseKey key(nVersion, inv);
+    if (!mapSharedResponses.insert(std::make_pair(key, msg)).second)
+        return;
+    nSharedResponsesSize += msg->size();
+    vSharedResponsesExpiration.push_back(std::make_pair(GetTime() + SHARED_RESPONSE_EXPIRY, key));
+    LimitSharedResponses();
+}
+
+/** The shared response for inv, serializing obj as a pszCommand message for pto if there is none yet */
+template <typename T>
+static CSerializedNetMsg GetSharedResponse(CNode* pto, const CInv& inv, const char* pszCommand, const T& obj)
+{
+    int nVersion = pto->GetSendVersion();
+    CSerializedNetMsg msg = FindSharedResponse(nVersion, inv);
+    if (!msg) {
+        msg = CreateNetMessage(nVersion, pszCommand, obj);
+        AddSharedResponse(nVersion, inv, msg);
+    }
+    return msg;
+}
+
 void static ProcessGetData(CNode* pfrom)
 {
     std::deque<CInv>::iterator it = pfrom->vRecvGetData.begin();
@@ -5104,7 +6045,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK) {
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK) {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end()) {
@@ -5123,13 +6064,27 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 // Don't send not-validated blocks
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA)) {
-                    // Send block from disk
+                    // Older blocks are sent in full, the peer's mempool is unlikely to have their transactions
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK && chainActive.Height() - mi->second->nHeight <= MAX_CMPCTBLOCK_DEPTH;
+                    CInv invShared(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, inv.hash);
+                    // Send block from disk, unless another peer just asked for it
+                    int nSendVersion = pfrom->GetSendVersion();
+                    CSerializedNetMsg msg;
+                    if (inv.type != MSG_FILTERED_BLOCK)
+                        msg = FindSharedResponse(nSendVersion, invShared);
                     CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
+                    if (!msg && !ReadBlockFromDisk(block, (*mi).second))
                         assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    if (inv.type != MSG_FILTERED_BLOCK) {
+                        if (!msg) {
+                            if (fCompact)
+                                msg = CreateNetMessage(nSendVersion, "cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                            else
+                                msg = CreateNetMessage(nSendVersion, "block", block);
+                            AddSharedResponse(nSendVersion, invShared, msg);
+                        }
+                        pfrom->PushSharedMessage(msg);
+                    } else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter) {
@@ -5140,11 +6095,11 @@ void static ProcessGetData(CNode* pfrom)
                             // Note that there is currently no way for a node to request any single transactions we didnt send here -
                             // they must either disconnect and retry or request the full block.
                             // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
+                            // however we MUST always provide at least what the remote peer needs. Known
+                            // inventory is only tracked approximately, so send all of them.
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH (PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                                pfrom->PushMessage("tx", *block.vtx[pair.first]);
                         }
                         // else
                         // no response
@@ -5164,117 +6119,83 @@ void static ProcessGetData(CNode* pfrom)
             } else if (inv.IsKnownType()) {
                 // Send stream from relay memory
                 bool pushed = false;
-                {
-                    LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                    if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
-                        pushed = true;
+                if (inv.type == MSG_TX) {
+                    CTransactionRef ptx;
+                    {
+                        LOCK(cs_mapRelay);
+                        map<uint256, CTransactionRef>::iterator mi = mapRelay.find(inv.hash);
+                        if (mi != mapRelay.end())
+                            ptx = mi->second;
                     }
-                }
-
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << tx;
-                        pfrom->PushMessage("tx", ss);
+                    if (!ptx)
+                        ptx = mempool.get(inv.hash);
+                    if (ptx) {
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "tx", *ptx));
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_VOTE) {
                     if (mapTxLockVote.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockVote[inv.hash];
-                        pfrom->PushMessage("txlvote", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "txlvote", mapTxLockVote[inv.hash]));
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_TXLOCK_REQUEST) {
                     if (mapTxLockReq.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapTxLockReq[inv.hash];
-                        pfrom->PushMessage("ix", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "ix", mapTxLockReq[inv.hash]));
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_SPORK) {
                     if (mapSporks.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mapSporks[inv.hash];
-                        pfrom->PushMessage("spork", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "spork", mapSporks[inv.hash]));
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_MASTERNODE_WINNER) {
                     if (masternodePayments.mapMasternodePayeeVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << masternodePayments.mapMasternodePayeeVotes[inv.hash];
-                        pfrom->PushMessage("mnw", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "mnw", masternodePayments.mapMasternodePayeeVotes[inv.hash]));
                         pushed = true;
                     }
                 }
                 if (!pushed && inv.type == MSG_BUDGET_VOTE) {
                     if (budget.mapSeenMasternodeBudgetVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetVotes[inv.hash];
-                        pfrom->PushMessage("mvote", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "mvote", budget.mapSeenMasternodeBudgetVotes[inv.hash]));
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_PROPOSAL) {
                     if (budget.mapSeenMasternodeBudgetProposals.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenMasternodeBudgetProposals[inv.hash];
-                        pfrom->PushMessage("mprop", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "mprop", budget.mapSeenMasternodeBudgetProposals[inv.hash]));
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED_VOTE) {
                     if (budget.mapSeenFinalizedBudgetVotes.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgetVotes[inv.hash];
-                        pfrom->PushMessage("fbvote", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "fbvote", budget.mapSeenFinalizedBudgetVotes[inv.hash]));
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_BUDGET_FINALIZED) {
                     if (budget.mapSeenFinalizedBudgets.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << budget.mapSeenFinalizedBudgets[inv.hash];
-                        pfrom->PushMessage("fbs", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "fbs", budget.mapSeenFinalizedBudgets[inv.hash]));
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_ANNOUNCE) {
                     if (mnodeman.mapSeenMasternodeBroadcast.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodeBroadcast[inv.hash];
-                        pfrom->PushMessage("mnb", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "mnb", mnodeman.mapSeenMasternodeBroadcast[inv.hash]));
                         pushed = true;
                     }
                 }
 
                 if (!pushed && inv.type == MSG_MASTERNODE_PING) {
                     if (mnodeman.mapSeenMasternodePing.count(inv.hash)) {
-                        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                        ss.reserve(1000);
-                        ss << mnodeman.mapSeenMasternodePing[inv.hash];
-                        pfrom->PushMessage("mnp", ss);
+                        pfrom->PushSharedMessage(GetSharedResponse(pfrom, inv, "mnp", mnodeman.mapSeenMasternodePing[inv.hash]));
                         pushed = true;
                     }
                 }
@@ -5299,7 +6220,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5319,6 +6240,137 @@ void static ProcessGetData(CNode* pfrom)
 }
 
 bool fRequestedSporksIDB = false;
+/**
+ * Try to accept the orphans that spend the transactions in vWorkQueue, one
+ * generation at a time. Each generation is verified as a batch on the script
+ * check threads rather than one transaction after another, and without
+ * holding cs_main, so the caller must not hold it either.
+ */
+static void ProcessOrphanTxs(vector<uint256>& vWorkQueue)
+{
+    set<NodeId> setMisbehaving;
+    while (!vWorkQueue.empty()) {
+        // Collect the next generation under cs_main, which guards the orphan maps
+        vector<CTransaction> vtx;
+        vector<NodeId> vFromPeer;
+        {
+            LOCK(cs_main);
+            set<uint256> setGeneration;
+            BOOST_FOREACH (const uint256& hash, vWorkQueue) {
+                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(hash);
+                if (itByPrev != mapOrphanTransactionsByPrev.end())
+                    setGeneration.insert(itByPrev->second.begin(), itByPrev->second.end());
+            }
+            BOOST_FOREACH (const uint256& orphanHash, setGeneration) {
+                map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+                if (itOrphan == mapOrphanTransactions.end() || setMisbehaving.count(itOrphan->second.fromPeer))
+                    continue;
+                vtx.push_back(*itOrphan->second.tx);
+                vFromPeer.push_back(itOrphan->second.fromPeer);
+            }
+        }
+        vWorkQueue.clear();
+        if (vtx.empty())
+            break;
+
+        // Verify them on the script check threads; the batch only takes cs_main
+        // to look up their inputs and to add them to the mempool.
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        vector<CValidationState> vStateDummy;
+        vector<bool> vAccepted, vMissingInputs;
+        AcceptToMemoryPoolBatch(mempool, vtx, vStateDummy, vAccepted, true, NULL, &vMissingInputs);
+
+        LOCK(cs_main);
+        for (size_t i = 0; i < vtx.size(); i++) {
+            const uint256& orphanHash = vtx[i].GetHash();
+            if (vAccepted[i]) {
+                LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+                RelayTransaction(vtx[i]);
+                vWorkQueue.push_back(orphanHash);
+                EraseOrphanTx(orphanHash);
+            } else if (!vMissingInputs[i]) {
+                int nDos = 0;
+                if (vStateDummy[i].IsInvalid(nDos) && nDos > 0 && !setMisbehaving.count(vFromPeer[i])) {
+                    // Punish peer that gave us an invalid orphan tx
+                    Misbehaving(vFromPeer[i], nDos);
+                    setMisbehaving.insert(vFromPeer[i]);
+                    LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+                }
+                // Has inputs but not accepted to mempool
+                // Probably non-standard or insufficient fee/priority
+                LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                EraseOrphanTx(orphanHash);
+            }
+        }
+        mempool.check(pcoinsTip);
+    }
+}
+
+/**
+ * Ask pfrom, which just gave us our new tip, to announce new blocks as a
+ * "cmpctblock" without waiting for a getdata. Only the MAX_HB_CMPCTBLOCK_PEERS
+ * peers that did so most recently are asked. Requires cs_main.
+ */
+static void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNode* pfrom)
+{
+    NodeId nodeid = pfrom->GetId();
+    if (!State(nodeid)->fProvidesHeaderAndIDs)
+        return;
+    BOOST_FOREACH (NodeId nodeidAnnouncing, lNodesAnnouncingHeaderAndIDs) {
+        if (nodeidAnnouncing == nodeid) {
+            lNodesAnnouncingHeaderAndIDs.remove(nodeid);
+            lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+            return;
+        }
+    }
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCTBLOCK_PEERS) {
+        NodeId nodeidOldest = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeidOldest) {
+                pnode->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+                break;
+            }
+        }
+    }
+    pfrom->PushMessage("sendcmpct", true, CMPCTBLOCKS_VERSION);
+    lNodesAnnouncingHeaderAndIDs.push_back(nodeid);
+}
+
+/** Whether we have the block with this hash in full, not just its header */
+static bool AlreadyHaveBlock(const uint256& hash)
+{
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    return mi != mapBlockIndex.end() && (mi->second->nStatus & BLOCK_HAVE_DATA);
+}
+
+/** Process a block we didn't have yet, sent by pfrom in full or reconstructed from a compact block */
+static void ProcessReceivedBlock(CNode* pfrom, CBlock& block, const std::string& strCommand)
+{
+    uint256 hashBlock = block.GetHash();
+    CValidationState state;
+    ProcessNewBlock(state, pfrom, &block);
+    int nDoS;
+    if(state.IsInvalid(nDoS)) {
+        pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                           state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hashBlock);
+        if(nDoS > 0) {
+            TRY_LOCK(cs_main, lockMain);
+            if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
+        }
+    } else {
+        LOCK(cs_main);
+        if (chainActive.Tip()->GetBlockHash() == hashBlock)
+            MaybeSetPeerAsAnnouncingHeaderAndIDs(pfrom);
+    }
+    //disconnect this node if its old protocol version
+    pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -5464,6 +6516,22 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we understand compact blocks, without asking it to push them to us yet
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION)
+            pfrom->PushMessage("sendcmpct", false, CMPCTBLOCKS_VERSION);
+    }
+
+
+    else if (strCommand == "sendcmpct") {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -5496,7 +6564,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnowns of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -5559,9 +6627,19 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (inv.type == MSG_BLOCK) {
                 UpdateBlockAvailability(pfrom->GetId(), inv.hash);
                 if (!fAlreadyHave && !fImporting && !fReindex && !mapBlocksInFlight.count(inv.hash)) {
-                    // Add this to the list of blocks to request
-                    vToFetch.push_back(inv);
-                    LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    if (CanSyncHeadersFrom(pfrom) && IsInitialBlockDownload()) {
+                        // Catch up on the headers instead, the blocks are then downloaded from all peers.
+                        // Only the sync peer is asked, the others' announcements just tell us they have the block
+                        CNodeState* nodestate = State(pfrom->GetId());
+                        if (nodestate->fSyncStarted && nodestate->fHeadersSync && !nodestate->fHeadersPaused) {
+                            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
+                            LogPrint("net", "getheaders (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                        }
+                    } else {
+                        // Add this to the list of blocks to request
+                        vToFetch.push_back(inv);
+                        LogPrint("net", "getblocks (%d) %s to peer=%d\n", pindexBestHeader->nHeight, inv.hash.ToString(), pfrom->id);
+                    }
                 }
             }
 
@@ -5574,8 +6652,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        if (!vToFetch.empty())
+        if (!vToFetch.empty()) {
+            // A single new block is most likely the tip, which the peer can send as a compact block
+            if (vToFetch.size() == 1 && State(pfrom->GetId())->fProvidesHeaderAndIDs && !IsInitialBlockDownload()) {
+                vToFetch[0].type = MSG_CMPCT_BLOCK;
+                // Lets the "cmpctblock" answer be told apart from an unsolicited one
+                MarkBlockAsInFlight(pfrom->GetId(), vToFetch[0].hash);
+            }
             pfrom->PushMessage("getdata", vToFetch);
+        }
     }
 
 
@@ -5599,7 +6684,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "getblocks" || strCommand == "getheaders") {
+    else if (strCommand == "getblocks") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5631,7 +6716,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "headers" && Params().HeadersFirstSyncingActive()) {
+    else if (strCommand == "getheaders") {
         CBlockLocator locator;
         uint256 hashStop;
         vRecv >> locator >> hashStop;
@@ -5671,7 +6756,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
     else if (strCommand == "tx" || strCommand == "dstx") {
         vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
 
         //masternode signed transaction
@@ -5723,107 +6807,69 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        LOCK(cs_main);
+        {
+            LOCK(cs_main);
 
-        bool fMissingInputs = false;
-        bool fMissingZerocoinInputs = false;
-        CValidationState state;
-
-        mapAlreadyAskedFor.erase(inv);
-
-        if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
-
-            LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for(unsigned int i = 0; i < vWorkQueue.size(); i++) {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if(itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for(set<uint256>::iterator mi = itByPrev->second.begin();
-                    mi != itByPrev->second.end();
-                    ++mi) {
-                    const uint256 &orphanHash = *mi;
-                    const CTransaction &orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if(setMisbehaving.count(fromPeer))
-                        continue;
-                    if(AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2)) {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
-                    } else if(!fMissingInputs2) {
-                        int nDos = 0;
-                        if(stateDummy.IsInvalid(nDos) && nDos > 0) {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // Has inputs but not accepted to mempool
-                        // Probably non-standard or insufficient fee/priority
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
-                    }
-                    mempool.check(pcoinsTip);
-                }
+            bool fMissingInputs = false;
+            bool fMissingZerocoinInputs = false;
+            CValidationState state;
+
+            mapAlreadyAskedFor.erase(inv);
+
+            if (!tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs, false, ignoreFees)) {
+                mempool.check(pcoinsTip);
+                RelayTransaction(tx);
+                vWorkQueue.push_back(inv.hash);
+
+                LogPrint("mempool", "AcceptToMemoryPool: peer=%d %s : accepted %s (poolsz %u)\n",
+                         pfrom->id, pfrom->cleanSubVer,
+                         tx.GetHash().ToString(),
+                         mempool.mapTx.size());
+            } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
+                //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
+                //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
+                RelayTransaction(tx);
+                LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
+                         pfrom->id, pfrom->cleanSubVer,
+                         tx.GetHash().ToString(),
+                         mempool.mapTx.size());
+            } else if (fMissingInputs) {
+                AddOrphanTx(tx, pfrom->GetId());
+
+                // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+                unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
+                size_t nMaxOrphanBytes = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TX_SIZE)) * 1000;
+                unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanBytes);
+                if (nEvicted > 0)
+                    LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+            } else if (pfrom->fWhitelisted) {
+                // Always relay transactions received from whitelisted peers, even
+                // if they are already in the mempool (allowing the node to function
+                // as a gateway for nodes hidden behind it).
+
+                RelayTransaction(tx);
             }
 
-            BOOST_FOREACH (uint256 hash, vEraseQueue)EraseOrphanTx(hash);
-        } else if (tx.IsZerocoinSpend() && AcceptToMemoryPool(mempool, state, tx, true, &fMissingZerocoinInputs, false, ignoreFees)) {
-            //Presstab: ZCoin has a bunch of code commented out here. Is this something that should have more going on?
-            //Also there is nothing that handles fMissingZerocoinInputs. Does there need to be?
-            RelayTransaction(tx);
-            LogPrint("mempool", "AcceptToMemoryPool: Zerocoinspend peer=%d %s : accepted %s (poolsz %u)\n",
-                     pfrom->id, pfrom->cleanSubVer,
-                     tx.GetHash().ToString(),
-                     mempool.mapTx.size());
-        } else if (fMissingInputs) {
-            AddOrphanTx(tx, pfrom->GetId());
-
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
-
-            RelayTransaction(tx);
-        }
-
-        if (strCommand == "dstx") {
-            CInv inv(MSG_DSTX, tx.GetHash());
-            RelayInv(inv);
-        }
-
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS)) {
-            LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
-                pfrom->id, pfrom->cleanSubVer,
-                state.GetRejectReason());
-            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-            if (nDoS > 0)
-                Misbehaving(pfrom->GetId(), nDoS);
+            if (strCommand == "dstx") {
+                CInv inv(MSG_DSTX, tx.GetHash());
+                RelayInv(inv);
+            }
+
+            int nDoS = 0;
+            if (state.IsInvalid(nDoS)) {
+                LogPrint("mempool", "%s from peer=%d %s was not accepted into the memory pool: %s\n", tx.GetHash().ToString(),
+                    pfrom->id, pfrom->cleanSubVer,
+                    state.GetRejectReason());
+                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                    state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+            }
         }
+
+        // Process any orphan transactions that depended on this one; they are
+        // verified without holding cs_main
+        ProcessOrphanTxs(vWorkQueue);
     }
 
 
@@ -5850,6 +6896,18 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // Nothing interesting. Stop asking this peers for more headers.
             return true;
         }
+
+        // Headers are only indexed from the peer we sync them from, and have to extend what we know
+        CNodeState* nodestate = State(pfrom->GetId());
+        if (!nodestate->fSyncStarted || !nodestate->fHeadersSync) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("unsolicited headers from peer=%d", pfrom->id);
+        }
+        if (!mapBlockIndex.count(headers[0].hashPrevBlock)) {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("unconnected headers from peer=%d", pfrom->id);
+        }
+
         CBlockIndex* pindexLast = NULL;
         BOOST_FOREACH (const CBlockHeader& header, headers) {
             CValidationState state;
@@ -5858,9 +6916,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 return error("non-continuous headers sequence");
             }
 
-            /*TODO: this has a CBlock cast on it so that it will compile. There should be a solution for this
-             * before headers are reimplemented on mainnet
-             */
+            if (!mapBlockIndex.count(header.GetHash())) {
+                CBlockIndex* pindexPrev = mapBlockIndex[header.hashPrevBlock];
+                // Proof-of-stake headers can't be checked before their blocks, so only index a bounded
+                // number of them ahead of the active chain and ask for more once the blocks caught up
+                if (pindexPrev->nHeight >= Params().LAST_POW_BLOCK() &&
+                    pindexPrev->nHeight >= chainActive.Height() + MAX_HEADERS_AHEAD_OF_TIP) {
+                    LogPrint("net", "pausing headers sync at %d with peer=%d\n", pindexPrev->nHeight, pfrom->id);
+                    nodestate->fHeadersPaused = true;
+                    break;
+                }
+                if (!CheckHeaderFromPeer(header, pindexPrev, state)) {
+                    int nDoS = 0;
+                    if (state.IsInvalid(nDoS) && nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    std::string strError = "invalid header received " + header.GetHash().ToString();
+                    return error(strError.c_str());
+                }
+            }
+
+            // Without its transactions, the block is indexed without proof-of-stake
+            // fields; those are filled in once the block itself arrives
             if (!AcceptBlockHeader((CBlock)header, state, &pindexLast)) {
                 int nDoS;
                 if (state.IsInvalid(nDoS)) {
@@ -5875,7 +6951,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (pindexLast)
             UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (nCount == MAX_HEADERS_RESULTS && pindexLast && !nodestate->fHeadersPaused) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -5908,24 +6984,177 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         } else {
             pfrom->AddInventoryKnown(inv);
 
+            if (!AlreadyHaveBlock(hashBlock)) {
+                ProcessReceivedBlock(pfrom, block, strCommand);
+            } else {
+                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+            }
+        }
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+        CInv inv(MSG_BLOCK, hashBlock);
+        LogPrint("net", "received cmpctblock %s peer=%d\n", inv.hash.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(inv);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            if (AlreadyHaveBlock(hashBlock))
+                return true;
+
+            // Only blocks we asked this peer for, or that a peer we chose to announce new blocks
+            // compactly sends, are worth reconstructing; anything else is taken as an announcement
+            NodeId nodeid = pfrom->GetId();
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hashBlock);
+            bool fInFlight = itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid;
+            bool fHighBandwidth = std::find(lNodesAnnouncingHeaderAndIDs.begin(), lNodesAnnouncingHeaderAndIDs.end(), nodeid) != lNodesAnnouncingHeaderAndIDs.end();
+            if (!fInFlight && !fHighBandwidth) {
+                LogPrint("net", "Peer %d sent us an unrequested compact block %s\n", pfrom->id, hashBlock.ToString());
+                UpdateBlockAvailability(nodeid, hashBlock);
+                if (itInFlight == mapBlocksInFlight.end()) {
+                    MarkBlockAsInFlight(nodeid, hashBlock);
+                    pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_CMPCT_BLOCK, hashBlock)));
+                }
+                return true;
+            }
+
+            // A block we can't connect yet goes through the full block path, which catches up
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            // Check the header (version, difficulty, reorganization depth) before spending any
+            // work on the transactions
             CValidationState state;
-            if (!mapBlockIndex.count(block.GetHash())) {
-                ProcessNewBlock(state, pfrom, &block);
+            CBlockIndex* pindex = NULL;
+            if (!AcceptBlockHeader((CBlock)cmpctblock.header, state, &pindex)) {
                 int nDoS;
-                if(state.IsInvalid(nDoS)) {
-                    pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
-                                       state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), inv.hash);
-                    if(nDoS > 0) {
-                        TRY_LOCK(cs_main, lockMain);
-                        if(lockMain) Misbehaving(pfrom->GetId(), nDoS);
-                    }
+                if (state.IsInvalid(nDoS) && nDoS > 0) {
+                    Misbehaving(nodeid, nDoS);
+                    LogPrintf("Peer %d sent us an invalid compact block header %s\n", pfrom->id, hashBlock.ToString());
                 }
-                //disconnect this node if its old protocol version
-                pfrom->DisconnectOldProtocol(ActiveProtocol(), strCommand);
-            } else {
-                LogPrint("net", "%s : Already processed block %s, skipping ProcessNewBlock()\n", __func__, block.GetHash().GetHex());
+                return true;
+            }
+
+            // Orphans may well be in the block, their parents only arriving with it
+            vector<CTransactionRef> vOrphans;
+            vOrphans.reserve(mapOrphanTransactions.size());
+            for (map<uint256, COrphanTx>::iterator mi = mapOrphanTransactions.begin(); mi != mapOrphanTransactions.end(); ++mi)
+                vOrphans.push_back(mi->second.tx);
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock, vOrphans);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            for (size_t i = 0; i < partialBlock->BlockTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                CNodeState* nodestate = State(pfrom->GetId());
+                if (nodestate->mapPartialBlocks.size() >= MAX_PARTIAL_BLOCKS_PER_PEER && !nodestate->mapPartialBlocks.count(hashBlock))
+                    nodestate->mapPartialBlocks.erase(nodestate->mapPartialBlocks.begin());
+                nodestate->mapPartialBlocks[hashBlock] = partialBlock;
+                req.blockhash = hashBlock;
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            if (partialBlock->FillBlock(block, vector<CTransaction>()) != READ_STATUS_OK) {
+                // Most likely a short ID matched the wrong transaction
+                pfrom->PushMessage("getdata", vector<CInv>(1, inv));
+                return true;
+            }
+        }
+        ProcessReceivedBlock(pfrom, block, strCommand);
+    }
+
+
+    else if (strCommand == "getblocktxn") {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        // Serving transactions of old or side chain blocks is not worth it, send those like a getdata would
+        if (!chainActive.Contains(mi->second) || chainActive.Height() - mi->second->nHeight > MAX_BLOCKTXN_DEPTH) {
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
             }
+            resp.txn[i] = *block.vtx[req.indexes[i]];
         }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+        LogPrint("net", "received blocktxn %s (%u txn) peer=%d\n", resp.blockhash.ToString(), resp.txn.size(), pfrom->id);
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+            CNodeState* nodestate = State(pfrom->GetId());
+            std::map<uint256, boost::shared_ptr<PartiallyDownloadedBlock> >::iterator mi = nodestate->mapPartialBlocks.find(resp.blockhash);
+            if (mi == nodestate->mapPartialBlocks.end()) {
+                LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+                return true;
+            }
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock = mi->second;
+            nodestate->mapPartialBlocks.erase(mi);
+
+            ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+            if (status == READ_STATUS_INVALID) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+                return true;
+            } else if (status == READ_STATUS_FAILED) {
+                // Most likely a short ID matched the wrong transaction, fall back to the full block
+                pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+                return true;
+            }
+
+            // Received in full from somewhere else in the meantime
+            if (AlreadyHaveBlock(resp.blockhash))
+                return true;
+        }
+        ProcessReceivedBlock(pfrom, block, strCommand);
     }
 
 
@@ -5950,10 +7179,9 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<CInv> vInv;
         BOOST_FOREACH (uint256& hash, vtxid) {
             CInv inv(MSG_TX, hash);
-            CTransaction tx;
-            bool fInMemPool = mempool.lookup(hash, tx);
-            if (!fInMemPool) continue; // another thread removed since queryHashes, maybe...
-            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(tx)) ||
+            CTransactionRef ptx = mempool.get(hash);
+            if (!ptx) continue; // another thread removed since queryHashes, maybe...
+            if ((pfrom->pfilter && pfrom->pfilter->IsRelevantAndUpdate(*ptx)) ||
                 (!pfrom->pfilter))
                 vInv.push_back(inv);
             if (vInv.size() == MAX_INV_SZ) {
@@ -6179,6 +7407,45 @@ int ActiveProtocol()
     return MIN_PEER_PROTO_VERSION_BEFORE_ENFORCEMENT;
 }
 
+/**
+ * Peers are spread over several message handler threads (-msghandlerthreads).
+ * Messages that touch chain state, and SendMessages, stay serialized with each
+ * other on cs_chainMessages. The masternode, budget, spork, SwiftX and
+ * obfuscation families only serialize among themselves on cs_extensionMessages,
+ * so they are not held up while another thread validates a block; the few of
+ * their handlers that do need cs_main take it themselves. Ping and pong only
+ * touch the peer they came from.
+ *
+ * inv, getdata and dstx read and write the maps of those families too (through
+ * AlreadyHave and ProcessGetData), so they hold both locks, cs_chainMessages
+ * first. cs_main is always taken after these.
+ */
+static CCriticalSection cs_chainMessages;
+static CCriticalSection cs_extensionMessages;
+
+/** Whether a chain message also needs cs_extensionMessages */
+static bool UsesExtensionState(const std::string& strCommand)
+{
+    return strCommand == "inv" || strCommand == "getdata" || strCommand == "dstx";
+}
+
+/** The lock a message must be processed under, or NULL if it needs none */
+static CCriticalSection* GetMessageLock(const std::string& strCommand)
+{
+    static const char* const pszChainCommands[] = {
+        "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders", "tx", "dstx",
+        "headers", "block", "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn", "getaddr",
+        "mempool", "alert", "filterload", "filteradd", "filterclear", "reject"};
+
+    if (strCommand == "ping" || strCommand == "pong")
+        return NULL;
+    BOOST_FOREACH (const char* pszCommand, pszChainCommands) {
+        if (strCommand == pszCommand)
+            return &cs_chainMessages;
+    }
+    return &cs_extensionMessages;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -6195,8 +7462,10 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        LOCK2(cs_chainMessages, cs_extensionMessages);
         ProcessGetData(pfrom);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -6253,8 +7522,21 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nProcessStart = GetTimeMicros();
         try {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            CCriticalSection* pcsMessage = GetMessageLock(strCommand);
+            if (pcsMessage == &cs_chainMessages && UsesExtensionState(strCommand)) {
+                LOCK2(cs_chainMessages, cs_extensionMessages);
+                nProcessStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else if (pcsMessage) {
+                LOCK(*pcsMessage);
+                // Don't count the wait for the lock as processing time
+                nProcessStart = GetTimeMicros();
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            } else {
+                fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            }
             boost::this_thread::interruption_point();
         } catch (std::ios_base::failure& e) {
             pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
@@ -6275,6 +7557,8 @@ bool ProcessMessages(CNode* pfrom)
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
 
+        pfrom->RecordProcessedMessage(SanitizeString(strCommand), nMessageSize + CMessageHeader::HEADER_SIZE, GetTimeMicros() - nProcessStart);
+
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED peer=%d\n", SanitizeString(strCommand), nMessageSize, pfrom->id);
 
@@ -6282,14 +7566,17 @@ bool ProcessMessages(CNode* pfrom)
     }
 
     // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
+    if (!pfrom->fDisconnect) {
+        for (std::deque<CNetMessage>::iterator itDone = pfrom->vRecvMsg.begin(); itDone != it; itDone++)
+            recvBufferPool.Release(itDone->vRecv);
         pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+    }
 
     return fOk;
 }
 
 
-bool SendMessages(CNode* pto, bool fSendTrickle)
+bool SendMessages(CNode* pto)
 {
     {
         // Don't send anything until we get their version message
@@ -6325,6 +7612,15 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
         }
 
+        // Never wait here: the caller holds cs_vSend, which message processing takes after this lock
+        TRY_LOCK(cs_chainMessages, lockMessages);
+        if (!lockMessages)
+            return true;
+        // Only needed to look up the masternode, budget, spork and SwiftX
+        // items we'd ask for; those requests wait if an extension message is
+        // being processed
+        TRY_LOCK(cs_extensionMessages, lockExtension);
+
         TRY_LOCK(cs_main, lockMain); // Acquire cs_main for IsInitialBlockDownload() and CNodeState()
         if (!lockMain)
             return true;
@@ -6334,9 +7630,9 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (!IsInitialBlockDownload() && (GetTime() - nLastRebroadcast > 24 * 60 * 60)) {
             LOCK(cs_vNodes);
             BOOST_FOREACH (CNode* pnode, vNodes) {
-                // Periodically clear setAddrKnown to allow refresh broadcasts
+                // Periodically clear addrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
-                    pnode->setAddrKnown.clear();
+                    pnode->addrKnown.reset();
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -6348,12 +7644,14 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: addr
         //
-        if (fSendTrickle) {
+        int64_t nNow = GetTimeMicros();
+        if (pto->nNextAddrSend < nNow) {
+            pto->nNextAddrSend = PoissonNextSend(nNow, AVG_ADDRESS_BROADCAST_INTERVAL);
             vector<CAddress> vAddr;
             vAddr.reserve(pto->vAddrToSend.size());
             BOOST_FOREACH (const CAddress& addr, pto->vAddrToSend) {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second) {
+                if (!pto->addrKnown.contains(addr.GetKey())) {
+                    pto->addrKnown.insert(addr.GetKey());
                     vAddr.push_back(addr);
                     // receiver rejects addr messages larger than 1000
                     if (vAddr.size() >= 1000) {
@@ -6392,16 +7690,32 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         bool fFetch = state.fPreferredDownload || (nPreferredDownload == 0 && !pto->fClient && !pto->fOneShot); // Download if this is a nice peer, or we have no nice peers and this one might do.
         if (!state.fSyncStarted && !pto->fClient && fFetch /*&& !fImporting*/ && !fReindex) {
             // Only actively request headers from a single peer, unless we're close to end of initial download.
-            if (nSyncStarted == 0 || pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
+            // A peer that can send headers takes over from one that can only send inventory, as the blocks
+            // are then downloaded from all peers in parallel.
+            bool fHeadersSync = CanSyncHeadersFrom(pto);
+            if (nSyncStarted == 0 || (fHeadersSync && nHeadersSyncStarted == 0) ||
+                pindexBestHeader->GetBlockTime() > GetAdjustedTime() - 6 * 60 * 60) { // NOTE: was "close to today" and 24h in Bitcoin
                 state.fSyncStarted = true;
+                state.fHeadersSync = fHeadersSync;
                 nSyncStarted++;
-                //CBlockIndex *pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
-                //LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
-                //pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
-                pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
+                nHeadersSyncStarted += fHeadersSync;
+                if (fHeadersSync) {
+                    // Start from the parent of our best header so the peer's reply tells us it has that one
+                    CBlockIndex* pindexStart = pindexBestHeader->pprev ? pindexBestHeader->pprev : pindexBestHeader;
+                    LogPrint("net", "initial getheaders (%d) to peer=%d (startheight:%d)\n", pindexStart->nHeight, pto->id, pto->nStartingHeight);
+                    pto->PushMessage("getheaders", chainActive.GetLocator(pindexStart), uint256(0));
+                } else
+                    pto->PushMessage("getblocks", chainActive.GetLocator(chainActive.Tip()), uint256(0));
             }
         }
 
+        // Resume a paused headers sync once the active chain is halfway to the best header
+        if (state.fHeadersPaused && pindexBestHeader->nHeight < chainActive.Height() + MAX_HEADERS_AHEAD_OF_TIP / 2) {
+            state.fHeadersPaused = false;
+            LogPrint("net", "resuming headers sync (%d) with peer=%d\n", pindexBestHeader->nHeight, pto->id);
+            pto->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+        }
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -6412,48 +7726,23 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: inventory
         //
+        // Blocks and instantx locks are announced right away. Everything else
+        // is collected until the peer's Poisson timer fires and then goes out
+        // in as few inv messages as possible, at most a fixed number of items
+        // per type each time; the rest waits for the next timer.
+        bool fSendTrickle = pto->fWhitelisted;
+        if (pto->nNextInvSend < nNow) {
+            fSendTrickle = true;
+            pto->nNextInvSend = PoissonNextSend(nNow, pto->fInbound ? INVENTORY_BROADCAST_INTERVAL : INVENTORY_BROADCAST_INTERVAL >> 1);
+        }
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
-        {
-            LOCK(pto->cs_inventory);
-            vInv.reserve(pto->vInventoryToSend.size());
-            vInvWait.reserve(pto->vInventoryToSend.size());
-            BOOST_FOREACH (const CInv& inv, pto->vInventoryToSend) {
-                if (pto->setInventoryKnown.count(inv))
-                    continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle) {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
-
-                    if (fTrickleWait) {
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second) {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000) {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
-                }
-            }
-            pto->vInventoryToSend = vInvWait;
+        pto->GetInventoryToSend(fSendTrickle, vInv);
+        for (size_t nStart = 0; nStart < vInv.size(); nStart += MAX_INV_SZ) {
+            vector<CInv> vInvMsg(vInv.begin() + nStart, vInv.begin() + std::min(vInv.size(), nStart + MAX_INV_SZ));
+            pto->PushMessage("inv", vInvMsg);
         }
-        if (!vInv.empty())
-            pto->PushMessage("inv", vInv);
 
         // Detect whether we're stalling
-        int64_t nNow = GetTimeMicros();
         if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
             // Stalling only triggers when the block download window cannot move. During normal steady state,
             // the download window should be much larger than the to-be-downloaded set of blocks, so disconnection
@@ -6496,7 +7785,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         // Message: getdata (non-blocks)
         //
-        while (!pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
+        while (lockExtension && !pto->fDisconnect && !pto->mapAskFor.empty() && (*pto->mapAskFor.begin()).first <= nNow) {
             const CInv& inv = (*pto->mapAskFor.begin()).second;
             if (!AlreadyHave(inv)) {
                 if (fDebug)
@@ -6545,18 +7834,36 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos& pos, const uint256& hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-    // Read block
     uint256 hashChecksum;
-    try {
-        filein >> *this;
-        filein >> hashChecksum;
-    } catch (std::exception& e) {
-        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    boost::shared_ptr<CMappedDiskFile> pmapped;
+    const char* pbegin;
+    const char* pend;
+    bool fRead = false;
+    if (GetMappedDiskRecord(pos, "rev", sizeof(hashChecksum), pmapped, pbegin, pend)) {
+        // Deserialize straight from the mapped file
+        try {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> *this;
+            reader >> hashChecksum;
+            fRead = true;
+        } catch (std::exception& e) {
+            LogPrintf("%s : mapped read failed, retrying from file - %s\n", __func__, e.what());
+            vtxundo.clear();
+        }
+    }
+    if (!fRead) {
+        // Open history file to read
+        CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+
+        // Read block
+        try {
+            filein >> *this;
+            filein >> hashChecksum;
+        } catch (std::exception& e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
     }
 
     // Verify checksum
@@ -55,6 +55,7 @@ class CValidationInterface;
 class CValidationState;
 
 struct CBlockTemplate;
+struct CCheckQueueStats;
 struct CNodeStateStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -75,14 +76,48 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS_CURRENT = MAX_BLOCK_SIGOPS_CURRENT / 5;
 static const unsigned int MAX_TX_SIGOPS_LEGACY = MAX_BLOCK_SIGOPS_LEGACY / 5;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -persistmempool, save the mempool on shutdown and load it on restart */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Number of transactions re-validated per cs_main acquisition when loading mempool.dat */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 100;
+/** Default for -zerocoinspendcachesize, memory in MiB for verified zerocoin spend proofs */
+static const int64_t DEFAULT_ZEROCOIN_SPEND_CACHE_SIZE = 4;
+/** Default for -scriptexeccachesize, memory in MiB for transactions whose scripts passed with given flags */
+static const int64_t DEFAULT_SCRIPT_EXEC_CACHE_SIZE = 4;
+/** Script verification flags enforced by ConnectBlock */
+static const unsigned int BLOCK_SCRIPT_VERIFY_FLAGS = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum kilobytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TX_SIZE = 250;
+/** A single peer may use at most 1/n of the orphan transaction limits */
+static const unsigned int ORPHAN_TX_PEER_SHARE = 4;
+/** Expiration time for orphan transactions in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
 static const unsigned int BLOCKFILE_CHUNK_SIZE = 0x1000000; // 16 MiB
 /** The pre-allocation chunk size for rev?????.dat files (since 0.8) */
 static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
+/** Maximum number of blk/rev files kept memory-mapped for reading */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 16;
+/** Default for -blockmmap, read blocks, indexed transactions and undo data through memory-mapped files */
+static const bool DEFAULT_BLOCK_MMAP = true;
+/** Default for -blockcachesize, memory budget in MiB for recently read and connected blocks */
+static const int64_t DEFAULT_BLOCK_CACHE_SIZE = 32;
 /** Coinbase transaction outputs can only be spent after this number of new blocks (network rule) */
 static const int COINBASE_MATURITY = 100;
 /** Threshold for nLockTime: below this value it is interpreted as block number, otherwise as UNIX timestamp. */
@@ -95,9 +130,26 @@ static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
 static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Seconds a serialized getdata response stays available to other peers asking for the same inventory */
+static const int64_t SHARED_RESPONSE_EXPIRY = 60;
+/** Maximum total size in bytes of the shared getdata responses */
+static const size_t MAX_SHARED_RESPONSES_SIZE = 8 * 1000 * 1000;
+/** Version of the compact block relay ("sendcmpct") we speak */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Maximum depth below the tip at which a block is still served as a "cmpctblock" */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth below the tip at which "getblocktxn" requests are still answered */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Number of peers asked to announce new blocks straight away as a "cmpctblock" */
+static const unsigned int MAX_HB_CMPCTBLOCK_PEERS = 3;
+/** Maximum number of compact blocks per peer waiting for their missing transactions */
+static const unsigned int MAX_PARTIAL_BLOCKS_PER_PEER = 3;
 /** Number of headers sent in one getheaders result. We rely on the assumption that if a peer sends
  *  less than this number, we reached their tip. Changing this value is a protocol upgrade. */
 static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** How far beyond the active chain proof-of-stake headers are indexed ahead of their blocks. Their
+ *  stake can only be checked once the blocks arrive, so this bounds what a peer can make us index. */
+static const int MAX_HEADERS_AHEAD_OF_TIP = 4 * MAX_HEADERS_RESULTS;
 /** Size of the "block download window": how far ahead of our current height do we fetch?
  *  Larger windows tolerate larger download speed differences between peer, but increase the potential
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
@@ -215,12 +267,17 @@ bool ProcessMessages(CNode* pfrom);
 /**
  * Send queued protocol messages to be sent to a give node.
  *
+ * Addresses and inventory that isn't urgent are announced on per-peer Poisson timers.
+ *
  * @param[in]   pto             The node which we are sending messages to.
- * @param[in]   fSendTrickle    When true send the trickled data, otherwise trickle the data until true.
  */
-bool SendMessages(CNode* pto, bool fSendTrickle);
+bool SendMessages(CNode* pto);
+/** Height of the active chain's tip without taking cs_main, for handlers that only need an estimate */
+int GetCachedTipHeight();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Script check queue statistics for the last connected block and totals over all blocks */
+void GetScriptCheckQueueStats(CCheckQueueStats& last, CCheckQueueStats& total, uint64_t& nBlocks);
 
 // ***TODO*** probably not the right place for these 2
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
@@ -259,6 +316,19 @@ void FlushStateToDisk();
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool ignoreFees = false);
 
+/**
+ * Add a batch of transactions to the memory pool, as AcceptToMemoryPool would
+ * one by one. Script and zerocoin proof verification runs on up to -par
+ * threads without holding cs_main. Returns the number of transactions accepted.
+ * If pvMissingInputs is given, it flags the transactions rejected for missing inputs.
+ */
+int AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, bool fLimitFree, const std::vector<int64_t>* pvAcceptTime = NULL, std::vector<bool>* pvMissingInputs = NULL);
+
+/** Load the mempool from mempool.dat, re-validating every transaction */
+bool LoadMempool();
+/** Write the mempool to mempool.dat */
+bool DumpMempool();
+
 bool AcceptableInputs(CTxMemPool& pool, CValidationState& state, const CTransaction& tx, bool fLimitFree, bool* pfMissingInputs, bool fRejectInsaneFee = false, bool isDSTX = false);
 
 int GetInputAge(CTxIn& vin);
@@ -344,17 +414,22 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline. Transactions whose scripts already passed with the same
+ * flags are looked up in the script execution cache and skip script checks entirely.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& view, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck>* pvChecks = NULL);
+/** Size the cache of fully script-validated transactions from -scriptexeccachesize (in MiB) */
+void InitScriptExecutionCache();
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState& state, CCoinsViewCache& inputs, CTxUndo& txundo, int nHeight);
 
 /** Context-independent validity checks */
-bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state);
+bool CheckTransaction(const CTransaction& tx, bool fZerocoinActive, bool fRejectBadUTXO, CValidationState& state, bool fSkipZerocoinProofs = false);
 bool CheckZerocoinMint(const uint256& txHash, const CTxOut& txout, CValidationState& state, bool fCheckOnly = false);
 bool CheckZerocoinSpend(const CTransaction& tx, bool fVerifySignature, CValidationState& state);
+/** Size the cache of verified zerocoin spend proofs from -zerocoinspendcachesize (in MiB) */
+void InitZerocoinSpendCache();
 bool ContextualCheckZerocoinSpend(const CTransaction& tx, const libzerocoin::CoinSpend& spend, CBlockIndex* pindex);
 bool IsTransactionInChain(const uint256& txId, int& nHeightTx, CTransaction& tx);
 bool IsTransactionInChain(const uint256& txId, int& nHeightTx);
@@ -440,6 +515,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Keep a copy of a block that is likely to be read again soon, see ReadBlockFromDisk(CBlock&, const CBlockIndex*) */
+void AddToBlockCache(const CBlock& block);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -468,8 +545,11 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
-/** Store block on disk. If dbp is provided, the file is known to already reside on disk */
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false);
+/**
+ * Store block on disk. If dbp is provided, the file is known to already reside on disk. Blocks
+ * whose stake can't be checked yet are only stored if fRequested, i.e. we asked a peer for them.
+ */
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyCheckedBlock = false, bool fRequested = true);
 bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex = NULL);
 
 
@@ -232,7 +232,7 @@ bool IsBlockPayeeValid(const CBlock& block, int nBlockHeight)
         return true;
     }
 
-    const CTransaction& txNew = (nBlockHeight > Params().LAST_POW_BLOCK() ? block.vtx[1] : block.vtx[0]);
+    const CTransaction& txNew = (nBlockHeight > Params().LAST_POW_BLOCK() ? *block.vtx[1] : *block.vtx[0]);
 
     //check if it's a budget block
     if (IsSporkActive(SPORK_13_ENABLE_SUPERBLOCKS)) {
@@ -413,12 +413,9 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
 
         if (pfrom->nVersion < ActiveProtocol()) return;
 
-        int nHeight;
-        {
-            TRY_LOCK(cs_main, locked);
-            if (!locked || chainActive.Tip() == NULL) return;
-            nHeight = chainActive.Tip()->nHeight;
-        }
+        // Don't drop the vote while another message handler holds cs_main
+        int nHeight = GetCachedTipHeight();
+        if (nHeight < 0) return;
 
         if (masternodePayments.mapMasternodePayeeVotes.count(winner.GetHash())) {
             LogPrint("mnpayments", "mnw - Already seen - %s bestHeight %d\n", winner.GetHash().ToString().c_str(), nHeight);
@@ -432,8 +429,14 @@ void CMasternodePayments::ProcessMessageMasternodePayments(CNode* pfrom, std::st
             return;
         }
 
+        // The masternode rank is computed from block hashes of the active chain
         std::string strError = "";
-        if (!winner.IsValid(pfrom, strError)) {
+        bool fValid;
+        {
+            LOCK(cs_main);
+            fValid = winner.IsValid(pfrom, strError);
+        }
+        if (!fValid) {
             // if(strError != "") LogPrint("masternode","mnw - invalid message - %s\n", strError);
             return;
         }
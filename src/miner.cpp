@@ -41,27 +41,6 @@ using namespace std;
 // VELESMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
-{
-public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
-    {
-    }
-};
-
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
@@ -89,6 +68,214 @@ public:
     }
 };
 
+/**
+ * The transactions CreateNewBlock has collected so far, with the coins they
+ * create and spend applied to view and the running totals the block limits
+ * are checked against.
+ */
+class CBlockTxCollector
+{
+public:
+    CBlockTemplate* pblocktemplate;
+    CCoinsViewCache& view;
+    int nHeight;
+    unsigned int nBlockMaxSize;
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    CAmount nFees;
+    std::set<uint256> setInBlock;
+    std::vector<CBigNum> vBlockSerials;
+
+    CBlockTxCollector(CBlockTemplate* pblocktemplateIn, CCoinsViewCache& viewIn, int nHeightIn, unsigned int nBlockMaxSizeIn) :
+        pblocktemplate(pblocktemplateIn), view(viewIn), nHeight(nHeightIn), nBlockMaxSize(nBlockMaxSizeIn),
+        nBlockSize(1000), nBlockTx(0), nBlockSigOps(100), nFees(0) {}
+
+    /** Append a mempool transaction if it fits and is valid on top of the block so far */
+    bool Add(const CTxMemPoolEntry& entry)
+    {
+        const CTransaction& tx = entry.GetTx();
+
+        // Size limits
+        unsigned int nTxSize = entry.GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            return false;
+
+        // Legacy limits on sigOps:
+        unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
+        unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+        if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
+            return false;
+
+        if (!view.HaveInputs(tx))
+            return false;
+
+        // double check that there are no double spent zVLS spends in this block or tx
+        vector<CBigNum> vTxSerials;
+        if (tx.IsZerocoinSpend()) {
+            int nHeightTx = 0;
+            if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+                return false;
+
+            for (const CTxIn txIn : tx.vin) {
+                if (txIn.scriptSig.IsZerocoinSpend()) {
+                    libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
+                    bool fUseV1Params = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION;
+                    if (!spend.HasValidSerial(Params().Zerocoin_Params(fUseV1Params)))
+                        return false;
+                    //This zVLS serial has already been included in the block, do not add this tx.
+                    if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
+                        return false;
+                    if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
+                        return false;
+                    vTxSerials.emplace_back(spend.getCoinSerialNumber());
+                }
+            }
+        }
+
+        CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
+
+        nTxSigOps += GetP2SHSigOpCount(tx, view);
+        if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
+            return false;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        CValidationState state;
+        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            return false;
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, view, txundo, nHeight);
+
+        // Added
+        pblocktemplate->block.vtx.push_back(entry.GetSharedTx());
+        pblocktemplate->vTxFees.push_back(nTxFees);
+        pblocktemplate->vTxSigOps.push_back(nTxSigOps);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+        setInBlock.insert(tx.GetHash());
+
+        for (const CBigNum bnSerial : vTxSerials)
+            vBlockSerials.emplace_back(bnSerial);
+        return true;
+    }
+};
+
+/** Order the members of a package so every transaction follows its in-pool parents */
+static bool CompareByAncestorCount(const CTxMemPoolEntry* a, const CTxMemPoolEntry* b)
+{
+    return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+}
+
+/**
+ * Fee rate ordering of the mempool for the block being built. Packages are
+ * scored like CTxMemPoolFeeKey::AncestorScore, but with fees that include
+ * PrioritiseTransaction deltas and over the ancestors not in the block yet:
+ * the scores of the remaining descendants are lowered as each transaction
+ * is added.
+ */
+class CBlockPackageScores
+{
+private:
+    struct CPackageState {
+        CAmount nModFee;
+        uint64_t nSizeWithAncestors;
+        CAmount nModFeesWithAncestors;
+    };
+
+    const CTxMemPool& pool;
+    std::map<uint256, CPackageState> mapState;
+    std::set<CTxMemPoolFeeKey> setByScore;
+
+    CTxMemPoolFeeKey Score(const uint256& hash, const CPackageState& state) const
+    {
+        CTxMemPoolFeeKey own(state.nModFee, pool.mapTx.find(hash)->second.GetTxSize(), hash);
+        CTxMemPoolFeeKey package(state.nModFeesWithAncestors, state.nSizeWithAncestors, hash);
+        return package < own ? package : own;
+    }
+
+public:
+    /** Score every mempool transaction not in setExclude */
+    CBlockPackageScores(const CTxMemPool& poolIn, const std::set<uint256>& setExclude) : pool(poolIn)
+    {
+        AssertLockHeld(pool.cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool.mapTx.begin(); it != pool.mapTx.end(); ++it) {
+            if (setExclude.count(it->first))
+                continue;
+            CPackageState& state = mapState[it->first];
+            state.nModFee = it->second.GetFee();
+            state.nSizeWithAncestors = it->second.GetSizeWithAncestors();
+            state.nModFeesWithAncestors = it->second.GetFeesWithAncestors();
+        }
+
+        // A fee delta raises the transaction and every package it is part of
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = pool.mapDeltas.begin(); it != pool.mapDeltas.end(); ++it) {
+            const CAmount nFeeDelta = it->second.second;
+            if (nFeeDelta == 0 || !pool.mapTx.count(it->first))
+                continue;
+            std::map<uint256, CPackageState>::iterator mi = mapState.find(it->first);
+            if (mi != mapState.end()) {
+                mi->second.nModFee += nFeeDelta;
+                mi->second.nModFeesWithAncestors += nFeeDelta;
+            }
+            std::set<uint256> setDescendants;
+            pool.CalculateDescendants(it->first, setDescendants);
+            BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+                mi = mapState.find(hashDescendant);
+                if (mi != mapState.end())
+                    mi->second.nModFeesWithAncestors += nFeeDelta;
+            }
+        }
+
+        for (std::map<uint256, CPackageState>::const_iterator it = mapState.begin(); it != mapState.end(); ++it)
+            setByScore.insert(Score(it->first, it->second));
+    }
+
+    /** Take the best scored transaction off the ordering */
+    bool PopBest(uint256& hash)
+    {
+        if (setByScore.empty())
+            return false;
+        std::set<CTxMemPoolFeeKey>::iterator it = --setByScore.end();
+        hash = it->hash;
+        setByScore.erase(it);
+        mapState.erase(hash);
+        return true;
+    }
+
+    /** Remove a transaction that went into the block from the packages of its descendants */
+    void Added(const uint256& hash)
+    {
+        std::map<uint256, CPackageState>::iterator mi = mapState.find(hash);
+        if (mi != mapState.end()) {
+            setByScore.erase(Score(hash, mi->second));
+            mapState.erase(mi);
+        }
+
+        const CTxMemPoolEntry& entry = pool.mapTx.find(hash)->second;
+        CAmount nModFee = entry.GetFee();
+        std::map<uint256, std::pair<double, CAmount> >::const_iterator itDelta = pool.mapDeltas.find(hash);
+        if (itDelta != pool.mapDeltas.end())
+            nModFee += itDelta->second.second;
+
+        std::set<uint256> setDescendants;
+        pool.CalculateDescendants(hash, setDescendants);
+        BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+            mi = mapState.find(hashDescendant);
+            if (mi == mapState.end())
+                continue;
+            setByScore.erase(Score(hashDescendant, mi->second));
+            mi->second.nSizeWithAncestors -= entry.GetTxSize();
+            mi->second.nModFeesWithAncestors -= nModFee;
+            setByScore.insert(Score(hashDescendant, mi->second));
+        }
+    }
+};
+
 void UpdateTime(CBlockHeader* pblock, const CBlockIndex* pindexPrev)
 {
     pblock->nTime = std::max(pindexPrev->GetMedianTimePast() + 1, GetAdjustedTime());
@@ -127,7 +314,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
     txNew.vin[0].prevout.SetNull();
     txNew.vout.resize(1);
     txNew.vout[0].scriptPubKey = scriptPubKeyIn;
-    pblock->vtx.push_back(txNew);
+    pblock->vtx.push_back(MakeTransactionRef(txNew));
     pblocktemplate->vTxFees.push_back(-1);   // updated at end
     pblocktemplate->vTxSigOps.push_back(-1); // updated at end
 
@@ -146,8 +333,9 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             unsigned int nTxNewTime = 0;
             if (pwallet->CreateCoinStake(*pwallet, pblock->nBits, nSearchTime - nLastCoinStakeSearchTime, txCoinStake, nTxNewTime)) {
                 pblock->nTime = nTxNewTime;
-                pblock->vtx[0].vout[0].SetEmpty();
-                pblock->vtx.push_back(CTransaction(txCoinStake));
+                txNew.vout[0].SetEmpty();
+                pblock->vtx[0] = MakeTransactionRef(txNew);
+                pblock->vtx.push_back(MakeTransactionRef(txCoinStake));
                 fStakeFound = true;
             }
             nLastCoinStakeSearchInterval = nSearchTime - nLastCoinStakeSearchTime;
@@ -184,29 +372,32 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         const int nHeight = pindexPrev->nHeight + 1;
         CCoinsViewCache view(pcoinsTip);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        CBlockTxCollector collector(pblocktemplate.get(), view, nHeight, nBlockMaxSize);
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
+        // Transactions that can never go into this block, and those whose
+        // package failed; their descendants are passed over as well
+        std::set<uint256> setSkip;
+
         // This vector will be sorted into a priority queue:
         vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
         for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
              mi != mempool.mapTx.end(); ++mi) {
             const CTransaction& tx = mi->second.GetTx();
+            uint256 txid = tx.GetHash();
             if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight)){
+                setSkip.insert(txid);
                 continue;
             }
             if(GetAdjustedTime() > GetSporkValue(SPORK_16_ZEROCOIN_MAINTENANCE_MODE) && tx.ContainsZerocoins()){
+                setSkip.insert(txid);
                 continue;
             }
 
-            COrphan* porphan = NULL;
             double dPriority = 0;
             CAmount nTotalIn = 0;
             bool fMissingInputs = false;
-            uint256 txid = tx.GetHash();
+            bool fInPoolInputs = false;
             for (const CTxIn& txin : tx.vin) {
                 //zerocoinspend has special vin
                 if (tx.IsZerocoinSpend()) {
@@ -244,20 +435,11 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
                         LogPrintf("ERROR: mempool transaction missing input\n");
                         if (fDebug) assert("mempool transaction missing input" == 0);
                         fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
                         break;
                     }
 
-                    // Has to wait for dependencies
-                    if (!porphan) {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                    // Has to wait for its package, see the fee rate pass below
+                    fInPoolInputs = true;
                     continue;
                 }
 
@@ -280,35 +462,27 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
                 dPriority = double_safe_addition(dPriority, ((double)nValueIn * nConf));
 
             }
-            if (fMissingInputs) continue;
+            if (fMissingInputs) {
+                setSkip.insert(txid);
+                continue;
+            }
+            if (fInPoolInputs || nBlockPrioritySize <= 0)
+                continue;
 
             // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = mi->second.GetTxSize();
             dPriority = tx.ComputePriority(dPriority, nTxSize);
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+            mempool.ApplyDeltas(txid, dPriority, nTotalIn);
 
             CFeeRate feeRate(nTotalIn - tx.GetValueOut(), nTxSize);
-
-            if (porphan) {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            } else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
+            vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
+        // First fill the space reserved for high-priority transactions,
+        // included regardless of the fees they pay
+        TxPriorityCompare comparer(false);
         std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        vector<CBigNum> vBlockSerials;
-        vector<CBigNum> vTxSerials;
         while (!vecPriority.empty()) {
             // Take highest priority transaction off the priority queue:
             double dPriority = vecPriority.front().get<0>();
@@ -318,110 +492,91 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
             std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
             vecPriority.pop_back();
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nMaxBlockSigOps = MAX_BLOCK_SIGOPS_CURRENT;
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (!tx.IsZerocoinSpend() && fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
             // Prioritise by fee once past the priority size or we run out of high-priority
             // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority))) {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+            const CTxMemPoolEntry& entry = mempool.mapTx[tx.GetHash()];
+            if ((collector.nBlockSize + entry.GetTxSize() >= nBlockPrioritySize) || !AllowFree(dPriority))
+                break;
+
+            if (collector.Add(entry) && fPrintPriority) {
+                LogPrintf("priority %.1f fee %s txid %s\n",
+                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
             }
+        }
 
-            if (!view.HaveInputs(tx))
+        // Then fill the rest by fee rate: take the transaction with the best
+        // ancestor score together with its in-pool ancestors that are not in
+        // the block yet. Each transaction added lowers the scores of its
+        // descendants, so a package is judged on what is left of it.
+        CBlockPackageScores scores(mempool, setSkip);
+        BOOST_FOREACH (const uint256& hashInBlock, collector.setInBlock)
+            scores.Added(hashInBlock);
+        uint256 hash;
+        while (scores.PopBest(hash)) {
+            if (collector.setInBlock.count(hash) || setSkip.count(hash))
                 continue;
 
-            // double check that there are no double spent zVLS spends in this block or tx
-            if (tx.IsZerocoinSpend()) {
-                int nHeightTx = 0;
-                if (IsTransactionInChain(tx.GetHash(), nHeightTx))
+            std::set<uint256> setPackage;
+            mempool.CalculateMemPoolAncestors(mempool.mapTx[hash].GetTx(), setPackage);
+            setPackage.insert(hash);
+
+            std::vector<const CTxMemPoolEntry*> vPackage;
+            uint64_t nPackageSize = 0;
+            CAmount nPackageFees = 0;
+            unsigned int nPackageSigOps = 0;
+            bool fPrioritised = false;
+            bool fSkipPackage = false;
+            BOOST_FOREACH (const uint256& hashMember, setPackage) {
+                if (collector.setInBlock.count(hashMember))
                     continue;
-
-                bool fDoubleSerial = false;
-                for (const CTxIn txIn : tx.vin) {
-                    if (txIn.scriptSig.IsZerocoinSpend()) {
-                        libzerocoin::CoinSpend spend = TxInToZerocoinSpend(txIn);
-                        bool fUseV1Params = libzerocoin::ExtractVersionFromSerial(spend.getCoinSerialNumber()) < libzerocoin::PrivateCoin::PUBKEY_VERSION;
-                        if (!spend.HasValidSerial(Params().Zerocoin_Params(fUseV1Params)))
-                            fDoubleSerial = true;
-                        if (count(vBlockSerials.begin(), vBlockSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (count(vTxSerials.begin(), vTxSerials.end(), spend.getCoinSerialNumber()))
-                            fDoubleSerial = true;
-                        if (fDoubleSerial)
-                            break;
-                        vTxSerials.emplace_back(spend.getCoinSerialNumber());
-                    }
+                if (setSkip.count(hashMember)) {
+                    fSkipPackage = true;
+                    break;
                 }
-                //This zVLS serial has already been included in the block, do not add this tx.
-                if (fDoubleSerial)
-                    continue;
+                const CTxMemPoolEntry& member = mempool.mapTx[hashMember];
+                double dPriorityDelta = 0;
+                CAmount nFeeDelta = 0;
+                mempool.ApplyDeltas(hashMember, dPriorityDelta, nFeeDelta);
+                if (dPriorityDelta > 0 || nFeeDelta > 0)
+                    fPrioritised = true;
+                vPackage.push_back(&member);
+                nPackageSize += member.GetTxSize();
+                nPackageFees += member.GetFee() + nFeeDelta;
+                nPackageSigOps += GetLegacySigOpCount(member.GetTx());
             }
-
-            CAmount nTxFees = view.GetValueIn(tx) - tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= nMaxBlockSigOps)
+            if (fSkipPackage) {
+                setSkip.insert(hash);
                 continue;
+            }
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+            // Size and legacy sigOp limits, checked again per transaction below
+            if (collector.nBlockSize + nPackageSize >= nBlockMaxSize)
+                continue;
+            if (collector.nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS_CURRENT)
                 continue;
 
-            CTxUndo txundo;
-            UpdateCoins(tx, state, view, txundo, nHeight);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            for (const CBigNum bnSerial : vTxSerials)
-                vBlockSerials.emplace_back(bnSerial);
-
-            if (fPrintPriority) {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+            // Skip free packages if we're past the minimum block size:
+            CFeeRate feeRate(nPackageFees, nPackageSize);
+            const CTransaction& tx = mempool.mapTx[hash].GetTx();
+            if (!tx.IsZerocoinSpend() && !fPrioritised && (feeRate < ::minRelayTxFee) && (collector.nBlockSize + nPackageSize >= nBlockMinSize))
+                continue;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash)) {
-                BOOST_FOREACH (COrphan* porphan, mapDependers[hash]) {
-                    if (!porphan->setDependsOn.empty()) {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty()) {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+            std::sort(vPackage.begin(), vPackage.end(), CompareByAncestorCount);
+            BOOST_FOREACH (const CTxMemPoolEntry* pmember, vPackage) {
+                if (!collector.Add(*pmember)) {
+                    setSkip.insert(pmember->GetTx().GetHash());
+                    break;
+                }
+                scores.Added(pmember->GetTx().GetHash());
+                if (fPrintPriority) {
+                    LogPrintf("package fee %s txid %s\n",
+                        feeRate.ToString(), pmember->GetTx().GetHash().ToString());
                 }
             }
         }
+        uint64_t nBlockSize = collector.nBlockSize;
+        uint64_t nBlockTx = collector.nBlockTx;
+        nFees = collector.nFees;
 
         if (!fProofOfStake) {
             //Masternode and general budget payments
@@ -438,11 +593,11 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
 
         // Compute final coinbase transaction.
-        pblock->vtx[0].vin[0].scriptSig = CScript() << nHeight << OP_0;
-        if (!fProofOfStake) {
-            pblock->vtx[0] = txNew;
+        if (fProofOfStake)
+            txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+        pblock->vtx[0] = MakeTransactionRef(txNew);
+        if (!fProofOfStake)
             pblocktemplate->vTxFees[0] = -nFees;
-        }
 
         // Fill in header
         pblock->hashPrevBlock = pindexPrev->GetBlockHash();
@@ -473,7 +628,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn, CWallet* pwallet,
         }
 
         pblock->nAccumulatorCheckpoint = pCheckpointCache.second.second;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(*pblock->vtx[0]);
 
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false)) {
@@ -501,11 +656,11 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
     }
     ++nExtraNonce;
     unsigned int nHeight = pindexPrev->nHeight + 1; // Height first in coinbase required for block.version=2
-    CMutableTransaction txCoinbase(pblock->vtx[0]);
+    CMutableTransaction txCoinbase(*pblock->vtx[0]);
     txCoinbase.vin[0].scriptSig = (CScript() << nHeight << CScriptNum(nExtraNonce)) + COINBASE_FLAGS;
     assert(txCoinbase.vin[0].scriptSig.size() <= 100);
 
-    pblock->vtx[0] = txCoinbase;
+    pblock->vtx[0] = MakeTransactionRef(txCoinbase);
     pblock->hashMerkleRoot = pblock->BuildMerkleTree();
 }
 
@@ -530,7 +685,7 @@ CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey, CWallet* pwallet,
 bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
 {
     LogPrintf("%s\n", pblock->ToString());
-    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue));
+    LogPrintf("generated %s\n", FormatMoney(pblock->vtx[0]->vout[0].nValue));
 
     // Found a solution
     {
@@ -555,7 +710,7 @@ bool ProcessBlockFound(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     CValidationState state;
     if (!ProcessNewBlock(state, NULL, pblock)) {
         if (pblock->IsZerocoinStake())
-            pwalletMain->zvlsTracker->RemovePending(pblock->vtx[1].GetHash());
+            pwalletMain->zvlsTracker->RemovePending(pblock->vtx[1]->GetHash());
         return error("VELESMiner : ProcessNewBlock, block not accepted");
     }
 
@@ -641,7 +796,7 @@ void BitcoinMiner(CWallet* pwallet, bool fProofOfStake)
             LogPrintf("CPUMiner : proof-of-stake block found %s \n", pblock->GetHash().ToString().c_str());
             if (pblock->IsZerocoinStake()) {
                 //Find the key associated with the zerocoin that is being staked
-                libzerocoin::CoinSpend spend = TxInToZerocoinSpend(pblock->vtx[1].vin[0]);
+                libzerocoin::CoinSpend spend = TxInToZerocoinSpend(pblock->vtx[1]->vin[0]);
                 CBigNum bnSerial = spend.getCoinSerialNumber();
                 CKey key;
                 if (!pwallet->GetZerocoinKey(bnSerial, key)) {
@@ -18,13 +18,21 @@
 #include "obfuscation.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "txmempool.h"
 #include "ui_interface.h"
 #include "wallet.h"
 
+#include <math.h>
+
 #ifdef WIN32
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
 #endif
 
 #ifdef USE_UPNP
@@ -35,6 +43,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 // Dump addresses to peers.dat every 15 minutes (900s)
@@ -84,18 +93,104 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
 bool fAddressesInitialized = false;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
-deque<pair<int64_t, CInv> > vRelayExpiration;
+map<uint256, CTransactionRef> mapRelay;
+deque<pair<int64_t, uint256> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CRecvBufferPool recvBufferPool;
 
 static deque<string> vOneShots;
 CCriticalSection cs_vOneShots;
 
+#ifdef USE_EPOLL
+//! epoll instance of the socket handler, and a pipe to wake it up early
+static int hEpollFd = -1;
+static int hWakeupPipe[2] = {-1, -1};
+#endif
+
+/** Start watching a peer socket for edge-triggered readiness, see ThreadSocketHandler */
+static void RegisterSocketEvents(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpollFd == -1 || hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = hSocket;
+    if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hSocket, &event) != 0)
+        LogPrintf("Failed to register socket with epoll: %s\n", NetworkErrorString(WSAGetLastError()));
+#endif
+}
+
+static void UnregisterSocketEvents(SOCKET hSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpollFd == -1 || hSocket == INVALID_SOCKET)
+        return;
+    epoll_ctl(hEpollFd, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
+}
+
+/** Interrupt the socket handler's wait for events */
+static void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hWakeupPipe[1] == -1)
+        return;
+    char ch = 0;
+    // A full pipe means a wakeup is pending already
+    if (write(hWakeupPipe[1], &ch, 1) != 1)
+        return;
+#endif
+}
+
+#ifdef USE_EPOLL
+/** Create the epoll instance and watch the wakeup pipe and the listening sockets */
+static bool InitEpoll()
+{
+    hEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (hEpollFd == -1)
+        return false;
+    if (pipe(hWakeupPipe) != 0) {
+        close(hEpollFd);
+        hEpollFd = -1;
+        return false;
+    }
+    fcntl(hWakeupPipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(hWakeupPipe[1], F_SETFL, O_NONBLOCK);
+
+    // Level-triggered, so a backlog of connections keeps being reported
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = hWakeupPipe[0];
+    if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hWakeupPipe[0], &event) != 0)
+        return false;
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        event.data.fd = hListenSocket.socket;
+        if (epoll_ctl(hEpollFd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void CloseEpoll()
+{
+    for (int i = 0; i < 2; i++) {
+        if (hWakeupPipe[i] != -1)
+            close(hWakeupPipe[i]);
+        hWakeupPipe[i] = -1;
+    }
+    if (hEpollFd != -1)
+        close(hEpollFd);
+    hEpollFd = -1;
+}
+#endif
+
 set<CNetAddr> setservAddNodeAddresses;
 CCriticalSection cs_setservAddNodeAddresses;
 
@@ -106,7 +201,9 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore* semOutbound = NULL;
+boost::mutex messageHandlerMutex;
 boost::condition_variable messageHandlerCondition;
+static int nMessageHandlerThreads = 1;
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -342,6 +439,10 @@ uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
 
+//! Message statistics of the peers that disconnected
+static CNetMsgStats msgStatsDisconnected;
+static CCriticalSection cs_msgStatsDisconnected;
+
 CNode* FindNode(const CNetAddr& ip)
 {
     LOCK(cs_vNodes);
@@ -428,6 +529,7 @@ CNode* ConnectNode(CAddress addrConnect, const char* pszDest, bool obfuScationMa
         {
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
+            RegisterSocketEvents(hSocket);
         }
 
         pnode->nTimeConnected = GetTime();
@@ -448,6 +550,7 @@ void CNode::CloseSocketDisconnect()
     fDisconnect = true;
     if (hSocket != INVALID_SOCKET) {
         LogPrint("net", "disconnecting peer=%d\n", id);
+        UnregisterSocketEvents(hSocket);
         CloseSocket(hSocket);
     }
 
@@ -701,6 +804,11 @@ void CNode::copyStats(CNodeStats& stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_msgStats);
+        stats.mapMsgStats = msgStats.mapCommands;
+    }
 }
 #undef X
 
@@ -711,7 +819,7 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
-            vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            vRecvMsg.emplace_back(SER_NETWORK, nRecvVersion);
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -735,13 +843,34 @@ bool CNode::ReceiveMsgBytes(const char* pch, unsigned int nBytes)
 
         if (msg.complete()) {
             msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
+            // Only the handler thread serving this peer has anything to do, but we can't tell which one sleeps on it
+            messageHandlerCondition.notify_all();
         }
     }
 
     return true;
 }
 
+char* CNode::GetDirectRecvBuffer(unsigned int nBytes)
+{
+    if (vRecvMsg.empty())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (!msg.in_data || msg.hdr.nMessageSize - msg.nDataPos < nBytes)
+        return NULL;
+    return msg.PrepareData(nBytes);
+}
+
+void CNode::ReceivedDirectBytes(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.nDataPos += nBytes;
+    if (msg.complete()) {
+        msg.nTime = GetTimeMicros();
+        messageHandlerCondition.notify_all();
+    }
+}
+
 int CNetMessage::readHeader(const char* pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -777,38 +906,145 @@ int CNetMessage::readData(const char* pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    memcpy(PrepareData(nCopy), pch, nCopy);
+    nDataPos += nCopy;
+
+    return nCopy;
+}
+
+char* CNetMessage::PrepareData(unsigned int nBytes)
+{
+    if (vRecv.size() < nDataPos + nBytes) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024);
+        recvBufferPool.Reserve(vRecv, nSize);
+        vRecv.resize(nSize);
     }
+    return &vRecv[nDataPos];
+}
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+void CRecvBufferPool::Reserve(CDataStream& vRecv, size_t nSize)
+{
+    CSerializeData vchOld;
+    vRecv.swap(vchOld);
+    if (vchOld.capacity() >= nSize) {
+        vRecv.swap(vchOld);
+        return;
+    }
 
-    return nCopy;
+    int nClass = 0;
+    size_t nClassSize = RECV_BUFFER_MIN_SIZE;
+    while (nClass < RECV_BUFFER_CLASSES && nClassSize < nSize) {
+        nClass++;
+        nClassSize *= 4;
+    }
+    CSerializeData vch;
+    if (nClass < RECV_BUFFER_CLASSES) {
+        LOCK(cs);
+        if (!vFree[nClass].empty()) {
+            vch.swap(vFree[nClass].back());
+            vFree[nClass].pop_back();
+            nHits++;
+        } else
+            nMisses++;
+    }
+    if (vch.capacity() < nSize)
+        vch.reserve(nClass < RECV_BUFFER_CLASSES ? nClassSize : nSize);
+
+    // Only a message outgrowing its buffer has data to move over
+    vch.insert(vch.end(), vchOld.begin(), vchOld.end());
+    vRecv.swap(vch);
+    Put(vchOld);
 }
 
+void CRecvBufferPool::Release(CDataStream& vRecv)
+{
+    CSerializeData vch;
+    vRecv.swap(vch);
+    Put(vch);
+}
+
+void CRecvBufferPool::Put(CSerializeData& vch)
+{
+    // File the buffer under the largest class it holds, allowing for an
+    // allocator that rounds capacity up; much larger buffers are freed
+    for (int nClass = RECV_BUFFER_CLASSES - 1; nClass >= 0; nClass--) {
+        size_t nClassSize = RECV_BUFFER_MIN_SIZE << (2 * nClass);
+        if (vch.capacity() < nClassSize)
+            continue;
+        if (vch.capacity() >= 2 * nClassSize)
+            return;
+        LOCK(cs);
+        if ((vFree[nClass].size() + 1) * nClassSize > RECV_BUFFER_POOL_CLASS_BYTES)
+            return;
+        vch.clear();
+        vFree[nClass].push_back(CSerializeData());
+        vFree[nClass].back().swap(vch);
+        return;
+    }
+}
+
+void CRecvBufferPool::GetStats(uint64_t& nHitsOut, uint64_t& nMissesOut)
+{
+    LOCK(cs);
+    nHitsOut = nHits;
+    nMissesOut = nMisses;
+}
+
+
+/** Maximum number of queued messages handed to the kernel in one scatter/gather send */
+static const int MAX_SEND_IOV = 64;
+
+/** Send as much as possible of the queued messages starting at it, in one system call */
+static int SendQueuedMessages(CNode* pnode, std::deque<CSerializedNetMsg>::iterator it)
+{
+#ifdef WIN32
+    const CSerializeData& data = **it;
+    return send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+    struct iovec iov[MAX_SEND_IOV];
+    int nIov = 0;
+    size_t nOffset = pnode->nSendOffset;
+    for (; it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; it++, nIov++) {
+        const CSerializeData& data = **it;
+        iov[nIov].iov_base = (void*)&data[nOffset];
+        iov[nIov].iov_len = data.size() - nOffset;
+        nOffset = 0;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = nIov;
+    return sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
+}
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode* pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    // Writable events seen so far; if this send blocks, wait for a later one
+    unsigned int nSendEvents = pnode->nSendEvents;
+    std::deque<CSerializedNetMsg>::iterator it = pnode->vSendMsg.begin();
 
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData& data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        assert((*it)->size() > pnode->nSendOffset);
+        int nBytes = SendQueuedMessages(pnode, it);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            // Skip the messages that went out completely
+            size_t nLeft = nBytes;
+            while (nLeft > 0 && nLeft >= (*it)->size() - pnode->nSendOffset) {
+                nLeft -= (*it)->size() - pnode->nSendOffset;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
+            }
+            pnode->nSendOffset += nLeft;
+            if (pnode->nSendOffset > 0) {
                 // could not send full message; stop sending more
+                pnode->nSendEventsBlocked = nSendEvents;
                 break;
             }
         } else {
@@ -821,6 +1057,7 @@ void SocketSendData(CNode* pnode)
                 }
             }
             // couldn't send anything at all
+            pnode->nSendEventsBlocked = nSendEvents;
             break;
         }
     }
@@ -834,9 +1071,146 @@ void SocketSendData(CNode* pnode)
 
 static list<CNode*> vNodesDisconnected;
 
+/** Whether the socket handler should read more from pnode. Requires cs_vRecvMsg. */
+static bool WantsToReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+/** Wait for socket readiness with select(), which also polls pending sends every 50ms */
+static void SocketEventsSelect(set<SOCKET>& setRecv, set<SOCKET>& setSend, set<SOCKET>& setError)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    vector<SOCKET> vSockets;
+
+    BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+        vSockets.push_back(hListenSocket.socket);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH (CNode* pnode, vNodes) {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+            vSockets.push_back(pnode->hSocket);
+
+            // Implement the following logic:
+            // * If there is data to send, select() for sending data. As this only
+            //   happens when optimistic write failed, we choose to first drain the
+            //   write buffer in this case before receiving more. This avoids
+            //   needlessly queueing received data, if the remote peer is not themselves
+            //   receiving data. This means properly utilizing TCP flow control signalling.
+            // * Otherwise, if there is no (complete) message in the receive buffer,
+            //   or there is space left in the buffer, select() for receiving data.
+            // * (if neither of the above applies, there is certainly one message
+            //   in the receiver buffer ready to be processed).
+            // Together, that means that at least one of the following is always possible,
+            // so we don't deadlock:
+            // * We send some data.
+            // * We wait for data to be received (and disconnect after timeout).
+            // * We process a message in the buffer (message handler thread).
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty()) {
+                    FD_SET(pnode->hSocket, &fdsetSend);
+                    continue;
+                }
+            }
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && WantsToReceive(pnode))
+                    FD_SET(pnode->hSocket, &fdsetRecv);
+            }
+        }
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+        &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR) {
+        if (have_fds) {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            setRecv.insert(vSockets.begin(), vSockets.end());
+        }
+        MilliSleep(timeout.tv_usec / 1000);
+        return;
+    }
+
+    BOOST_FOREACH (SOCKET hSocket, vSockets) {
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            setRecv.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSend.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetError))
+            setError.insert(hSocket);
+    }
+}
+
+#ifdef USE_EPOLL
+/**
+ * Wait up to nWaitMs for socket readiness with epoll. Peer sockets are
+ * registered edge-triggered, so only changes are reported and the caller
+ * keeps track of what each socket still has to do.
+ */
+static void SocketEventsEpoll(set<SOCKET>& setRecv, set<SOCKET>& setSend, set<SOCKET>& setError, int nWaitMs)
+{
+    struct epoll_event events[256];
+    int nEvents = epoll_wait(hEpollFd, events, ARRAYLEN(events), nWaitMs);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0) {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(nErr));
+            MilliSleep(50);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        int fd = events[i].data.fd;
+        if (fd == hWakeupPipe[0]) {
+            char buf[128];
+            while (read(hWakeupPipe[0], buf, sizeof(buf)) > 0) {
+            }
+            continue;
+        }
+        SOCKET hSocket = fd;
+        if (events[i].events & EPOLLIN)
+            setRecv.insert(hSocket);
+        if (events[i].events & EPOLLOUT)
+            setSend.insert(hSocket);
+        if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            setError.insert(hSocket);
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    // How long the epoll loop may sleep; zero while sockets have work left
+    int nWaitMs = 0;
     while (true) {
         //
         // Disconnect nodes
@@ -851,6 +1225,12 @@ void ThreadSocketHandler()
                     // remove from vNodes
                     vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
+                    // keep its message statistics in the totals
+                    {
+                        LOCK2(cs_msgStatsDisconnected, pnode->cs_msgStats);
+                        msgStatsDisconnected.Add(pnode->msgStats);
+                    }
+
                     // release outbound grant (if any)
                     pnode->grantOutbound.Release();
 
@@ -902,86 +1282,19 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH (CNode* pnode, vNodes) {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-            &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR) {
-            if (have_fds) {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec / 1000);
-        }
+        set<SOCKET> setRecv, setSend, setError;
+#ifdef USE_EPOLL
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll(setRecv, setSend, setError, nWaitMs);
+        else
+#endif
+            SocketEventsSelect(setRecv, setSend, setError);
 
         //
         // Accept new connections
         //
         BOOST_FOREACH (const ListenSocket& hListenSocket, vhListenSocket) {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv)) {
+            if (hListenSocket.socket != INVALID_SOCKET && setRecv.count(hListenSocket.socket)) {
                 struct sockaddr_storage sockaddr;
                 socklen_t len = sizeof(sockaddr);
                 SOCKET hSocket = accept(hListenSocket.socket, (struct sockaddr*)&sockaddr, &len);
@@ -1004,7 +1317,7 @@ void ThreadSocketHandler()
                     int nErr = WSAGetLastError();
                     if (nErr != WSAEWOULDBLOCK)
                         LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-                } else if (!IsSelectableSocket(hSocket)) {
+                } else if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
                     LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
                     CloseSocket(hSocket);
                 } else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS) {
@@ -1021,6 +1334,7 @@ void ThreadSocketHandler()
                     {
                         LOCK(cs_vNodes);
                         vNodes.push_back(pnode);
+                        RegisterSocketEvents(hSocket);
                     }
                 }
             }
@@ -1029,6 +1343,7 @@ void ThreadSocketHandler()
         //
         // Service each socket
         //
+        nWaitMs = SOCKET_EVENTS_TIMEOUT_MS;
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
@@ -1044,32 +1359,59 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError)) {
+            bool fEpoll = nSocketEventsMode == SOCKETEVENTS_EPOLL;
+            bool fRecvReady = setRecv.count(pnode->hSocket) || setError.count(pnode->hSocket);
+            bool fSendReady = setSend.count(pnode->hSocket) > 0;
+            if (fEpoll) {
+                // Readiness is reported once per change, so remember it until used up
+                if (fRecvReady)
+                    pnode->fHasRecvData = true;
+                if (fSendReady)
+                    pnode->nSendEvents++;
+                fRecvReady = pnode->fHasRecvData;
+                fSendReady = pnode->nSendSize > 0;
+            }
+            if (fRecvReady) {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv) {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0) {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        } else if (nBytes == 0) {
-                            // socket closed gracefully
+                if (!lockRecv) {
+                    nWaitMs = std::min(nWaitMs, 10);
+                } else if (fEpoll && pnode->nSendSize > 0) {
+                    // Drain the send buffer first, see SocketEventsSelect
+                } else if (fEpoll && !WantsToReceive(pnode)) {
+                    // Resumed by the message handler once there is room, see ThreadMessageHandler
+                    pnode->fRecvThrottled = true;
+                } else {
+                    pnode->fRecvThrottled = false;
+                    // typical socket buffer is 8K-64K
+                    char pchBuf[0x10000];
+                    // When all of it belongs to the payload of one message, read straight into its buffer
+                    char* pchDirect = pnode->GetDirectRecvBuffer(sizeof(pchBuf));
+                    int nBytes = recv(pnode->hSocket, pchDirect ? pchDirect : pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                    if (nBytes > 0) {
+                        if (pchDirect)
+                            pnode->ReceivedDirectBytes(nBytes);
+                        else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            pnode->CloseSocketDisconnect();
+                        pnode->nLastRecv = GetTime();
+                        pnode->nRecvBytes += nBytes;
+                        pnode->RecordBytesRecv(nBytes);
+                        // more may be waiting, which epoll will not report again
+                        if (fEpoll)
+                            nWaitMs = 0;
+                    } else if (nBytes == 0) {
+                        // socket closed gracefully
+                        if (!pnode->fDisconnect)
+                            LogPrint("net", "socket closed\n");
+                        pnode->CloseSocketDisconnect();
+                    } else if (nBytes < 0) {
+                        // error
+                        int nErr = WSAGetLastError();
+                        if (nErr == WSAEWOULDBLOCK)
+                            pnode->fHasRecvData = false;
+                        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
                             if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
+                                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
                             pnode->CloseSocketDisconnect();
-                        } else if (nBytes < 0) {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS) {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
                         }
                     }
                 }
@@ -1080,10 +1422,18 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend)) {
+            if (fSendReady) {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (!lockSend) {
+                    nWaitMs = std::min(nWaitMs, 10);
+                } else if (!fEpoll || pnode->nSendEvents != pnode->nSendEventsBlocked) {
                     SocketSendData(pnode);
+                    // the socket is still writable if the buffer was not filled
+                    if (fEpoll && !pnode->vSendMsg.empty() && pnode->nSendEvents != pnode->nSendEventsBlocked)
+                        nWaitMs = 0;
+                    else if (fEpoll && pnode->fHasRecvData)
+                        nWaitMs = 0;
+                }
             }
 
             //
@@ -1270,11 +1620,14 @@ void DumpAddresses()
 {
     int64_t nStart = GetTimeMillis();
 
+    // Serialize and write a copy, so peers and connection selection only wait for the copying
+    boost::scoped_ptr<CAddrMan> paddrSnapshot(new CAddrMan());
+    addrman.GetSnapshot(*paddrSnapshot);
     CAddrDB adb;
-    adb.Write(addrman);
+    adb.Write(*paddrSnapshot);
 
     LogPrint("net", "Flushed %d addresses to peers.dat  %dms\n",
-        addrman.size(), GetTimeMillis() - nStart);
+        paddrSnapshot->size(), GetTimeMillis() - nStart);
 }
 
 void DumpData()
@@ -1491,27 +1844,27 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant* grantOu
 }
 
 
-void ThreadMessageHandler()
+/**
+ * Process the messages of the peers whose id falls in shard nShard. Every peer
+ * is served by exactly one thread, which keeps its messages in order; see
+ * ProcessMessages for how the threads share chain state.
+ */
+void ThreadMessageHandler(int nShard)
 {
-    boost::mutex condition_mutex;
-    boost::unique_lock<boost::mutex> lock(condition_mutex);
-
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true) {
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH (CNode* pnode, vNodesCopy) {
+            BOOST_FOREACH (CNode* pnode, vNodes) {
+                if (pnode->GetId() % nMessageHandlerThreads != nShard)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
         bool fSleep = true;
 
         BOOST_FOREACH (CNode* pnode, vNodesCopy) {
@@ -1525,6 +1878,12 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // Let the socket handler resume reading now there is room
+                    if (pnode->fRecvThrottled && WantsToReceive(pnode)) {
+                        pnode->fRecvThrottled = false;
+                        WakeSocketHandler();
+                    }
+
                     if (pnode->nSendSize < SendBufferSize()) {
                         if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete())) {
                             fSleep = false;
@@ -1538,7 +1897,7 @@ void ThreadMessageHandler()
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle || pnode->fWhitelisted);
+                    g_signals.SendMessages(pnode);
             }
             boost::this_thread::interruption_point();
         }
@@ -1550,8 +1909,10 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
+        if (fSleep) {
+            boost::unique_lock<boost::mutex> lock(messageHandlerMutex);
             messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+        }
     }
 }
 
@@ -1755,6 +2116,15 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Map ports with UPnP
     MapPort(GetBoolArg("-upnp", DEFAULT_UPNP));
 
+#ifdef USE_EPOLL
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && !InitEpoll()) {
+        LogPrintf("Failed to set up epoll (%s), using select for socket events\n", NetworkErrorString(WSAGetLastError()));
+        CloseEpoll();
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+    }
+#endif
+    LogPrintf("Using %s for socket events\n", nSocketEventsMode == SOCKETEVENTS_EPOLL ? "epoll" : "select");
+
     // Send and receive from sockets, accept connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
@@ -1765,7 +2135,10 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    nMessageHandlerThreads = std::max(1, std::min(MAX_MSGHANDLER_THREADS, (int)GetArg("-msghandlerthreads", DEFAULT_MSGHANDLER_THREADS)));
+    LogPrintf("Using %d message handler threads\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -1815,6 +2188,9 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        CloseEpoll();
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -1837,14 +2213,14 @@ void CExplicitNetCleanup::callCleanup()
 
 void RelayTransaction(const CTransaction& tx)
 {
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    ss << tx;
-    RelayTransaction(tx, ss);
+    // Keep a reference to the mempool's copy rather than another one
+    CTransactionRef ptx = mempool.get(tx.GetHash());
+    RelayTransaction(ptx ? ptx : MakeTransactionRef(tx));
 }
 
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
+void RelayTransaction(const CTransactionRef& ptx)
 {
+    const CTransaction& tx = *ptx;
     CInv inv(MSG_TX, tx.GetHash());
     {
         LOCK(cs_mapRelay);
@@ -1854,9 +2230,9 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        // Keep the transaction for getdata even after it left the mempool
+        mapRelay.insert(std::make_pair(inv.hash, ptx));
+        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv.hash));
     }
     LOCK(cs_vNodes);
     BOOST_FOREACH (CNode* pnode, vNodes) {
@@ -1895,6 +2271,12 @@ void RelayInv(CInv& inv)
     }
 }
 
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds)
+{
+    // Announcing at exponentially distributed times hides which peer told us first
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
+}
+
 void CNode::RecordBytesRecv(uint64_t bytes)
 {
     LOCK(cs_totalBytesRecv);
@@ -1919,6 +2301,98 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+void CNode::RecordSentMessage(const std::string& strCommand, uint64_t nBytes)
+{
+    LOCK(cs_msgStats);
+    CMsgCounters& counters = msgStats.Get(strCommand);
+    counters.nSentMsgs++;
+    counters.nSentBytes += nBytes;
+    msgStats.histSendQueue.Add(vSendMsg.size());
+}
+
+void CNode::RecordProcessedMessage(const std::string& strCommand, uint64_t nBytes, int64_t nProcessTime)
+{
+    LOCK(cs_msgStats);
+    CMsgCounters& counters = msgStats.Get(strCommand);
+    counters.nRecvMsgs++;
+    counters.nRecvBytes += nBytes;
+    counters.nProcessTime += nProcessTime;
+    counters.histProcessTime.Add(nProcessTime);
+}
+
+void CNode::GetTotalMsgStats(CNetMsgStats& stats)
+{
+    // Peers move from vNodes to msgStatsDisconnected under cs_vNodes, so each is counted once
+    LOCK(cs_vNodes);
+    {
+        LOCK(cs_msgStatsDisconnected);
+        stats.Add(msgStatsDisconnected);
+    }
+    BOOST_FOREACH (CNode* pnode, vNodes) {
+        LOCK(pnode->cs_msgStats);
+        stats.Add(pnode->msgStats);
+    }
+}
+
+void CHistogram::Add(uint64_t nValue)
+{
+    int nBucket = 0;
+    while (nValue >> nBucket && nBucket < BUCKETS - 1)
+        nBucket++;
+    vCount[nBucket]++;
+    nCount++;
+    nSum += nValue;
+}
+
+void CHistogram::Add(const CHistogram& other)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vCount[i] += other.vCount[i];
+    nCount += other.nCount;
+    nSum += other.nSum;
+}
+
+void CMsgCounters::Add(const CMsgCounters& other)
+{
+    nSentMsgs += other.nSentMsgs;
+    nSentBytes += other.nSentBytes;
+    nRecvMsgs += other.nRecvMsgs;
+    nRecvBytes += other.nRecvBytes;
+    nProcessTime += other.nProcessTime;
+    histProcessTime.Add(other.histProcessTime);
+}
+
+bool CNetMsgStats::IsKnownCommand(const std::string& strCommand)
+{
+    // Peers can make up commands, so only the ones we send or handle get counters of their own
+    static const char* const pszKnownCommands[] = {
+        "version", "verack", "addr", "inv", "getdata", "getblocks", "getheaders", "tx", "dstx",
+        "headers", "block", "sendcmpct", "cmpctblock", "getblocktxn", "blocktxn", "getaddr",
+        "mempool", "alert", "filterload", "filteradd", "filterclear", "reject", "ping", "pong",
+        "notfound", "merkleblock",
+        "mnb", "mnp", "mnw", "mnget", "mnvs", "dseg", "dsee", "dseep", "dsa", "dsc", "dsf",
+        "dsi", "dsq", "dsr", "dss", "dssu", "ssc", "mprop", "mvote", "fbs", "fbvote",
+        "spork", "getsporks", "ix", "txlvote"};
+
+    BOOST_FOREACH (const char* pszCommand, pszKnownCommands) {
+        if (strCommand == pszCommand)
+            return true;
+    }
+    return false;
+}
+
+CMsgCounters& CNetMsgStats::Get(const std::string& strCommand)
+{
+    return mapCommands[IsKnownCommand(strCommand) ? strCommand : NET_MESSAGE_COMMAND_OTHER];
+}
+
+void CNetMsgStats::Add(const CNetMsgStats& other)
+{
+    for (std::map<std::string, CMsgCounters>::const_iterator it = other.mapCommands.begin(); it != other.mapCommands.end(); it++)
+        Get(it->first).Add(it->second);
+    histSendQueue.Add(other.histSendQueue);
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -2050,7 +2524,9 @@ bool CAddrDB::Read(CAddrMan& addr)
 unsigned int ReceiveFloodSize() { return 1000 * GetArg("-maxreceivebuffer", 5 * 1000); }
 unsigned int SendBufferSize() { return 1000 * GetArg("-maxsendbuffer", 1 * 1000); }
 
-CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+                                                                                           addrKnown(ADDR_KNOWN_FILTER_SIZE, 0.001),
+                                                                                           filterInventoryKnown(INVENTORY_KNOWN_FILTER_SIZE, 0.000001)
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -2059,6 +2535,11 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     nLastRecv = 0;
     nSendBytes = 0;
     nRecvBytes = 0;
+    // Assume the socket may be ready until it reports otherwise
+    fHasRecvData = true;
+    fRecvThrottled = false;
+    nSendEvents = 1;
+    nSendEventsBlocked = 0;
     nTimeConnected = GetTime();
     nTimeOffset = 0;
     addr = addrIn;
@@ -2078,8 +2559,9 @@ CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fIn
     hashContinue = 0;
     nStartingHeight = -1;
     fGetAddr = false;
+    nNextAddrSend = 0;
+    nNextInvSend = 0;
     fRelayTxes = false;
-    setInventoryKnown.max_size(SendBufferSize() / 1000);
     pfilter = new CBloomFilter();
     nPingNonceSent = 0;
     nPingUsecStart = 0;
@@ -2114,6 +2596,68 @@ CNode::~CNode()
     GetNodeSignals().FinalizeNode(GetId());
 }
 
+/** Announcement order of queued transactions, keyed by their in-pool ancestor count and fee rate */
+static bool CompareInventoryTxOrder(const std::pair<uint64_t, CTxMemPoolFeeKey>& a, const std::pair<uint64_t, CTxMemPoolFeeKey>& b)
+{
+    if (a.first != b.first)
+        return a.first < b.first;
+    return b.second < a.second;
+}
+
+void CNode::GetInventoryToSend(bool fSendTrickle, std::vector<CInv>& vInv)
+{
+    LOCK(cs_inventory);
+    std::vector<CInv> vInvWait;
+    unsigned int nRelayedMasternode = 0;
+    BOOST_FOREACH (const CInv& inv, vInventoryToSend) {
+        if (filterInventoryKnown.contains(InventoryKnownKey(inv)))
+            continue;
+
+        if (inv.type != MSG_BLOCK && inv.type != MSG_TXLOCK_REQUEST && inv.type != MSG_TXLOCK_VOTE) {
+            if (!fSendTrickle || nRelayedMasternode >= INVENTORY_BROADCAST_MAX_MASTERNODE) {
+                vInvWait.push_back(inv);
+                continue;
+            }
+            nRelayedMasternode++;
+        }
+
+        filterInventoryKnown.insert(InventoryKnownKey(inv));
+        vInv.push_back(inv);
+    }
+    vInventoryToSend.swap(vInvWait);
+
+    if (!fSendTrickle)
+        return;
+
+    // Rank the queued transactions still in the mempool: fewer in-pool ancestors first, so
+    // parents go out before their children, then highest fee rate first
+    std::vector<std::pair<uint64_t, CTxMemPoolFeeKey> > vTxToSend;
+    {
+        LOCK(mempool.cs);
+        BOOST_FOREACH (const uint256& hash, setInventoryTxToSend) {
+            std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hash);
+            if (mi == mempool.mapTx.end() || filterInventoryKnown.contains(InventoryKnownKey(CInv(MSG_TX, hash))))
+                continue;
+            const CTxMemPoolEntry& entry = mi->second;
+            vTxToSend.push_back(std::make_pair(entry.GetCountWithAncestors(), CTxMemPoolFeeKey(entry.GetFee(), entry.GetTxSize(), hash)));
+        }
+    }
+    std::sort(vTxToSend.begin(), vTxToSend.end(), CompareInventoryTxOrder);
+
+    setInventoryTxToSend.clear();
+    unsigned int nRelayedTx = 0;
+    for (std::vector<std::pair<uint64_t, CTxMemPoolFeeKey> >::const_iterator it = vTxToSend.begin(); it != vTxToSend.end(); ++it) {
+        if (nRelayedTx >= INVENTORY_BROADCAST_MAX_TX) {
+            setInventoryTxToSend.insert(it->second.hash);
+            continue;
+        }
+        CInv inv(MSG_TX, it->second.hash);
+        filterInventoryKnown.insert(InventoryKnownKey(inv));
+        vInv.push_back(inv);
+        nRelayedTx++;
+    }
+}
+
 void CNode::AskFor(const CInv& inv)
 {
     if (mapAskFor.size() > MAPASKFOR_MAX_SZ)
@@ -2161,6 +2705,13 @@ void CNode::AbortMessage() UNLOCK_FUNCTION(cs_vSend)
     LogPrint("net", "(aborted)\n");
 }
 
+/** Command of a serialized message that starts with its CMessageHeader */
+static std::string GetMessageCommand(const char* pchMessage)
+{
+    const char* pchCommand = pchMessage + MESSAGE_START_SIZE;
+    return std::string(pchCommand, std::find(pchCommand, pchCommand + CMessageHeader::COMMAND_SIZE, '\0'));
+}
+
 void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
 {
     // The -*messagestest options are intentionally not documented in the help message,
@@ -2179,28 +2730,50 @@ void CNode::EndMessage() UNLOCK_FUNCTION(cs_vSend)
         return;
     }
 
-    // Set the size
-    unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-    memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+    FinalizeMessageHeader(ssSend);
+    LogPrint("net", "(%d bytes) peer=%d\n", ssSend.size() - CMessageHeader::HEADER_SIZE, id);
 
-    // Set the checksum
-    uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-    unsigned int nChecksum = 0;
-    memcpy(&nChecksum, &hash, sizeof(nChecksum));
-    assert(ssSend.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-    memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ssSend.GetAndClear(*pmsg);
+    vSendMsg.push_back(pmsg);
+    nSendSize += pmsg->size();
+    RecordSentMessage(GetMessageCommand(&(*pmsg)[0]), pmsg->size());
+
+    // If write queue empty, attempt "optimistic write"
+    if (vSendMsg.size() == 1)
+        SocketSendData(this);
 
-    LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSharedMessage(const CSerializedNetMsg& msg)
+{
+    LOCK(cs_vSend);
+    LogPrint("net", "sending: %s (%d bytes, shared) peer=%d\n",
+        SanitizeString(std::string(&(*msg)[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE)),
+        msg->size() - CMessageHeader::HEADER_SIZE, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    vSendMsg.push_back(msg);
+    nSendSize += msg->size();
+    RecordSentMessage(GetMessageCommand(&(*msg)[0]), msg->size());
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (vSendMsg.size() == 1)
         SocketSendData(this);
+}
 
-    LEAVE_CRITICAL_SECTION(cs_vSend);
+void FinalizeMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size() >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
 }
 
 //
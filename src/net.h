@@ -11,8 +11,8 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
 #include "streams.h"
@@ -20,6 +20,7 @@
 #include "uint256.h"
 #include "utilstrencodings.h"
 
+#include <atomic>
 #include <deque>
 #include <stdint.h>
 
@@ -29,6 +30,7 @@
 
 #include <boost/filesystem/path.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 
 class CAddrMan;
@@ -41,6 +43,9 @@ namespace boost
 class thread_group;
 } // namespace boost
 
+/** A complete serialized network message; immutable, so several peers' send queues can share it */
+typedef boost::shared_ptr<const CSerializeData> CSerializedNetMsg;
+
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
@@ -49,8 +54,28 @@ static const int TIMEOUT_INTERVAL = 20 * 60;
 static const unsigned int MAX_INV_SZ = 50000;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Number of most recent addresses per peer remembered as known to it */
+static const unsigned int ADDR_KNOWN_FILTER_SIZE = 5000;
+/** Number of most recent inventory items per peer remembered as known to it */
+static const unsigned int INVENTORY_KNOWN_FILTER_SIZE = 10000;
+/** Average delay between trickled inventory announcements to inbound peers in seconds; outbound peers get half of it */
+static const int INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transactions announced to a peer per trickle */
+static const unsigned int INVENTORY_BROADCAST_MAX_TX = 7 * INVENTORY_BROADCAST_INTERVAL;
+/** Maximum number of masternode, budget and spork items announced to a peer per trickle */
+static const unsigned int INVENTORY_BROADCAST_MAX_MASTERNODE = 200 * INVENTORY_BROADCAST_INTERVAL;
+/** Average delay between address announcements to a peer in seconds */
+static const int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
+/** Command under which messages with a command we don't know are counted */
+static const char* const NET_MESSAGE_COMMAND_OTHER = "*other*";
 /** Maximum length of incoming protocol messages (no message over 2 MiB is currently acceptable). */
 static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 2 * 1024 * 1024;
+/** Size of the smallest pooled receive buffer; each further size class is four times larger */
+static const size_t RECV_BUFFER_MIN_SIZE = 512;
+/** Number of receive buffer size classes, the largest holding MAX_PROTOCOL_MESSAGE_LENGTH */
+static const int RECV_BUFFER_CLASSES = 7;
+/** Maximum number of bytes in free receive buffers kept per size class */
+static const size_t RECV_BUFFER_POOL_CLASS_BYTES = 2 * 1024 * 1024;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
 /** -upnp default */
@@ -61,6 +86,27 @@ static const bool DEFAULT_UPNP = false;
 #endif
 /** The maximum number of entries in mapAskFor */
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
+/** Milliseconds the epoll socket loop sleeps when no socket has work left */
+static const int SOCKET_EVENTS_TIMEOUT_MS = 1000;
+/** -socketevents default and supported modes */
+#ifdef USE_EPOLL
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+static const char* const SUPPORTED_SOCKETEVENTS = "select, epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+static const char* const SUPPORTED_SOCKETEVENTS = "select";
+#endif
+
+/** Default for -msghandlerthreads, the number of threads peers' messages are spread over */
+static const int DEFAULT_MSGHANDLER_THREADS = 2;
+/** Maximum for -msghandlerthreads */
+static const int MAX_MSGHANDLER_THREADS = 16;
+
+/** How ThreadSocketHandler waits for sockets to become ready */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
 
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
@@ -87,7 +133,7 @@ typedef int NodeId;
 struct CNodeSignals {
     boost::signals2::signal<int()> GetHeight;
     boost::signals2::signal<bool(CNode*)> ProcessMessages;
-    boost::signals2::signal<bool(CNode*, bool)> SendMessages;
+    boost::signals2::signal<bool(CNode*)> SendMessages;
     boost::signals2::signal<void(NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void(NodeId)> FinalizeNode;
 };
@@ -128,11 +174,12 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern SocketEventsMode nSocketEventsMode;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
+extern std::map<uint256, CTransactionRef> mapRelay;
+extern std::deque<std::pair<int64_t, uint256> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
 
@@ -150,6 +197,58 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Counts of values in power-of-two buckets: bucket 0 holds 0, bucket i the values from 2^(i-1) up to 2^i - 1 */
+class CHistogram
+{
+public:
+    static const int BUCKETS = 32;
+
+    uint64_t vCount[BUCKETS];
+    uint64_t nCount;
+    uint64_t nSum;
+
+    CHistogram() : nCount(0), nSum(0)
+    {
+        std::fill(vCount, vCount + BUCKETS, 0);
+    }
+
+    void Add(uint64_t nValue);
+    void Add(const CHistogram& other);
+};
+
+/** Messages and bytes of one command sent and received, and the time spent processing the received ones */
+class CMsgCounters
+{
+public:
+    uint64_t nSentMsgs;
+    uint64_t nSentBytes;
+    uint64_t nRecvMsgs;
+    uint64_t nRecvBytes;
+    //! Microseconds ProcessMessage took, in total and per message
+    uint64_t nProcessTime;
+    CHistogram histProcessTime;
+
+    CMsgCounters() : nSentMsgs(0), nSentBytes(0), nRecvMsgs(0), nRecvBytes(0), nProcessTime(0) {}
+
+    void Add(const CMsgCounters& other);
+};
+
+/** Message statistics of a peer, or of all peers together */
+class CNetMsgStats
+{
+public:
+    std::map<std::string, CMsgCounters> mapCommands;
+    //! Number of messages in the send queue, sampled whenever one is queued
+    CHistogram histSendQueue;
+
+    //! The counters of strCommand, or of NET_MESSAGE_COMMAND_OTHER if it isn't a known command
+    CMsgCounters& Get(const std::string& strCommand);
+    void Add(const CNetMsgStats& other);
+
+    //! Whether strCommand is one of the protocol commands counted on their own
+    static bool IsKnownCommand(const std::string& strCommand);
+};
+
 class CNodeStats
 {
 public:
@@ -170,8 +269,38 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    std::map<std::string, CMsgCounters> mapMsgStats;
+};
+
+
+/**
+ * Free message receive buffers in a few size classes, shared by all peers.
+ * Incoming messages take their buffer from here and hand it back once
+ * processed, instead of allocating (and wiping on free) one per message.
+ */
+class CRecvBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree[RECV_BUFFER_CLASSES];
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    //! Keep vch for reuse if it is of a size class that has room left
+    void Put(CSerializeData& vch);
+
+public:
+    CRecvBufferPool() : nHits(0), nMisses(0) {}
+
+    //! Make room for nSize bytes in vRecv, moving its content to a larger pooled buffer if needed
+    void Reserve(CDataStream& vRecv, size_t nSize);
+    //! Take back the buffer of a processed message, leaving vRecv empty
+    void Release(CDataStream& vRecv);
+    //! Number of buffers handed out from the pool and allocated because it had none
+    void GetStats(uint64_t& nHitsOut, uint64_t& nMissesOut);
 };
 
+extern CRecvBufferPool recvBufferPool;
 
 class CNetMessage
 {
@@ -211,8 +340,29 @@ public:
 
     int readHeader(const char* pch, unsigned int nBytes);
     int readData(const char* pch, unsigned int nBytes);
+    //! Where the next nBytes of message data go, allocating room for them if needed
+    char* PrepareData(unsigned int nBytes);
 };
 
+/** Fill in the payload size and checksum of a message serialized after its CMessageHeader */
+void FinalizeMessageHeader(CDataStream& ss);
+
+/**
+ * Build a complete message (header, checksum and payload) once, to be queued
+ * with CNode::PushSharedMessage to any number of peers without copying it.
+ * Only peers whose GetSendVersion() is nVersion may share it.
+ */
+template <typename T>
+CSerializedNetMsg CreateNetMessage(int nVersion, const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, nVersion);
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    FinalizeMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pmsg(new CSerializeData());
+    ss.GetAndClear(*pmsg);
+    return pmsg;
+}
+
 
 typedef enum BanReason
 {
@@ -287,7 +437,7 @@ public:
     size_t nSendSize;   // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSerializedNetMsg> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -296,6 +446,13 @@ public:
     uint64_t nRecvBytes;
     int nRecvVersion;
 
+    // Readiness for the epoll socket loop, which only reports changes
+    // (edge-triggered) and so has to remember what is left to do
+    bool fHasRecvData;                     // socket may have unread data; socket handler thread only
+    bool fRecvThrottled;                   // unread data left because the receive buffer is full; protected by cs_vRecvMsg
+    std::atomic<unsigned int> nSendEvents; // writable events seen so far
+    unsigned int nSendEventsBlocked;       // nSendEvents when a send last could not complete; protected by cs_vSend
+
     int64_t nLastSend;
     int64_t nLastRecv;
     int64_t nTimeConnected;
@@ -356,14 +513,20 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
     bool fGetAddr;
     std::set<uint256> setKnown;
+    int64_t nNextAddrSend;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
+    //! Transactions to announce, by txid; they go out parents first, then highest fee rate first
+    std::set<uint256> setInventoryTxToSend;
+    //! Everything else to announce, in the order it was queued
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    //! When the queued inventory that isn't urgent is next announced (in usec)
+    int64_t nNextInvSend;
     std::multimap<int64_t, CInv> mapAskFor;
     std::vector<uint256> vBlockRequested;
 
@@ -377,6 +540,10 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
+    // Message statistics by command
+    CNetMsgStats msgStats;
+    CCriticalSection cs_msgStats;
+
     CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn = false);
     ~CNode();
 
@@ -414,6 +581,23 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char* pch, unsigned int nBytes);
 
+    /**
+     * The buffer of the message being received, if at least nBytes of its
+     * data are still missing, so the socket can be read into it directly.
+     * Requires LOCK(cs_vRecvMsg).
+     */
+    char* GetDirectRecvBuffer(unsigned int nBytes);
+
+    //! Account nBytes read into the buffer from GetDirectRecvBuffer. Requires LOCK(cs_vRecvMsg).
+    void ReceivedDirectBytes(unsigned int nBytes);
+
+    //! The protocol version messages to this peer are serialized with
+    int GetSendVersion()
+    {
+        LOCK(cs_vSend);
+        return ssSend.GetVersion();
+    }
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -436,7 +620,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -444,7 +628,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -454,11 +638,18 @@ public:
     }
 
 
+    //! Key of inv in filterInventoryKnown, telling apart inventory of different
+    //! types that share a hash, like a transaction and its lock request
+    static uint256 InventoryKnownKey(const CInv& inv)
+    {
+        return inv.hash ^ uint256(inv.type);
+    }
+
     void AddInventoryKnown(const CInv& inv)
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(InventoryKnownKey(inv));
         }
     }
 
@@ -466,13 +657,27 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (filterInventoryKnown.contains(InventoryKnownKey(inv)))
+                return;
+            if (inv.type == MSG_TX)
+                setInventoryTxToSend.insert(inv.hash);
+            else
                 vInventoryToSend.push_back(inv);
         }
     }
 
+    /**
+     * Take the queued inventory to announce now: blocks and instantx locks
+     * always, the rest only if fSendTrickle and at most a fixed number per
+     * type. Transactions that left the mempool meanwhile are dropped.
+     */
+    void GetInventoryToSend(bool fSendTrickle, std::vector<CInv>& vInv);
+
     void AskFor(const CInv& inv);
 
+    //! Queue a message built by CreateNetMessage; the peer shares it instead of copying it
+    void PushSharedMessage(const CSerializedNetMsg& msg);
+
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
     void BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSend);
 
@@ -726,6 +931,13 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    //! Count a message just queued for sending. Requires cs_vSend.
+    void RecordSentMessage(const std::string& strCommand, uint64_t nBytes);
+    //! Count a received message, and the time ProcessMessage took for it
+    void RecordProcessedMessage(const std::string& strCommand, uint64_t nBytes, int64_t nProcessTime);
+    //! Message statistics of all peers since startup, including those no longer connected
+    static void GetTotalMsgStats(CNetMsgStats& stats);
 };
 
 class CExplicitNetCleanup
@@ -736,10 +948,13 @@ public:
 
 class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
+void RelayTransaction(const CTransactionRef& ptx);
 void RelayTransactionLockReq(const CTransaction& tx, bool relayToAll = false);
 void RelayInv(CInv& inv);
 
+/** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
+int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+
 /** Access to the (IP) address database (peers.dat) */
 class CAddrDB
 {
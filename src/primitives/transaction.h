@@ -14,6 +14,9 @@
 
 #include <list>
 
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 class CTransaction;
 
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
@@ -305,6 +308,15 @@ public:
     bool GetCoinAge(uint64_t& nCoinAge) const;  // ppcoin: get transaction coin age
 };
 
+/** Reference-counted handle to an immutable transaction, shared instead of copied */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+
+template <typename Tx>
+static inline CTransactionRef MakeTransactionRef(const Tx& tx)
+{
+    return boost::make_shared<const CTransaction>(tx);
+}
+
 /** A mutable version of CTransaction. */
 struct CMutableTransaction
 {
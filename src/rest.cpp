@@ -9,6 +9,7 @@
 #include "primitives/transaction.h"
 #include "main.h"
 #include "httpserver.h"
+#include "net.h"
 #include "rpc/server.h"
 #include "streams.h"
 #include "sync.h"
@@ -619,3 +620,72 @@ void StopREST()
     for (unsigned int i = 0; i < ARRAYLEN(uri_prefixes); i++)
         UnregisterHTTPHandler(uri_prefixes[i].prefix, false);
 }
+
+/** Append a histogram in the Prometheus text format, with strLabels added to every sample */
+static void AppendHistogram(std::string& strOut, const std::string& strName, const std::string& strLabels, const CHistogram& hist)
+{
+    std::string strPrefix = strLabels.empty() ? "" : strLabels + ",";
+    uint64_t nCumulative = 0;
+    for (int i = 0; i < CHistogram::BUCKETS - 1; i++) {
+        nCumulative += hist.vCount[i];
+        strOut += strprintf("%s_bucket{%sle=\"%u\"} %u\n", strName, strPrefix, (((uint64_t)1) << i) - 1, nCumulative);
+    }
+    strOut += strprintf("%s_bucket{%sle=\"+Inf\"} %u\n", strName, strPrefix, hist.nCount);
+    std::string strBraced = strLabels.empty() ? "" : "{" + strLabels + "}";
+    strOut += strprintf("%s_sum%s %u\n", strName, strBraced, hist.nSum);
+    strOut += strprintf("%s_count%s %u\n", strName, strBraced, hist.nCount);
+}
+
+/** Network statistics for Prometheus, in its text exposition format */
+static bool metrics_net(HTTPRequest* req, const std::string& strURIPart)
+{
+    static const struct {
+        const char* name;
+        const char* help;
+        uint64_t CMsgCounters::*pCounter;
+    } counters[] = {
+        {"veles_net_messages_sent_total", "Messages sent to peers", &CMsgCounters::nSentMsgs},
+        {"veles_net_message_bytes_sent_total", "Bytes of messages sent to peers, including headers", &CMsgCounters::nSentBytes},
+        {"veles_net_messages_received_total", "Messages received from peers and processed", &CMsgCounters::nRecvMsgs},
+        {"veles_net_message_bytes_received_total", "Bytes of messages received from peers and processed, including headers", &CMsgCounters::nRecvBytes},
+    };
+
+    CNetMsgStats stats;
+    CNode::GetTotalMsgStats(stats);
+
+    std::string strOut;
+    strOut += "# HELP veles_net_bytes_sent_total Bytes sent to peers\n";
+    strOut += "# TYPE veles_net_bytes_sent_total counter\n";
+    strOut += strprintf("veles_net_bytes_sent_total %u\n", CNode::GetTotalBytesSent());
+    strOut += "# HELP veles_net_bytes_received_total Bytes received from peers\n";
+    strOut += "# TYPE veles_net_bytes_received_total counter\n";
+    strOut += strprintf("veles_net_bytes_received_total %u\n", CNode::GetTotalBytesRecv());
+    for (unsigned int i = 0; i < ARRAYLEN(counters); i++) {
+        strOut += strprintf("# HELP %s %s, by command\n", counters[i].name, counters[i].help);
+        strOut += strprintf("# TYPE %s counter\n", counters[i].name);
+        for (std::map<std::string, CMsgCounters>::const_iterator it = stats.mapCommands.begin(); it != stats.mapCommands.end(); it++)
+            strOut += strprintf("%s{command=\"%s\"} %u\n", counters[i].name, it->first, it->second.*counters[i].pCounter);
+    }
+    strOut += "# HELP veles_net_message_process_microseconds Time spent processing a received message, by command\n";
+    strOut += "# TYPE veles_net_message_process_microseconds histogram\n";
+    for (std::map<std::string, CMsgCounters>::const_iterator it = stats.mapCommands.begin(); it != stats.mapCommands.end(); it++)
+        AppendHistogram(strOut, "veles_net_message_process_microseconds", strprintf("command=\"%s\"", it->first), it->second.histProcessTime);
+    strOut += "# HELP veles_net_send_queue_depth Messages in a peer's send queue, sampled whenever one is queued\n";
+    strOut += "# TYPE veles_net_send_queue_depth histogram\n";
+    AppendHistogram(strOut, "veles_net_send_queue_depth", "", stats.histSendQueue);
+
+    req->WriteHeader("Content-Type", "text/plain; version=0.0.4");
+    req->WriteReply(HTTP_OK, strOut);
+    return true;
+}
+
+bool StartMetrics()
+{
+    RegisterHTTPHandler("/metrics", true, metrics_net);
+    return true;
+}
+
+void StopMetrics()
+{
+    UnregisterHTTPHandler("/metrics", true);
+}
@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "clientversion.h"
 #include "main.h"
 #include "rpc/server.h"
@@ -20,6 +21,8 @@
 #include <stdint.h>
 #include <univalue.h>
 
+#include <boost/algorithm/string.hpp>
+
 using namespace std;
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, UniValue& entry);
@@ -95,7 +98,8 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     result.push_back(Pair("merkleroot", block.hashMerkleRoot.GetHex()));
     result.push_back(Pair("acc_checkpoint", block.nAccumulatorCheckpoint.GetHex()));
     UniValue txs(UniValue::VARR);
-    BOOST_FOREACH (const CTransaction& tx, block.vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+        const CTransaction& tx = *ptx;
         if (txDetails) {
             UniValue objTx(UniValue::VOBJ);
             TxToJSON(tx, uint256(0), objTx);
@@ -195,6 +199,12 @@ UniValue mempoolToJSON(bool fVerbose = false)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", ValueFromAmount(e.GetFeesWithDescendants())));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(e.GetFeesWithAncestors())));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH (const CTxIn& txin, tx.vin) {
@@ -248,6 +258,12 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) fees of in-mempool descendants (including this one) in veles\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) fees of in-mempool ancestors (including this one) in veles\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -463,6 +479,62 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
     return ret;
 }
 
+/** Split a multi-line LevelDB property into an array of its non-empty lines */
+static UniValue PropertyLinesToJSON(const std::string& strProperty)
+{
+    UniValue lines(UniValue::VARR);
+    std::vector<std::string> vLines;
+    boost::split(vLines, strProperty, boost::is_any_of("\n"), boost::token_compress_on);
+    for (const std::string& strLine : vLines) {
+        if (!strLine.empty())
+            lines.push_back(strLine);
+    }
+    return lines;
+}
+
+UniValue dbstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 1)
+        throw runtime_error(
+            "dbstats ( includetables )\n"
+            "\nReturns LevelDB's internal statistics for each open database.\n"
+
+            "\nArguments:\n"
+            "1. includetables  (boolean, optional, default=false) Also list the sstables of every level\n"
+
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"name\",       (string) The database (chainstate, blockindex, zerocoin, sporks)\n"
+            "    \"options\": \"xxxx\",    (string) The options the database was opened with\n"
+            "    \"approximate_size\": n, (numeric) Approximate size on disk in bytes\n"
+            "    \"stats\": [ \"line\" ],   (array) Per-level compaction statistics as reported by LevelDB\n"
+            "    \"sstables\": [ \"line\" ] (array) The sstables of every level (only with includetables)\n"
+            "  }, ...\n"
+            "]\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("dbstats", "") + HelpExampleCli("dbstats", "true") + HelpExampleRpc("dbstats", ""));
+
+    bool fTables = params.size() > 0 && params[0].get_bool();
+
+    std::vector<CLevelDBStats> vStats;
+    GetLevelDBStats(vStats, fTables);
+
+    UniValue ret(UniValue::VARR);
+    for (const CLevelDBStats& stats : vStats) {
+        UniValue obj(UniValue::VOBJ);
+        obj.push_back(Pair("name", stats.strName));
+        obj.push_back(Pair("options", stats.strOptions));
+        obj.push_back(Pair("approximate_size", (uint64_t)stats.nApproximateSize));
+        obj.push_back(Pair("stats", PropertyLinesToJSON(stats.strStats)));
+        if (fTables)
+            obj.push_back(Pair("sstables", PropertyLinesToJSON(stats.strTables)));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 UniValue gettxout(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -752,7 +824,8 @@ UniValue getfeeinfo(const UniValue& params, bool fHelp)
 
         CAmount nValueIn = 0;
         CAmount nValueOut = 0;
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             if (tx.IsCoinBase() || tx.IsCoinStake())
                 continue;
 
@@ -800,7 +873,10 @@ UniValue mempoolInfoToJSON()
     UniValue ret(UniValue::VOBJ);
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
-    //ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
@@ -816,6 +892,9 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Estimated memory usage of the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool (-maxmempool)\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate in veles/kB for a transaction to be accepted\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -824,6 +903,73 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk.\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("savemempool", "") + HelpExampleRpc("savemempool", ""));
+
+    if (!mempool.IsLoaded())
+        throw JSONRPCError(RPC_MISC_ERROR, "The mempool was not loaded yet");
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
+static UniValue checkQueueStatsToJSON(const CCheckQueueStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("checks", (uint64_t)stats.nChecks));
+    ret.push_back(Pair("walltime", stats.nWallTime));
+    ret.push_back(Pair("idletime", stats.nIdleTime));
+    ret.push_back(Pair("steals", (uint64_t)stats.nSteals));
+    return ret;
+}
+
+UniValue getscriptcheckstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getscriptcheckstats\n"
+            "\nReturns statistics of the parallel script verification of connected blocks, to help tune -par.\n"
+            "Times are in microseconds. Idle time is summed over all threads.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"threads\": n,              (numeric) Script verification threads, including the block connecting thread\n"
+            "  \"blocks\": n,               (numeric) Number of blocks verified on the threads\n"
+            "  \"lastblock\": {             (json object) The most recently verified block\n"
+            "    \"checks\": n,             (numeric) Input scripts queued\n"
+            "    \"walltime\": n,           (numeric) Time from the start of the block until all checks completed\n"
+            "    \"idletime\": n,           (numeric) Time threads spent waiting for work\n"
+            "    \"steals\": n              (numeric) Batches a thread took from another thread's queue\n"
+            "  },\n"
+            "  \"total\": {                 (json object) The same fields summed over all blocks\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getscriptcheckstats", "") + HelpExampleRpc("getscriptcheckstats", ""));
+
+    CCheckQueueStats statsLast, statsTotal;
+    uint64_t nBlocks;
+    GetScriptCheckQueueStats(statsLast, statsTotal, nBlocks);
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("threads", std::max(1, nScriptCheckThreads)));
+    ret.push_back(Pair("blocks", (uint64_t)nBlocks));
+    ret.push_back(Pair("lastblock", checkQueueStatsToJSON(statsLast)));
+    ret.push_back(Pair("total", checkQueueStatsToJSON(statsTotal)));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -74,6 +74,7 @@ static const CRPCConvertParam vRPCConvertParams[] =
         {"listunspent", 2},
         {"listunspent", 3},
         {"getblock", 1},
+        {"dbstats", 0},
         {"getblockheader", 1},
         {"gettransaction", 1},
         {"getrawtransaction", 1},
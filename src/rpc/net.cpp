@@ -108,7 +108,16 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "    \"inflight\": [\n"
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
-            "    ]\n"
+            "    ],\n"
+            "    \"msgstats\": {             (json object) Messages exchanged with this peer, by command\n"
+            "      \"command\": {\n"
+            "        \"sentmsgs\": n,         (numeric) Messages sent\n"
+            "        \"sentbytes\": n,        (numeric) Bytes sent, including message headers\n"
+            "        \"recvmsgs\": n,         (numeric) Messages received and processed\n"
+            "        \"recvbytes\": n,        (numeric) Bytes received, including message headers\n"
+            "        \"processtime\": n       (numeric) Microseconds spent processing the received messages\n"
+            "      }, ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -159,6 +168,17 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             obj.push_back(Pair("inflight", heights));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
+        UniValue msgstats(UniValue::VOBJ);
+        for (std::map<std::string, CMsgCounters>::const_iterator it = stats.mapMsgStats.begin(); it != stats.mapMsgStats.end(); it++) {
+            UniValue counters(UniValue::VOBJ);
+            counters.push_back(Pair("sentmsgs", it->second.nSentMsgs));
+            counters.push_back(Pair("sentbytes", it->second.nSentBytes));
+            counters.push_back(Pair("recvmsgs", it->second.nRecvMsgs));
+            counters.push_back(Pair("recvbytes", it->second.nRecvBytes));
+            counters.push_back(Pair("processtime", it->second.nProcessTime));
+            msgstats.push_back(Pair(it->first, counters));
+        }
+        obj.push_back(Pair("msgstats", msgstats));
 
         ret.push_back(obj);
     }
@@ -354,7 +374,9 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "{\n"
             "  \"totalbytesrecv\": n,   (numeric) Total bytes received\n"
             "  \"totalbytessent\": n,   (numeric) Total bytes sent\n"
-            "  \"timemillis\": t        (numeric) Total cpu time\n"
+            "  \"timemillis\": t,       (numeric) Total cpu time\n"
+            "  \"recvbufferhits\": n,   (numeric) Receive buffers reused from the pool\n"
+            "  \"recvbuffermisses\": n  (numeric) Receive buffers allocated because the pool had none\n"
             "}\n"
 
             "\nExamples:\n" +
@@ -364,6 +386,70 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
     obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
     obj.push_back(Pair("timemillis", GetTimeMillis()));
+    uint64_t nPoolHits, nPoolMisses;
+    recvBufferPool.GetStats(nPoolHits, nPoolMisses);
+    obj.push_back(Pair("recvbufferhits", nPoolHits));
+    obj.push_back(Pair("recvbuffermisses", nPoolMisses));
+    return obj;
+}
+
+/** Bucket counts of a CHistogram, without the empty buckets at the end */
+static UniValue HistogramToJSON(const CHistogram& hist)
+{
+    int nBuckets = CHistogram::BUCKETS;
+    while (nBuckets > 0 && hist.vCount[nBuckets - 1] == 0)
+        nBuckets--;
+    UniValue ret(UniValue::VARR);
+    for (int i = 0; i < nBuckets; i++)
+        ret.push_back(hist.vCount[i]);
+    return ret;
+}
+
+UniValue getnetmsgstats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetmsgstats\n"
+            "\nReturns the messages exchanged with all peers since startup by command, how long\n"
+            "processing the received ones took, and how deep the send queues were.\n"
+            "Histograms are arrays of counts: the first counts zeros, entry i the values\n"
+            "from 2^(i-1) up to 2^i - 1.\n"
+
+            "\nResult:\n"
+            "{\n"
+            "  \"commands\": {\n"
+            "    \"command\": {\n"
+            "      \"sentmsgs\": n,            (numeric) Messages sent\n"
+            "      \"sentbytes\": n,           (numeric) Bytes sent, including message headers\n"
+            "      \"recvmsgs\": n,            (numeric) Messages received and processed\n"
+            "      \"recvbytes\": n,           (numeric) Bytes received, including message headers\n"
+            "      \"processtime\": n,         (numeric) Microseconds spent processing the received messages\n"
+            "      \"processtime_hist\": [...] (array) Received messages by microseconds of processing\n"
+            "    }, ...\n"
+            "  },\n"
+            "  \"sendqueue_hist\": [...]      (array) Messages queued for sending by the number of messages then queued\n"
+            "}\n"
+
+            "\nExamples:\n" +
+            HelpExampleCli("getnetmsgstats", "") + HelpExampleRpc("getnetmsgstats", ""));
+
+    CNetMsgStats stats;
+    CNode::GetTotalMsgStats(stats);
+
+    UniValue commands(UniValue::VOBJ);
+    for (std::map<std::string, CMsgCounters>::const_iterator it = stats.mapCommands.begin(); it != stats.mapCommands.end(); it++) {
+        UniValue counters(UniValue::VOBJ);
+        counters.push_back(Pair("sentmsgs", it->second.nSentMsgs));
+        counters.push_back(Pair("sentbytes", it->second.nSentBytes));
+        counters.push_back(Pair("recvmsgs", it->second.nRecvMsgs));
+        counters.push_back(Pair("recvbytes", it->second.nRecvBytes));
+        counters.push_back(Pair("processtime", it->second.nProcessTime));
+        counters.push_back(Pair("processtime_hist", HistogramToJSON(it->second.histProcessTime)));
+        commands.push_back(Pair(it->first, counters));
+    }
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("commands", commands));
+    obj.push_back(Pair("sendqueue_hist", HistogramToJSON(stats.histSendQueue)));
     return obj;
 }
 
@@ -7,11 +7,117 @@
 #define BITCOIN_SCRIPT_SIGCACHE_H
 
 #include "script/interpreter.h"
+#include "uint256.h"
 
+#include <algorithm>
+#include <atomic>
+#include <string.h>
 #include <vector>
 
+/** Default for -maxsigcachesize in MiB: about a million entries, far more than the signature operations of a block */
+static const int64_t DEFAULT_MAX_SIG_CACHE_SIZE = 32;
+/** Upper bound for -maxsigcachesize in MiB */
+static const int64_t MAX_MAX_SIG_CACHE_SIZE = 16384;
+
 class CPubKey;
 
+/**
+ * Fixed-size set of 256-bit keys using cuckoo hashing: every key may live in
+ * one of eight slots derived from its bits, so a lookup reads at most eight
+ * slots and never allocates. Inserting into a full table displaces entries
+ * along a bounded path, and the last one displaced is dropped.
+ *
+ * Callers provide the locking: lookups only need a shared lock, and so
+ * does erasing, which just marks the slot free with an atomic flag for a
+ * later insert to reuse. Insert and Setup need an exclusive lock.
+ */
+class CCuckooKeyCache
+{
+private:
+    std::vector<uint256> table;
+    std::vector<std::atomic<bool> > vFree; //! slot holds no live entry
+    uint32_t nSize;
+    unsigned int nDepthLimit;
+
+    void GetLocations(const uint256& key, uint32_t locs[8]) const
+    {
+        // The key is a salted SHA256, so its words are independent uniform
+        // hashes; map each onto [0, nSize) without a division
+        for (int i = 0; i < 8; i++) {
+            uint32_t nWord;
+            memcpy(&nWord, key.begin() + 4 * i, 4);
+            locs[i] = (uint32_t)(((uint64_t)nWord * nSize) >> 32);
+        }
+    }
+
+public:
+    CCuckooKeyCache() : nSize(0), nDepthLimit(0) {}
+
+    /** Allocate room for about nBytes of entries, dropping the current contents */
+    size_t Setup(size_t nBytes)
+    {
+        size_t nEntries = std::min<size_t>(nBytes / (sizeof(uint256) + 1), 0xffffffff);
+        nSize = nEntries;
+        nDepthLimit = 0;
+        while ((size_t(1) << nDepthLimit) < nEntries)
+            nDepthLimit++;
+        table.assign(nSize, uint256());
+        std::vector<std::atomic<bool> > vFreeNew(nSize);
+        vFree.swap(vFreeNew);
+        for (uint32_t i = 0; i < nSize; i++)
+            vFree[i].store(true, std::memory_order_relaxed);
+        return nSize;
+    }
+
+    bool Contains(const uint256& key, bool fErase)
+    {
+        if (nSize == 0)
+            return false;
+        uint32_t locs[8];
+        GetLocations(key, locs);
+        for (int i = 0; i < 8; i++) {
+            if (table[locs[i]] == key && !vFree[locs[i]].load(std::memory_order_relaxed)) {
+                if (fErase)
+                    vFree[locs[i]].store(true, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Insert(uint256 key)
+    {
+        if (nSize == 0)
+            return;
+        uint32_t locs[8];
+        GetLocations(key, locs);
+        for (int i = 0; i < 8; i++) {
+            if (table[locs[i]] == key) {
+                vFree[locs[i]].store(false, std::memory_order_relaxed);
+                return;
+            }
+        }
+        uint32_t nLastLoc = locs[0];
+        for (unsigned int nDepth = 0; nDepth < nDepthLimit; nDepth++) {
+            for (int i = 0; i < 8; i++) {
+                if (vFree[locs[i]].load(std::memory_order_relaxed)) {
+                    table[locs[i]] = key;
+                    vFree[locs[i]].store(false, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            // No free slot: take the one after the slot we came from and
+            // move its occupant on to one of its own alternatives
+            int nNext = (std::find(locs, locs + 8, nLastLoc) - locs + 1) & 7;
+            nLastLoc = locs[nNext];
+            std::swap(table[nLastLoc], key);
+            GetLocations(key, locs);
+        }
+        // The displaced key at the end of the path is dropped, which acts as
+        // a random eviction that attackers cannot target
+    }
+};
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -23,4 +129,7 @@ public:
     bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 };
 
+/** Size the signature cache from -maxsigcachesize (in MiB) */
+void InitSignatureCache();
+
 #endif // BITCOIN_SCRIPT_SIGCACHE_H
@@ -18,6 +18,10 @@
 #include <string>
 #include <utility>
 #include <vector>
+
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 #include "libzerocoin/Denominations.h"
 #include "libzerocoin/SpendType.h"
 
@@ -467,6 +471,7 @@ I ReadVarInt(Stream& is)
 
 #define FLATDATA(obj) REF(CFlatData((char*)&(obj), (char*)&(obj) + sizeof(obj)))
 #define VARINT(obj) REF(WrapVarInt(REF(obj)))
+#define COMPACTSIZE(obj) REF(CCompactSize(REF(obj)))
 #define LIMITED_STRING(obj, n) REF(LimitedString<n>(REF(obj)))
 
 /** 
@@ -536,6 +541,33 @@ public:
     }
 };
 
+/** Wrapper for serializing an integer as a CompactSize */
+class CCompactSize
+{
+protected:
+    uint64_t& n;
+
+public:
+    CCompactSize(uint64_t& nIn) : n(nIn) {}
+
+    unsigned int GetSerializeSize(int, int) const
+    {
+        return GetSizeOfCompactSize(n);
+    }
+
+    template <typename Stream>
+    void Serialize(Stream& s, int, int) const
+    {
+        WriteCompactSize<Stream>(s, n);
+    }
+
+    template <typename Stream>
+    void Unserialize(Stream& s, int, int)
+    {
+        n = ReadCompactSize<Stream>(s);
+    }
+};
+
 template <size_t Limit>
 class LimitedString
 {
@@ -653,6 +685,16 @@ void Serialize(Stream& os, const std::set<K, Pred, A>& m, int nType, int nVersio
 template <typename Stream, typename K, typename Pred, typename A>
 void Unserialize(Stream& is, std::set<K, Pred, A>& m, int nType, int nVersion);
 
+/**
+ * shared_ptr to an immutable object, serialized as the object itself
+ */
+template <typename T>
+unsigned int GetSerializeSize(const boost::shared_ptr<const T>& p, int nType, int nVersion);
+template <typename Stream, typename T>
+void Serialize(Stream& os, const boost::shared_ptr<const T>& p, int nType, int nVersion);
+template <typename Stream, typename T>
+void Unserialize(Stream& is, boost::shared_ptr<const T>& p, int nType, int nVersion);
+
 
 /**
  * If none of the specialized versions above matched, default to calling member function.
@@ -906,6 +948,30 @@ void Unserialize(Stream& is, std::set<K, Pred, A>& m, int nType, int nVersion)
 }
 
 
+/**
+ * shared_ptr
+ */
+template <typename T>
+unsigned int GetSerializeSize(const boost::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    return GetSerializeSize(*p, nType, nVersion);
+}
+
+template <typename Stream, typename T>
+void Serialize(Stream& os, const boost::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    Serialize(os, *p, nType, nVersion);
+}
+
+template <typename Stream, typename T>
+void Unserialize(Stream& is, boost::shared_ptr<const T>& p, int nType, int nVersion)
+{
+    boost::shared_ptr<T> pNew = boost::make_shared<T>();
+    Unserialize(is, *pNew, nType, nVersion);
+    p = pNew;
+}
+
+
 /**
  * Support for ADD_SERIALIZE_METHODS and READWRITE macro
  */
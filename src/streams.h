@@ -117,6 +117,12 @@ public:
     bool empty() const { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c = 0) { vch.resize(n + nReadPos, c); }
     void reserve(size_type n) { vch.reserve(n + nReadPos); }
+    //! Exchange the whole underlying buffer, e.g. with a pooled one; reading restarts at its beginning
+    void swap(CSerializeData& vchOther)
+    {
+        vch.swap(vchOther);
+        nReadPos = 0;
+    }
     const_reference operator[](size_type pos) const { return vch[pos + nReadPos]; }
     reference operator[](size_type pos) { return vch[pos + nReadPos]; }
     void clear()
@@ -290,6 +296,53 @@ public:
 };
 
 
+/** Read-only stream over memory owned by someone else, e.g. a memory-mapped file.
+ *
+ * Deserializes in place, without first copying the input into a buffer the
+ * way CDataStream does. The memory must outlive the reader.
+ */
+class CMemoryReader
+{
+private:
+    const char* pcur;
+    const char* pend;
+    int nType;
+    int nVersion;
+
+public:
+    CMemoryReader(const char* pbegin, const char* pendIn, int nTypeIn, int nVersionIn) : pcur(pbegin), pend(pendIn), nType(nTypeIn), nVersion(nVersionIn) {}
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+    size_t size() const { return pend - pcur; }
+    bool empty() const { return pcur == pend; }
+
+    CMemoryReader& read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::read() : end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+        return (*this);
+    }
+
+    CMemoryReader& ignore(size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CMemoryReader::ignore() : end of data");
+        pcur += nSize;
+        return (*this);
+    }
+
+    template <typename T>
+    CMemoryReader& operator>>(T& obj)
+    {
+        // Unserialize from this stream
+        ::Unserialize(*this, obj, nType, nVersion);
+        return (*this);
+    }
+};
+
 /** Non-refcounted RAII wrapper for FILE*
  *
  * Will automatically close the file when it goes out of scope if not null.
@@ -16,6 +16,7 @@
 #include "serialize.h"
 #include "util.h"
 
+#include <limits>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp> // for 'map_list_of()'
@@ -26,10 +27,12 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes);
 struct COrphanTx {
-    CTransaction tx;
+    CTransactionRef tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
 };
 extern std::map<uint256, COrphanTx> mapOrphanTransactions;
 extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
@@ -50,7 +53,7 @@ BOOST_AUTO_TEST_CASE(DoS_banning)
     CNode dummyNode1(INVALID_SOCKET, addr1, "", true);
     dummyNode1.nVersion = 1;
     Misbehaving(dummyNode1.GetId(), 100); // Should get banned
-    SendMessages(&dummyNode1, false);
+    SendMessages(&dummyNode1);
     BOOST_CHECK(CNode::IsBanned(addr1));
     BOOST_CHECK(!CNode::IsBanned(ip(0xa0b0c001|0x0000ff00))); // Different IP, not banned
 
@@ -58,11 +61,11 @@ BOOST_AUTO_TEST_CASE(DoS_banning)
     CNode dummyNode2(INVALID_SOCKET, addr2, "", true);
     dummyNode2.nVersion = 1;
     Misbehaving(dummyNode2.GetId(), 50);
-    SendMessages(&dummyNode2, false);
+    SendMessages(&dummyNode2);
     BOOST_CHECK(!CNode::IsBanned(addr2)); // 2 not banned yet...
     BOOST_CHECK(CNode::IsBanned(addr1));  // ... but 1 still should be
     Misbehaving(dummyNode2.GetId(), 50);
-    SendMessages(&dummyNode2, false);
+    SendMessages(&dummyNode2);
     BOOST_CHECK(CNode::IsBanned(addr2));
 }
 
@@ -74,13 +77,13 @@ BOOST_AUTO_TEST_CASE(DoS_banscore)
     CNode dummyNode1(INVALID_SOCKET, addr1, "", true);
     dummyNode1.nVersion = 1;
     Misbehaving(dummyNode1.GetId(), 100);
-    SendMessages(&dummyNode1, false);
+    SendMessages(&dummyNode1);
     BOOST_CHECK(!CNode::IsBanned(addr1));
     Misbehaving(dummyNode1.GetId(), 10);
-    SendMessages(&dummyNode1, false);
+    SendMessages(&dummyNode1);
     BOOST_CHECK(!CNode::IsBanned(addr1));
     Misbehaving(dummyNode1.GetId(), 1);
-    SendMessages(&dummyNode1, false);
+    SendMessages(&dummyNode1);
     BOOST_CHECK(CNode::IsBanned(addr1));
     mapArgs.erase("-banscore");
 }
@@ -96,7 +99,7 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     dummyNode.nVersion = 1;
 
     Misbehaving(dummyNode.GetId(), 100);
-    SendMessages(&dummyNode, false);
+    SendMessages(&dummyNode);
     BOOST_CHECK(CNode::IsBanned(addr));
 
     SetMockTime(nStartTime+60*60);
@@ -112,7 +115,29 @@ CTransaction RandomOrphan()
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    return *it->second.tx;
+}
+
+CMutableTransaction OrphanSpending(const uint256& hashPrev)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.n = 0;
+    tx.vin[0].prevout.hash = hashPrev;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 1*CENT;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    return tx;
+}
+
+size_t OrphansFrom(NodeId peer)
+{
+    size_t nCount = 0;
+    for (std::map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+        if (it->second.fromPeer == peer)
+            nCount++;
+    return nCount;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -187,13 +212,53 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    size_t nNoByteLimit = std::numeric_limits<size_t>::max();
+    LimitOrphanTxSize(40, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, nNoByteLimit);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphansLimits)
+{
+    size_t nNoByteLimit = std::numeric_limits<size_t>::max();
+    unsigned int nTxSize = CTransaction(OrphanSpending(GetRandHash())).GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+
+    // A single peer only gets its share of the pool, keeping its newest orphans
+    int64_t nStartTime = GetTime();
+    std::vector<uint256> vHashes;
+    for (int i = 0; i < 20; i++) {
+        SetMockTime(nStartTime + i);
+        CTransaction tx(OrphanSpending(GetRandHash()));
+        BOOST_CHECK(AddOrphanTx(tx, 0));
+        vHashes.push_back(tx.GetHash());
+    }
+    for (int i = 0; i < 5; i++)
+        AddOrphanTx(OrphanSpending(GetRandHash()), 1);
+    LimitOrphanTxSize(40, nNoByteLimit);
+    BOOST_CHECK_EQUAL(OrphansFrom(0), 40 / ORPHAN_TX_PEER_SHARE);
+    BOOST_CHECK_EQUAL(OrphansFrom(1), 5U);
+    BOOST_CHECK(!mapOrphanTransactions.count(vHashes.front()));
+    BOOST_CHECK(mapOrphanTransactions.count(vHashes.back()));
+
+    // The byte limit applies to the pool and, by share, to every peer
+    for (NodeId i = 10; i < 30; i++)
+        AddOrphanTx(OrphanSpending(GetRandHash()), i);
+    LimitOrphanTxSize(100, 10 * nTxSize);
+    BOOST_CHECK(OrphansFrom(0) <= 2);
+    BOOST_CHECK(OrphansFrom(1) <= 2);
+    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
+
+    // Orphans whose parents never arrive expire
+    AddOrphanTx(OrphanSpending(GetRandHash()), 2);
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME);
+    LimitOrphanTxSize(40, nNoByteLimit);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+// Copyright (c) 2011-2014 The Bitcoin Core developers
+// Copyright (c) 2018 The VELES developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "net.h"
+#include "pow.h"
+#include "script/script.h"
+#include "timedata.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(acceptblock_tests)
+
+/** A proof-of-work block on top of pindexPrev paying its coinbase to OP_TRUE, nSalt tells apart siblings */
+static CBlock CreateBlock(const CBlockIndex* pindexPrev, int nSalt = 0)
+{
+    int nHeight = pindexPrev->nHeight + 1;
+    CMutableTransaction txCoinbase;
+    txCoinbase.vin.resize(1);
+    txCoinbase.vin[0].prevout.SetNull();
+    txCoinbase.vin[0].scriptSig = CScript() << nHeight << nSalt << OP_0;
+    txCoinbase.vout.resize(1);
+    txCoinbase.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    txCoinbase.vout[0].nValue = 0;
+
+    CBlock block;
+    block.nVersion = GetAdjustedTime() >= Params().Zerocoin_StartTime() ? Params().Zerocoin_HeaderVersion() : 3;
+    block.hashPrevBlock = pindexPrev->GetBlockHash();
+    block.nTime = pindexPrev->GetBlockTime() + 60;
+    block.nAccumulatorCheckpoint = pindexPrev->nAccumulatorCheckpoint;
+    block.vtx.push_back(MakeTransactionRef(txCoinbase));
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nBits = GetNextWorkRequired(pindexPrev, &block);
+    return block;
+}
+
+static CBlockIndex* LookupBlockIndex(const uint256& hash)
+{
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    return mi == mapBlockIndex.end() ? NULL : mi->second;
+}
+
+static bool AcceptHeader(const CBlock& block)
+{
+    LOCK(cs_main);
+    CValidationState state;
+    CBlockIndex* pindex = NULL;
+    return AcceptBlockHeader(CBlock(block.GetBlockHeader()), state, &pindex);
+}
+
+BOOST_AUTO_TEST_CASE(acceptblock_out_of_order)
+{
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    CValidationState state;
+    CBlockIndex* pindexGenesis = chainActive.Tip();
+
+    // A child stored ahead of its parent is connected together with it
+    CBlock block1 = CreateBlock(pindexGenesis);
+    BOOST_CHECK(AcceptHeader(block1));
+    CBlock block2 = CreateBlock(LookupBlockIndex(block1.GetHash()));
+    BOOST_CHECK(AcceptHeader(block2));
+
+    BOOST_CHECK(ProcessNewBlock(state, NULL, &block2));
+    BOOST_CHECK(LookupBlockIndex(block2.GetHash())->nStatus & BLOCK_HAVE_DATA);
+    BOOST_CHECK(chainActive.Tip() == pindexGenesis);
+
+    BOOST_CHECK(ProcessNewBlock(state, NULL, &block1));
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block2.GetHash());
+
+    // Proof-of-work blocks past the proof-of-work period fail their stake check and are marked so
+    while (chainActive.Height() < Params().LAST_POW_BLOCK()) {
+        CBlock block = CreateBlock(chainActive.Tip());
+        BOOST_REQUIRE(ProcessNewBlock(state, NULL, &block));
+    }
+    CBlockIndex* pindexLastPoW = chainActive.Tip();
+    CBlock blockPoWEnded = CreateBlock(pindexLastPoW);
+    CValidationState statePoWEnded;
+    BOOST_CHECK(!ProcessNewBlock(statePoWEnded, NULL, &blockPoWEnded));
+    BOOST_CHECK(statePoWEnded.IsInvalid());
+    CBlockIndex* pindexPoWEnded = LookupBlockIndex(blockPoWEnded.GetHash());
+    BOOST_REQUIRE(pindexPoWEnded);
+    BOOST_CHECK(pindexPoWEnded->nStatus & BLOCK_FAILED_VALID);
+    BOOST_CHECK(!(pindexPoWEnded->nStatus & BLOCK_HAVE_DATA));
+    BOOST_CHECK(chainActive.Tip() == pindexLastPoW);
+
+    // Clean up
+    {
+        LOCK(cs_main);
+        CValidationState stateInvalidate;
+        InvalidateBlock(stateInvalidate, chainActive[1]);
+    }
+    ActivateBestChain(state);
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
+BOOST_AUTO_TEST_CASE(acceptblock_stake_data_backfill)
+{
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    CValidationState state;
+
+    CBlockIndex* pindexFork = chainActive.Tip();
+    while (chainActive.Height() < Params().LAST_POW_BLOCK()) {
+        CBlock block = CreateBlock(chainActive.Tip(), 1);
+        BOOST_REQUIRE(ProcessNewBlock(state, NULL, &block));
+    }
+
+    // A header past the proof-of-work period has no stake data until its block arrives
+    CBlock blockHeaderOnly = CreateBlock(chainActive.Tip(), 1);
+    BOOST_CHECK(AcceptHeader(blockHeaderOnly));
+    CBlockIndex* pindexHeaderOnly = LookupBlockIndex(blockHeaderOnly.GetHash());
+    BOOST_REQUIRE(pindexHeaderOnly);
+    BOOST_CHECK(!pindexHeaderOnly->IsProofOfStake());
+
+    // So a child a peer sends without being asked isn't stored, as its stake couldn't be checked
+    CBlock blockChild = CreateBlock(pindexHeaderOnly, 1);
+    {
+        CAddress addr(CService("127.0.0.1", 0));
+        CNode node(INVALID_SOCKET, addr, "", true);
+        BOOST_CHECK(ProcessNewBlock(state, &node, &blockChild));
+    }
+    BOOST_CHECK(LookupBlockIndex(blockChild.GetHash()) == NULL);
+
+    // One we asked for, or load ourselves, is stored and checked once its parent is
+    BOOST_CHECK(ProcessNewBlock(state, NULL, &blockChild));
+    CBlockIndex* pindexChild = LookupBlockIndex(blockChild.GetHash());
+    BOOST_REQUIRE(pindexChild);
+    BOOST_CHECK(pindexChild->nStatus & BLOCK_HAVE_DATA);
+    BOOST_CHECK(!pindexChild->IsProofOfStake());
+
+    // Clean up
+    {
+        LOCK(cs_main);
+        CValidationState stateInvalidate;
+        InvalidateBlock(stateInvalidate, chainActive[pindexFork->nHeight + 1]);
+    }
+    ActivateBestChain(state);
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,120 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Copyright (c) 2018 The VELES developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrman.h"
+#include "clientversion.h"
+#include "streams.h"
+#include "tinyformat.h"
+
+#include <boost/test/unit_test.hpp>
+
+class CAddrManTest : public CAddrMan
+{
+public:
+    //! Run the full consistency check, which Check() only does with DEBUG_ADDRMAN defined
+    int CheckConsistency() { return Check_(); }
+};
+
+/** The n-th address of the 1.2.0.0/16 group, so all of them share their buckets */
+static CAddress GroupAddress(int n)
+{
+    return CAddress(CService(strprintf("1.2.%d.%d", n / 256, n % 256), 8333));
+}
+
+/**
+ * Add nAddresses from one source, so they compete for the 64 "new" buckets of
+ * that source group and replace each other, then mark every third one good, so
+ * they compete for the 8 "tried" buckets of their group and are evicted back.
+ */
+static void FillAddrMan(CAddrManTest& addrman, int nAddresses)
+{
+    CNetAddr source("5.6.7.8");
+    for (int n = 0; n < nAddresses; n++) {
+        addrman.Add(GroupAddress(n), source);
+        if (n % 500 == 0)
+            BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    }
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    for (int n = 0; n < nAddresses; n += 3) {
+        addrman.Good(GroupAddress(n));
+        if (n % 300 == 0)
+            BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+    }
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+}
+
+BOOST_AUTO_TEST_SUITE(addrman_tests)
+
+BOOST_AUTO_TEST_CASE(addrman_select)
+{
+    CAddrManTest addrman;
+    CNetAddr source("5.6.7.8");
+
+    // Nothing to select from an empty table
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK_EQUAL(addrman.Select().ToStringIPPort(), "[::]:0");
+
+    // A single "new" entry is always selected, and still once it is "tried"
+    CAddress addr = GroupAddress(1);
+    BOOST_CHECK(addrman.Add(addr, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK_EQUAL(addrman.Select().ToStringIPPort(), addr.ToStringIPPort());
+    addrman.Good(addr);
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+    BOOST_CHECK_EQUAL(addrman.Select().ToStringIPPort(), addr.ToStringIPPort());
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+
+    // Adding the same address again does not duplicate it
+    BOOST_CHECK(!addrman.Add(addr, source));
+    BOOST_CHECK_EQUAL(addrman.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_slots_consistent)
+{
+    // Enough addresses to overwrite "new" positions and evict "tried" ones
+    CAddrManTest addrman;
+    FillAddrMan(addrman, 6000);
+    BOOST_CHECK(addrman.size() > 0);
+    BOOST_CHECK(addrman.size() < 6000);
+
+    // Whatever is selected is one of the addresses added
+    for (int i = 0; i < 100; i++) {
+        CAddress addr = addrman.Select();
+        BOOST_CHECK_EQUAL(addr.ToStringIP().substr(0, 4), "1.2.");
+    }
+
+    addrman.Clear();
+    BOOST_CHECK_EQUAL(addrman.size(), 0);
+    BOOST_CHECK_EQUAL(addrman.CheckConsistency(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(addrman_snapshot_roundtrip)
+{
+    CAddrManTest addrman;
+    FillAddrMan(addrman, 3000);
+
+    CAddrManTest snapshot;
+    addrman.GetSnapshot(snapshot);
+    BOOST_CHECK_EQUAL(snapshot.CheckConsistency(), 0);
+    BOOST_CHECK_EQUAL(snapshot.size(), addrman.size());
+
+    // The snapshot serializes exactly like the tables it was taken from
+    CDataStream ssOriginal(SER_DISK, CLIENT_VERSION);
+    ssOriginal << addrman;
+    CDataStream ssSnapshot(SER_DISK, CLIENT_VERSION);
+    ssSnapshot << snapshot;
+    BOOST_CHECK(ssOriginal.str() == ssSnapshot.str());
+
+    // ... and reading it back gives the same tables again
+    CAddrManTest reloaded;
+    ssSnapshot >> reloaded;
+    BOOST_CHECK_EQUAL(reloaded.CheckConsistency(), 0);
+    BOOST_CHECK_EQUAL(reloaded.size(), addrman.size());
+    CDataStream ssReloaded(SER_DISK, CLIENT_VERSION);
+    ssReloaded << reloaded;
+    BOOST_CHECK(ssOriginal.str() == ssReloaded.str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,246 @@
+// Copyright (c) 2011-2014 The Bitcoin Core developers
+// Copyright (c) 2018 The VELES developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "main.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+/** A block with a coinbase and three spends, the second spending the first */
+static CBlock BuildBlockTestCase()
+{
+    CBlock block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig.resize(10);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+
+    block.vtx.resize(4);
+    block.nVersion = 1;
+    block.nBits = 0x207fffff;
+    block.nTime = 1000;
+
+    tx.vin[0].prevout.SetNull();
+    block.vtx[0] = MakeTransactionRef(tx);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].prevout.n = 0;
+    block.vtx[1] = MakeTransactionRef(tx);
+    tx.vin[0].prevout.hash = block.vtx[1]->GetHash();
+    block.vtx[2] = MakeTransactionRef(tx);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vout[0].nValue = 43;
+    block.vtx[3] = MakeTransactionRef(tx);
+
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+/** Round trip a compact block through the network serialization, like a peer would send it */
+static CBlockHeaderAndShortTxIDs SendCompactBlock(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblockRecv;
+    stream >> cmpctblockRecv;
+    return cmpctblockRecv;
+}
+
+/** Gives access to the short IDs, to make them collide */
+class TestHeaderAndShortIDs : public CBlockHeaderAndShortTxIDs
+{
+public:
+    TestHeaderAndShortIDs(const CBlock& block) : CBlockHeaderAndShortTxIDs(block) {}
+
+    std::vector<uint64_t>& ShortTxIDs() { return shorttxids; }
+};
+
+static void AddToPool(CTxMemPool& pool, const CTransactionRef& ptx)
+{
+    pool.addUnchecked(ptx->GetHash(), CTxMemPoolEntry(ptx, 0, 0, 0.0, 1));
+}
+
+BOOST_AUTO_TEST_CASE(SimpleRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    AddToPool(pool, block.vtx[2]);
+
+    CBlockHeaderAndShortTxIDs cmpctblock = SendCompactBlock(CBlockHeaderAndShortTxIDs(block));
+    BOOST_CHECK_EQUAL(cmpctblock.BlockTxCount(), block.vtx.size());
+
+    // The coinbase is prefilled, the spend in the mempool is found, the others are missing
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, std::vector<CTransactionRef>()), READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(3));
+
+    // Too few missing transactions is the peer's fault
+    {
+        PartiallyDownloadedBlock partialBlockShort(&pool);
+        BOOST_CHECK_EQUAL(partialBlockShort.InitData(cmpctblock, std::vector<CTransactionRef>()), READ_STATUS_OK);
+        CBlock blockShort;
+        std::vector<CTransaction> vtxMissing(1, *block.vtx[1]);
+        BOOST_CHECK_EQUAL(partialBlockShort.FillBlock(blockShort, vtxMissing), READ_STATUS_INVALID);
+    }
+
+    // The wrong transactions only fail the merkle root check
+    {
+        PartiallyDownloadedBlock partialBlockWrong(&pool);
+        BOOST_CHECK_EQUAL(partialBlockWrong.InitData(cmpctblock, std::vector<CTransactionRef>()), READ_STATUS_OK);
+        CBlock blockWrong;
+        std::vector<CTransaction> vtxMissing;
+        vtxMissing.push_back(*block.vtx[3]);
+        vtxMissing.push_back(*block.vtx[1]);
+        BOOST_CHECK_EQUAL(partialBlockWrong.FillBlock(blockWrong, vtxMissing), READ_STATUS_FAILED);
+    }
+
+    CBlock blockRecv;
+    std::vector<CTransaction> vtxMissing;
+    vtxMissing.push_back(*block.vtx[1]);
+    vtxMissing.push_back(*block.vtx[3]);
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRecv, vtxMissing), READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRecv.GetHash().ToString(), block.GetHash().ToString());
+    BOOST_CHECK_EQUAL(blockRecv.BuildMerkleTree().ToString(), block.hashMerkleRoot.ToString());
+}
+
+BOOST_AUTO_TEST_CASE(ExtraTransactionsTest)
+{
+    // Transactions outside the mempool, like orphans, complete a block as well
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+    AddToPool(pool, block.vtx[3]);
+
+    std::vector<CTransactionRef> vExtraTxn;
+    vExtraTxn.push_back(block.vtx[1]);
+    vExtraTxn.push_back(block.vtx[2]);
+    vExtraTxn.push_back(block.vtx[3]);
+
+    CBlockHeaderAndShortTxIDs cmpctblock = SendCompactBlock(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, vExtraTxn), READ_STATUS_OK);
+    for (size_t i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(partialBlock.IsTxAvailable(i));
+
+    CBlock blockRecv;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRecv, std::vector<CTransaction>()), READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRecv.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(ShortIDCollisionTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    // Two transactions of the block with the same short ID can't be told apart, the full block is needed
+    {
+        TestHeaderAndShortIDs cmpctblock(block);
+        cmpctblock.ShortTxIDs()[1] = cmpctblock.ShortTxIDs()[0];
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(SendCompactBlock(cmpctblock), std::vector<CTransactionRef>()), READ_STATUS_FAILED);
+    }
+
+    // A mempool transaction that matches the short ID of another one is only caught by the merkle root
+    {
+        CMutableTransaction txOther(*block.vtx[3]);
+        txOther.vout[0].nValue = 44;
+        CTransactionRef ptxOther = MakeTransactionRef(txOther);
+        AddToPool(pool, ptxOther);
+
+        TestHeaderAndShortIDs cmpctblock(block);
+        cmpctblock.ShortTxIDs()[2] = cmpctblock.GetShortID(ptxOther->GetHash());
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(SendCompactBlock(cmpctblock), std::vector<CTransactionRef>()), READ_STATUS_OK);
+        BOOST_CHECK(partialBlock.IsTxAvailable(3));
+
+        CBlock blockRecv;
+        std::vector<CTransaction> vtxMissing;
+        vtxMissing.push_back(*block.vtx[1]);
+        vtxMissing.push_back(*block.vtx[2]);
+        BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRecv, vtxMissing), READ_STATUS_FAILED);
+    }
+
+    // An empty compact block is the peer's fault
+    {
+        CBlockHeaderAndShortTxIDs cmpctblockEmpty;
+        PartiallyDownloadedBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblockEmpty, std::vector<CTransactionRef>()), READ_STATUS_INVALID);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(BlockTransactionsRoundTripTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    CBlock block(BuildBlockTestCase());
+
+    CBlockHeaderAndShortTxIDs cmpctblock = SendCompactBlock(CBlockHeaderAndShortTxIDs(block));
+    PartiallyDownloadedBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, std::vector<CTransactionRef>()), READ_STATUS_OK);
+
+    // Ask for what is missing, as the cmpctblock handler does
+    BlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    for (size_t i = 0; i < partialBlock.BlockTxCount(); i++) {
+        if (!partialBlock.IsTxAvailable(i))
+            req.indexes.push_back(i);
+    }
+    BOOST_CHECK_EQUAL(req.indexes.size(), 3U);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BlockTransactionsRequest reqRecv;
+    stream >> reqRecv;
+    BOOST_CHECK(reqRecv.blockhash == req.blockhash);
+    BOOST_CHECK(reqRecv.indexes == req.indexes);
+
+    // Answer it, as the getblocktxn handler does
+    BlockTransactions resp(reqRecv);
+    for (size_t i = 0; i < reqRecv.indexes.size(); i++)
+        resp.txn[i] = *block.vtx[reqRecv.indexes[i]];
+    stream << resp;
+    BlockTransactions respRecv;
+    stream >> respRecv;
+    BOOST_CHECK(respRecv.blockhash == block.GetHash());
+    BOOST_CHECK_EQUAL(respRecv.txn.size(), 3U);
+
+    CBlock blockRecv;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockRecv, respRecv.txn), READ_STATUS_OK);
+    BOOST_CHECK_EQUAL(blockRecv.GetHash().ToString(), block.GetHash().ToString());
+}
+
+BOOST_AUTO_TEST_CASE(TransactionsRequestSerializationTest)
+{
+    // Indexes are sent differentially, and must stay within 16 bits
+    BlockTransactionsRequest req;
+    req.blockhash = GetRandHash();
+    req.indexes.push_back(0);
+    req.indexes.push_back(1);
+    req.indexes.push_back(3);
+    req.indexes.push_back(4);
+    req.indexes.push_back(65535);
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << req;
+    BlockTransactionsRequest reqRecv;
+    stream >> reqRecv;
+    BOOST_CHECK(reqRecv.indexes == req.indexes);
+
+    // A second index right after 65535 would be 65536
+    uint64_t nCount = 2, nFirst = 65535, nSecond = 0;
+    CDataStream streamOverflow(SER_NETWORK, PROTOCOL_VERSION);
+    streamOverflow << req.blockhash << COMPACTSIZE(nCount) << COMPACTSIZE(nFirst) << COMPACTSIZE(nSecond);
+    BlockTransactionsRequest reqOverflow;
+    BOOST_CHECK_THROW(streamOverflow >> reqOverflow, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 #include "clientversion.h"
 #include "key.h"
 #include "merkleblock.h"
+#include "random.h"
 #include "serialize.h"
 #include "streams.h"
 #include "uint256.h"
@@ -17,6 +18,7 @@
 
 #include <vector>
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 #include <boost/tuple/tuple.hpp>
 
@@ -86,7 +88,7 @@ BOOST_AUTO_TEST_CASE(bloom_create_insert_serialize_with_tweak)
 
 BOOST_AUTO_TEST_CASE(bloom_create_insert_key)
 {
-    string strSecret = string("5Kg1gnAjaLfKiwhhPpGS3QfRg2m6awQvaj98JCZBZQ5SuS2F15C");
+    string strSecret = string("88xYWFsRA5UM3rWwYWQNAM2UbcVRC6CUgR6AnnLV4Se2Mg6qCai");
     CBitcoinSecret vchSecret;
     BOOST_CHECK(vchSecret.SetString(strSecret));
 
@@ -460,4 +462,55 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // Last 100 entries, 1% false positive rate
+    CRollingBloomFilter rb(100, 0.01);
+
+    std::vector<uint256> vOld;
+    for (int i = 0; i < 100; i++) {
+        vOld.push_back(GetRandHash());
+        rb.insert(vOld.back());
+    }
+    // No false negatives for the most recent entries
+    BOOST_FOREACH (const uint256& hash, vOld)
+        BOOST_CHECK(rb.contains(hash));
+
+    // Few false positives
+    int nFalsePositives = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb.contains(GetRandHash()))
+            nFalsePositives++;
+    }
+    BOOST_CHECK(nFalsePositives < 300);
+
+    // Entries are forgotten once enough newer ones were inserted
+    std::vector<uint256> vNew;
+    for (int i = 0; i < 200; i++) {
+        vNew.push_back(GetRandHash());
+        rb.insert(vNew.back());
+    }
+    int nStillKnown = 0;
+    BOOST_FOREACH (const uint256& hash, vOld) {
+        if (rb.contains(hash))
+            nStillKnown++;
+    }
+    BOOST_CHECK(nStillKnown < 20);
+    for (int i = 100; i < 200; i++)
+        BOOST_CHECK(rb.contains(vNew[i]));
+
+    rb.reset();
+    nStillKnown = 0;
+    BOOST_FOREACH (const uint256& hash, vNew) {
+        if (rb.contains(hash))
+            nStillKnown++;
+    }
+    BOOST_CHECK(nStillKnown < 20);
+
+    // Keys are raw bytes too
+    std::vector<unsigned char> vKey(10, 'a');
+    rb.insert(vKey);
+    BOOST_CHECK(rb.contains(vKey));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,166 @@
+// Copyright (c) 2012-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_AUTO_TEST_SUITE(checkqueue_tests)
+
+/** A verification that counts how often it ran and returns a preset result */
+class CFakeCheck
+{
+public:
+    std::atomic<int>* pnRuns;
+    bool fResult;
+
+    CFakeCheck() : pnRuns(NULL), fResult(true) {}
+    CFakeCheck(std::atomic<int>* pnRunsIn, bool fResultIn) : pnRuns(pnRunsIn), fResult(fResultIn) {}
+
+    bool operator()()
+    {
+        if (pnRuns)
+            (*pnRuns)++;
+        return fResult;
+    }
+
+    void swap(CFakeCheck& other)
+    {
+        std::swap(pnRuns, other.pnRuns);
+        std::swap(fResult, other.fResult);
+    }
+};
+
+static const unsigned int TEST_WORKERS = 4;
+
+/** A check queue with TEST_WORKERS - 1 worker threads, stopped on destruction */
+struct CheckQueueSetup {
+    CCheckQueue<CFakeCheck> queue;
+    boost::thread_group threadGroup;
+
+    CheckQueueSetup() : queue(16, TEST_WORKERS)
+    {
+        for (unsigned int i = 0; i < TEST_WORKERS - 1; i++)
+            threadGroup.create_thread(boost::bind(&CCheckQueue<CFakeCheck>::Thread, &queue));
+    }
+    ~CheckQueueSetup()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+    }
+};
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_runs_every_check_once, CheckQueueSetup)
+{
+    // Batches of every size, spread over the deques in any order, run
+    // exactly once each before Wait returns
+    const int nChecks = 1000;
+    boost::scoped_array<std::atomic<int> > vRuns(new std::atomic<int>[nChecks]);
+    for (int i = 0; i < nChecks; i++)
+        vRuns[i] = 0;
+
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        int nPos = 0;
+        for (int nBatch = 1; nPos < nChecks; nBatch++) {
+            std::vector<CFakeCheck> vChecks;
+            for (int i = 0; i < nBatch && nPos < nChecks; i++, nPos++)
+                vChecks.push_back(CFakeCheck(&vRuns[nPos], true));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+    }
+    for (int i = 0; i < nChecks; i++)
+        BOOST_CHECK_EQUAL(vRuns[i].load(), 1);
+    BOOST_CHECK(queue.IsIdle());
+}
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_failure_propagation, CheckQueueSetup)
+{
+    // A single failing check fails the session wherever it is queued, and
+    // the next session starts from a clean result
+    const int nChecks = 200;
+    for (int nFail = 0; nFail < nChecks; nFail += 37) {
+        {
+            CCheckQueueControl<CFakeCheck> control(&queue);
+            std::vector<CFakeCheck> vChecks;
+            for (int i = 0; i < nChecks; i++)
+                vChecks.push_back(CFakeCheck(NULL, i != nFail));
+            control.Add(vChecks);
+            BOOST_CHECK(!control.Wait());
+        }
+        {
+            CCheckQueueControl<CFakeCheck> control(&queue);
+            std::vector<CFakeCheck> vChecks(nChecks, CFakeCheck(NULL, true));
+            control.Add(vChecks);
+            BOOST_CHECK(control.Wait());
+        }
+    }
+    BOOST_CHECK(queue.IsIdle());
+}
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_wait_under_contention, CheckQueueSetup)
+{
+    // Many short sessions whose checks arrive one at a time, so the workers
+    // keep stealing from each other while the master is still adding; Wait
+    // must not return before the last check ran
+    std::atomic<int> nRuns(0);
+    for (int nSession = 1; nSession <= 100; nSession++) {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        for (int i = 0; i < 50; i++) {
+            std::vector<CFakeCheck> vChecks(1, CFakeCheck(&nRuns, true));
+            control.Add(vChecks);
+        }
+        BOOST_CHECK(control.Wait());
+        BOOST_CHECK_EQUAL(nRuns.load(), 50 * nSession);
+    }
+    BOOST_CHECK(queue.IsIdle());
+}
+
+BOOST_FIXTURE_TEST_CASE(checkqueue_stats, CheckQueueSetup)
+{
+    CCheckQueueStats last, total;
+    uint64_t nSessions;
+
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        std::vector<CFakeCheck> vChecks(10, CFakeCheck(NULL, true));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    queue.GetStats(last, total, nSessions);
+    BOOST_CHECK_EQUAL(nSessions, 1U);
+    BOOST_CHECK_EQUAL(last.nChecks, 10U);
+
+    // Sessions that are not recorded, like TestBlockValidity's, leave the statistics alone
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue, false);
+        std::vector<CFakeCheck> vChecks(20, CFakeCheck(NULL, true));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    queue.GetStats(last, total, nSessions);
+    BOOST_CHECK_EQUAL(nSessions, 1U);
+    BOOST_CHECK_EQUAL(last.nChecks, 10U);
+    BOOST_CHECK_EQUAL(total.nChecks, 10U);
+
+    {
+        CCheckQueueControl<CFakeCheck> control(&queue);
+        std::vector<CFakeCheck> vChecks(5, CFakeCheck(NULL, true));
+        control.Add(vChecks);
+        BOOST_CHECK(control.Wait());
+    }
+    queue.GetStats(last, total, nSessions);
+    BOOST_CHECK_EQUAL(nSessions, 2U);
+    BOOST_CHECK_EQUAL(last.nChecks, 5U);
+    BOOST_CHECK_EQUAL(total.nChecks, 15U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,83 @@
+// Copyright (c) 2012-2014 The Bitcoin Core developers
+// Copyright (c) 2018 The VELES developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(leveldbwrapper_tests)
+
+/** Options of an in-memory database named strName, opened with the -db* arguments currently set */
+static std::string OpenedOptions(const std::string& strName)
+{
+    CLevelDBWrapper db(boost::filesystem::path(), 1 << 20, true, false, strName);
+    return db.GetOptionsString();
+}
+
+static void ClearDBArgs()
+{
+    const char* const pszOptions[] = {"dbcompression", "dbblocksize", "dbbloombits", "dbmaxopenfiles", "dbwritebuffer"};
+    for (unsigned int i = 0; i < sizeof(pszOptions) / sizeof(pszOptions[0]); i++) {
+        mapArgs.erase(std::string("-") + pszOptions[i]);
+        mapArgs.erase(std::string("-") + pszOptions[i] + "-chainstate");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_compression_arg)
+{
+    ClearDBArgs();
+    BOOST_CHECK(OpenedOptions("chainstate").find("compression=none") != std::string::npos);
+
+    // A bare -dbcompression, as given on the command line, turns compression on
+    mapArgs["-dbcompression"] = "";
+    BOOST_CHECK(OpenedOptions("chainstate").find("compression=snappy") != std::string::npos);
+
+    // A per-database setting overrides the global one, bare or not
+    mapArgs["-dbcompression"] = "0";
+    mapArgs["-dbcompression-chainstate"] = "";
+    BOOST_CHECK(OpenedOptions("chainstate").find("compression=snappy") != std::string::npos);
+    BOOST_CHECK(OpenedOptions("blockindex").find("compression=none") != std::string::npos);
+
+    mapArgs["-dbcompression"] = "1";
+    mapArgs["-dbcompression-chainstate"] = "0";
+    BOOST_CHECK(OpenedOptions("chainstate").find("compression=none") != std::string::npos);
+    BOOST_CHECK(OpenedOptions("blockindex").find("compression=snappy") != std::string::npos);
+    ClearDBArgs();
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_clamped_args)
+{
+    ClearDBArgs();
+    mapArgs["-dbblocksize"] = "1";
+    mapArgs["-dbmaxopenfiles"] = "-5";
+    mapArgs["-dbbloombits"] = "0";
+    mapArgs["-dbwritebuffer-chainstate"] = "100000000";
+    std::string strOptions = OpenedOptions("chainstate");
+    BOOST_CHECK(strOptions.find(strprintf("block_size=%d,", MIN_DB_BLOCK_SIZE)) != std::string::npos);
+    BOOST_CHECK(strOptions.find(strprintf("max_open_files=%d,", MIN_DB_MAX_OPEN_FILES)) != std::string::npos);
+    BOOST_CHECK(strOptions.find(strprintf("write_buffer_size=%d,", MAX_DB_WRITE_BUFFER_KB << 10)) != std::string::npos);
+    BOOST_CHECK(strOptions.find("bloom=none") != std::string::npos);
+    ClearDBArgs();
+}
+
+BOOST_AUTO_TEST_CASE(leveldbwrapper_stats_order)
+{
+    std::vector<CLevelDBStats> vStatsBefore;
+    GetLevelDBStats(vStatsBefore);
+
+    // Whatever order they are opened and allocated in, the stats come out by name
+    CLevelDBWrapper dbZerocoin(boost::filesystem::path(), 1 << 20, true, false, "zerocoin");
+    CLevelDBWrapper dbBlockIndex(boost::filesystem::path(), 1 << 20, true, false, "blockindex");
+    CLevelDBWrapper dbSporks(boost::filesystem::path(), 1 << 20, true, false, "sporks");
+    std::vector<CLevelDBStats> vStats;
+    GetLevelDBStats(vStats);
+    BOOST_CHECK_EQUAL(vStats.size(), vStatsBefore.size() + 3);
+    for (size_t i = 1; i < vStats.size(); i++)
+        BOOST_CHECK(vStats[i - 1].strName <= vStats[i].strName);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -2,10 +2,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "key.h"
 #include "main.h"
+#include "script/interpreter.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 #include <list>
 
@@ -99,4 +103,368 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    // Test the package statistics and secondary indexes of CTxMemPool
+
+    // A low-fee parent with a high-fee child, plus an unrelated transaction
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout.hash = txParent.GetHash();
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+    CMutableTransaction txOther;
+    txOther.vin.resize(1);
+    txOther.vin[0].scriptSig = CScript() << OP_12;
+    txOther.vout.resize(1);
+    txOther.vout[0].scriptPubKey = CScript() << OP_12 << OP_EQUAL;
+    txOther.vout[0].nValue = 22000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    LOCK(testPool.cs);
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 3, 0.0, 1));
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 20000LL, 1, 0.0, 1));
+    testPool.addUnchecked(txOther.GetHash(), CTxMemPoolEntry(txOther, 5000LL, 2, 0.0, 1));
+
+    const CTxMemPoolEntry& parent = testPool.mapTx[txParent.GetHash()];
+    const CTxMemPoolEntry& child = testPool.mapTx[txChild.GetHash()];
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 21000LL);
+    BOOST_CHECK_EQUAL(parent.GetSizeWithDescendants(), parent.GetTxSize() + child.GetTxSize());
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(child.GetFeesWithAncestors(), 21000LL);
+
+    // Oldest entry first
+    BOOST_CHECK(testPool.setEntriesByTime.begin()->second == txChild.GetHash());
+    // The parent is carried by its child, so the unrelated transaction is evicted first
+    BOOST_CHECK(testPool.setEntriesByDescendantScore.begin()->hash == txOther.GetHash());
+    // The child pays for its parent and their package mines first; the parent alone scores lowest
+    BOOST_CHECK(testPool.setEntriesByAncestorScore.rbegin()->hash == txChild.GetHash());
+    BOOST_CHECK(testPool.setEntriesByAncestorScore.begin()->hash == txParent.GetHash());
+
+    // Removing the child leaves the parent on its own
+    std::list<CTransaction> removed;
+    testPool.remove(txChild, removed, false);
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 1);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 1000LL);
+    BOOST_CHECK(testPool.setEntriesByDescendantScore.begin()->hash == txParent.GetHash());
+
+    // Re-adding the parent while its child is in the pool recomputes both packages
+    testPool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 20000LL, 1, 0.0, 1));
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetCountWithAncestors(), 1);
+    testPool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000LL, 3, 0.0, 1));
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txParent.GetHash()].GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(testPool.setEntriesByAncestorScore.size(), 3);
+
+    testPool.clear();
+    BOOST_CHECK(testPool.setEntriesByTime.empty());
+    BOOST_CHECK(testPool.setEntriesByDescendantScore.empty());
+    BOOST_CHECK(testPool.setEntriesByAncestorScore.empty());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolAncestorLimitTest)
+{
+    // Test the chain limits and re-adding a transaction between relatives already in the pool
+
+    // txGrand -> txParent -> txChild, where txChild also spends txGrand directly
+    CMutableTransaction txGrand;
+    txGrand.vin.resize(1);
+    txGrand.vin[0].scriptSig = CScript() << OP_11;
+    txGrand.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txGrand.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txGrand.vout[i].nValue = 10000LL;
+    }
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vin[0].prevout = COutPoint(txGrand.GetHash(), 0);
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 9000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(2);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vin[1].scriptSig = CScript() << OP_11;
+    txChild.vin[1].prevout = COutPoint(txGrand.GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 18000LL;
+
+    CTxMemPool testPool(CFeeRate(0));
+    LOCK(testPool.cs);
+    CTxMemPoolEntry entryGrand(txGrand, 1000LL, 1, 0.0, 1);
+    CTxMemPoolEntry entryParent(txParent, 1000LL, 2, 0.0, 1);
+    CTxMemPoolEntry entryChild(txChild, 1000LL, 3, 0.0, 1);
+    testPool.addUnchecked(txGrand.GetHash(), entryGrand);
+    testPool.addUnchecked(txParent.GetHash(), entryParent);
+
+    std::set<uint256> setAncestors;
+    std::string errString;
+    BOOST_CHECK(testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 3, 1000000, 3, 1000000, errString));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 2);
+    // One ancestor too many
+    setAncestors.clear();
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 2, 1000000, 3, 1000000, errString));
+    // txGrand would get a third descendant
+    setAncestors.clear();
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 3, 1000000, 2, 1000000, errString));
+    // The package would outgrow the size limits
+    setAncestors.clear();
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 3, entryChild.GetTxSize(), 3, 1000000, errString));
+    setAncestors.clear();
+    BOOST_CHECK(!testPool.CalculateMemPoolAncestors(entryChild, setAncestors, 3, 1000000, 3, entryChild.GetTxSize(), errString));
+
+    // Take txParent out and put it back below txGrand and above txChild: txChild
+    // gains only txParent, since it already descended from txGrand
+    testPool.addUnchecked(txChild.GetHash(), entryChild);
+    std::list<CTransaction> removed;
+    testPool.remove(txParent, removed, false);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txChild.GetHash()].GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(testPool.mapTx[txGrand.GetHash()].GetCountWithDescendants(), 2);
+    testPool.addUnchecked(txParent.GetHash(), entryParent);
+    const CTxMemPoolEntry& grand = testPool.mapTx[txGrand.GetHash()];
+    const CTxMemPoolEntry& parent = testPool.mapTx[txParent.GetHash()];
+    const CTxMemPoolEntry& child = testPool.mapTx[txChild.GetHash()];
+    BOOST_CHECK_EQUAL(grand.GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(grand.GetFeesWithDescendants(), 3000LL);
+    BOOST_CHECK_EQUAL(parent.GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(child.GetSizeWithAncestors(), grand.GetTxSize() + parent.GetTxSize() + child.GetTxSize());
+    BOOST_CHECK_EQUAL(testPool.setEntriesByAncestorScore.size(), 3);
+    BOOST_CHECK_EQUAL(testPool.setEntriesByDescendantScore.size(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    // Test expiry, trimming and the rolling minimum fee
+
+    CMutableTransaction tx[4];
+    for (int i = 0; i < 4; i++)
+    {
+        tx[i].vin.resize(1);
+        tx[i].vin[0].scriptSig = CScript() << OP_11 << i;
+        tx[i].vout.resize(1);
+        tx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx[i].vout[0].nValue = 10000LL;
+    }
+
+    SetMockTime(1000);
+    CTxMemPool testPool(CFeeRate(1000));
+    for (int i = 0; i < 4; i++)
+        testPool.addUnchecked(tx[i].GetHash(), CTxMemPoolEntry(tx[i], 1000LL * (i + 1), 100 * i, 0.0, 1));
+
+    // Only the entries that arrived before the cut-off expire
+    BOOST_CHECK_EQUAL(testPool.Expire(150), 2);
+    BOOST_CHECK(!testPool.exists(tx[0].GetHash()));
+    BOOST_CHECK(!testPool.exists(tx[1].GetHash()));
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(0).GetFeePerK(), 0);
+
+    // Trimming evicts the lowest fee rate first and raises the minimum fee above it
+    testPool.TrimToSize(testPool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK(!testPool.exists(tx[2].GetHash()));
+    BOOST_CHECK(testPool.exists(tx[3].GetHash()));
+    CFeeRate minFee = testPool.GetMinFee(1);
+    BOOST_CHECK(minFee > CFeeRate(1000));
+
+    // Without a block the minimum fee holds; after one it halves every half-life
+    SetMockTime(1000 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(testPool.GetMinFee(1) == minFee);
+    std::list<CTransaction> conflicts;
+    testPool.removeForBlock(std::vector<CTransactionRef>(), 2, conflicts);
+    SetMockTime(1000 + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(1).GetFeePerK(), minFee.GetFeePerK() / 2);
+
+    // ... until it drops below half the relay fee and resets
+    SetMockTime(1000 + 10 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(testPool.GetMinFee(1).GetFeePerK(), 0);
+
+    SetMockTime(0);
+}
+
+/** A transaction spending prevout, paying 0.99 of nValueIn back to key, with a valid signature unless fValid is false */
+static CMutableTransaction CreateSpend(const COutPoint& prevout, CAmount nValueIn, const CKey& key, bool fValid = true)
+{
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    CMutableTransaction tx;
+    tx.vin.push_back(CTxIn(prevout));
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[0].nValue = nValueIn * 99 / 100;
+
+    uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL);
+    if (!fValid)
+        hash = ~hash;
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    tx.vin[0].scriptSig = CScript() << vchSig << ToByteVector(key.GetPubKey());
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolBatchAcceptTest)
+{
+    // AcceptToMemoryPoolBatch must accept and reject exactly what
+    // AcceptToMemoryPool does one transaction at a time
+
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    const CAmount nValue = COIN;
+
+    LOCK(cs_main);
+    uint256 hashFunding = GetRandHash();
+    {
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(hashFunding);
+        coins->fCoinBase = false;
+        coins->nVersion = 1;
+        coins->nHeight = chainActive.Height();
+        coins->vout.assign(5, CTxOut(nValue, scriptPubKey));
+    }
+
+    std::vector<CTransaction> vtxValid;
+    vtxValid.push_back(CreateSpend(COutPoint(hashFunding, 0), nValue, key));
+    vtxValid.push_back(CreateSpend(COutPoint(hashFunding, 1), nValue, key));
+
+    std::vector<CTransaction> vtxMixed;
+    // Valid, a bad signature, a parent and its child, a double spend and a missing input
+    vtxMixed.push_back(CreateSpend(COutPoint(hashFunding, 2), nValue, key));
+    vtxMixed.push_back(CreateSpend(COutPoint(hashFunding, 3), nValue, key, false));
+    vtxMixed.push_back(CreateSpend(COutPoint(hashFunding, 4), nValue, key));
+    vtxMixed.push_back(CreateSpend(COutPoint(vtxMixed[2].GetHash(), 0), nValue * 99 / 100, key));
+    vtxMixed.push_back(CreateSpend(COutPoint(hashFunding, 2), nValue / 2, key));
+    vtxMixed.push_back(CreateSpend(COutPoint(GetRandHash(), 0), nValue, key));
+    bool vExpected[] = {true, false, true, true, false, false};
+
+    // All valid, so the scripts are verified on the script check threads;
+    // then mixed with invalid ones, which fall back to the full checks
+    std::vector<std::vector<CTransaction> > vBatches;
+    vBatches.push_back(vtxValid);
+    vBatches.push_back(vtxMixed);
+    CTxMemPool poolBatch(CFeeRate(0));
+    CTxMemPool poolSingle(CFeeRate(0));
+    for (unsigned int n = 0; n < vBatches.size(); n++) {
+        const std::vector<CTransaction>& vtx = vBatches[n];
+        std::vector<CValidationState> vState;
+        std::vector<bool> vAccepted;
+        std::vector<bool> vMissingInputs;
+        int nAccepted = AcceptToMemoryPoolBatch(poolBatch, vtx, vState, vAccepted, false, NULL, &vMissingInputs);
+
+        int nAcceptedSingle = 0;
+        for (unsigned int i = 0; i < vtx.size(); i++) {
+            CValidationState state;
+            bool fMissingInputs = false;
+            bool fAccepted = AcceptToMemoryPool(poolSingle, state, vtx[i], false, &fMissingInputs);
+            if (fAccepted)
+                nAcceptedSingle++;
+            BOOST_CHECK_EQUAL(vAccepted[i], fAccepted);
+            BOOST_CHECK_EQUAL(vMissingInputs[i], fMissingInputs);
+            BOOST_CHECK_EQUAL(vState[i].GetRejectCode(), state.GetRejectCode());
+            BOOST_CHECK_EQUAL(vState[i].GetRejectReason(), state.GetRejectReason());
+            if (n == 0)
+                BOOST_CHECK(fAccepted);
+            else
+                BOOST_CHECK_EQUAL(fAccepted, vExpected[i]);
+        }
+        BOOST_CHECK_EQUAL(nAccepted, nAcceptedSingle);
+        BOOST_CHECK_EQUAL(poolBatch.size(), poolSingle.size());
+    }
+
+    pcoinsTip->ModifyCoins(hashFunding)->Clear();
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDumpLoadTest)
+{
+    // Transactions written to mempool.dat come back with their entry time
+    // and the fee deltas, except those that expired or became invalid
+
+    CKey key;
+    key.MakeNewKey(true);
+    CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+    const CAmount nValue = COIN;
+    const int64_t nExpiry = DEFAULT_MEMPOOL_EXPIRY * 60 * 60;
+    const int64_t nStart = 1500000000;
+
+    LOCK(cs_main);
+    mempool.clear();
+    uint256 hashFunding = GetRandHash();
+    {
+        CCoinsModifier coins = pcoinsTip->ModifyCoins(hashFunding);
+        coins->fCoinBase = false;
+        coins->nVersion = 1;
+        coins->nHeight = chainActive.Height();
+        coins->vout.assign(3, CTxOut(nValue, scriptPubKey));
+    }
+
+    // An old transaction, a recent one, and one whose input is spent after the dump
+    CTransaction txOld = CreateSpend(COutPoint(hashFunding, 0), nValue, key);
+    CTransaction txRecent = CreateSpend(COutPoint(hashFunding, 1), nValue, key);
+    CTransaction txSpent = CreateSpend(COutPoint(hashFunding, 2), nValue, key);
+    CValidationState state;
+    SetMockTime(nStart);
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, txOld, true, NULL));
+    SetMockTime(nStart + nExpiry / 2);
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, txRecent, true, NULL));
+    BOOST_CHECK(AcceptToMemoryPool(mempool, state, txSpent, true, NULL));
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+
+    // Deltas are kept for pool transactions as well as ones not (yet) seen
+    uint256 hashUnseen = GetRandHash();
+    mempool.PrioritiseTransaction(txRecent.GetHash(), txRecent.GetHash().ToString(), 1000.0, 5000);
+    mempool.PrioritiseTransaction(hashUnseen, hashUnseen.ToString(), 0.0, -3000);
+
+    BOOST_CHECK(DumpMempool());
+    BOOST_CHECK(boost::filesystem::exists(GetDataDir() / "mempool.dat"));
+    mempool.clear();
+    {
+        LOCK(mempool.cs);
+        mempool.mapDeltas.clear();
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // Load after txOld expired, with the input of txSpent gone
+    pcoinsTip->ModifyCoins(hashFunding)->vout[2].SetNull();
+    SetMockTime(nStart + nExpiry);
+    BOOST_CHECK(LoadMempool());
+
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+    BOOST_CHECK(!mempool.exists(txOld.GetHash()));
+    BOOST_CHECK(mempool.exists(txRecent.GetHash()));
+    BOOST_CHECK(!mempool.exists(txSpent.GetHash()));
+    {
+        LOCK(mempool.cs);
+        BOOST_CHECK_EQUAL(mempool.mapTx[txRecent.GetHash()].GetTime(), nStart + nExpiry / 2);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas.size(), 2);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[txRecent.GetHash()].first, 1000.0);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[txRecent.GetHash()].second, 5000);
+        BOOST_CHECK_EQUAL(mempool.mapDeltas[hashUnseen].second, -3000);
+    }
+
+    // A second load finds the remaining transaction already in the pool
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 1);
+
+    mempool.clear();
+    {
+        LOCK(mempool.cs);
+        mempool.mapDeltas.clear();
+    }
+    boost::filesystem::remove(GetDataDir() / "mempool.dat");
+    pcoinsTip->ModifyCoins(hashFunding)->Clear();
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
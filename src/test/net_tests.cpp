@@ -0,0 +1,311 @@
+// Copyright (c) 2012-2014 The Bitcoin Core developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "main.h"
+#include "net.h"
+#include "serialize.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+#ifndef WIN32
+#include <sys/socket.h>
+#endif
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+#ifndef WIN32
+/** Sum of the sizes of the messages still queued for pnode */
+static size_t QueuedSize(const CNode* pnode)
+{
+    size_t nSize = 0;
+    for (std::deque<CSerializedNetMsg>::const_iterator it = pnode->vSendMsg.begin(); it != pnode->vSendMsg.end(); ++it)
+        nSize += (*it)->size();
+    return nSize;
+}
+
+BOOST_AUTO_TEST_CASE(socket_send_data_partial)
+{
+    // A connected socket pair with small buffers, so the queued messages only
+    // go out a piece at a time and sends regularly end inside a message
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int nBufSize = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &nBufSize, sizeof(nBufSize));
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &nBufSize, sizeof(nBufSize));
+
+    CAddress addr(CService("127.0.0.1", 0));
+    CNode node(fds[0], addr, "", true);
+
+    // Messages of different sizes, one of them queued twice by reference
+    std::string strExpected;
+    std::vector<CSerializedNetMsg> vMsgs;
+    for (int i = 0; i < 6; i++) {
+        std::vector<unsigned char> vPayload(1 + i * 7919, (unsigned char)i);
+        vMsgs.push_back(CreateNetMessage(PROTOCOL_VERSION, "block", vPayload));
+    }
+    vMsgs.push_back(vMsgs[3]);
+    for (size_t i = 0; i < vMsgs.size(); i++) {
+        strExpected.append(vMsgs[i]->begin(), vMsgs[i]->end());
+        node.PushSharedMessage(vMsgs[i]);
+    }
+
+    std::string strReceived;
+    bool fPartial = false;
+    for (int nRound = 0; nRound < 100000 && strReceived.size() < strExpected.size(); nRound++) {
+        {
+            LOCK(node.cs_vSend);
+            // The queue accounting matches what is left to send
+            BOOST_CHECK_EQUAL(node.nSendSize, QueuedSize(&node));
+            if (node.vSendMsg.empty()) {
+                BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+            } else {
+                BOOST_CHECK(node.nSendOffset < node.vSendMsg.front()->size());
+                if (node.nSendOffset > 0)
+                    fPartial = true;
+                // Everything before the offset into the queue went out already
+                BOOST_CHECK_EQUAL(node.nSendBytes + node.nSendSize - node.nSendOffset, strExpected.size());
+            }
+        }
+
+        char buf[1000];
+        ssize_t nRead = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+        if (nRead > 0)
+            strReceived.append(buf, nRead);
+
+        LOCK(node.cs_vSend);
+        if (!node.vSendMsg.empty())
+            SocketSendData(&node);
+    }
+
+    BOOST_CHECK(fPartial);
+    BOOST_CHECK(strReceived == strExpected);
+    {
+        LOCK(node.cs_vSend);
+        BOOST_CHECK(node.vSendMsg.empty());
+        BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+        BOOST_CHECK_EQUAL(node.nSendOffset, 0U);
+        BOOST_CHECK_EQUAL(node.nSendBytes, strExpected.size());
+    }
+    close(fds[1]);
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(inventory_send_rate_bounded)
+{
+    CAddress addr(CService("127.0.0.1", 0));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    // Transactions with rising fee rates, and one that isn't in the mempool
+    std::vector<uint256> vHashes;
+    const unsigned int nTx = 3 * INVENTORY_BROADCAST_MAX_TX;
+    for (unsigned int i = 0; i < nTx; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000;
+        CTransactionRef ptx = MakeTransactionRef(tx);
+        mempool.addUnchecked(ptx->GetHash(), CTxMemPoolEntry(ptx, 1000 * (i + 1), 0, 0.0, 1));
+        vHashes.push_back(ptx->GetHash());
+        node.PushInventory(CInv(MSG_TX, ptx->GetHash()));
+    }
+    node.PushInventory(CInv(MSG_TX, GetRandHash()));
+    // Queuing a transaction twice still announces it once
+    node.PushInventory(CInv(MSG_TX, vHashes[0]));
+    node.PushInventory(CInv(MSG_BLOCK, GetRandHash()));
+
+    // Without a trickle only the block goes out
+    std::vector<CInv> vInv;
+    node.GetInventoryToSend(false, vInv);
+    BOOST_CHECK_EQUAL(vInv.size(), 1U);
+    BOOST_CHECK_EQUAL(vInv[0].type, MSG_BLOCK);
+
+    // Each trickle announces at most INVENTORY_BROADCAST_MAX_TX transactions, highest fee rate first
+    std::set<uint256> setAnnounced;
+    for (unsigned int nTrickle = 0; nTrickle < 3; nTrickle++) {
+        vInv.clear();
+        node.GetInventoryToSend(true, vInv);
+        BOOST_CHECK_EQUAL(vInv.size(), (size_t)INVENTORY_BROADCAST_MAX_TX);
+        for (unsigned int i = 0; i < vInv.size(); i++) {
+            BOOST_CHECK(vInv[i].hash == vHashes[nTx - 1 - nTrickle * INVENTORY_BROADCAST_MAX_TX - i]);
+            setAnnounced.insert(vInv[i].hash);
+        }
+    }
+    BOOST_CHECK_EQUAL(setAnnounced.size(), (size_t)nTx);
+
+    // The transaction outside the mempool was dropped rather than announced
+    vInv.clear();
+    node.GetInventoryToSend(true, vInv);
+    BOOST_CHECK(vInv.empty());
+    {
+        LOCK(node.cs_inventory);
+        BOOST_CHECK(node.setInventoryTxToSend.empty());
+    }
+
+    // A child paying a higher fee rate than everything else still waits for its parent
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].prevout.hash = GetRandHash();
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = 1000;
+    CTransactionRef ptxParent = MakeTransactionRef(txParent);
+    mempool.addUnchecked(ptxParent->GetHash(), CTxMemPoolEntry(ptxParent, 1, 0, 0.0, 1));
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(ptxParent->GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 500;
+    CTransactionRef ptxChild = MakeTransactionRef(txChild);
+    mempool.addUnchecked(ptxChild->GetHash(), CTxMemPoolEntry(ptxChild, 1000000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(mempool.mapTx[ptxChild->GetHash()].GetCountWithAncestors(), 2U);
+
+    node.PushInventory(CInv(MSG_TX, ptxChild->GetHash()));
+    node.PushInventory(CInv(MSG_TX, ptxParent->GetHash()));
+    vInv.clear();
+    node.GetInventoryToSend(true, vInv);
+    BOOST_REQUIRE_EQUAL(vInv.size(), 2U);
+    BOOST_CHECK(vInv[0].hash == ptxParent->GetHash());
+    BOOST_CHECK(vInv[1].hash == ptxChild->GetHash());
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(histogram_buckets)
+{
+    CHistogram hist;
+    hist.Add(0);
+    hist.Add(1);
+    hist.Add(2);
+    hist.Add(3);
+    hist.Add(4);
+    hist.Add(7);
+    hist.Add(8);
+    hist.Add(uint64_t(1) << 40);
+    BOOST_CHECK_EQUAL(hist.vCount[0], 1U);
+    BOOST_CHECK_EQUAL(hist.vCount[1], 1U);
+    BOOST_CHECK_EQUAL(hist.vCount[2], 2U);
+    BOOST_CHECK_EQUAL(hist.vCount[3], 2U);
+    BOOST_CHECK_EQUAL(hist.vCount[4], 1U);
+    // Values beyond the last bucket end up in it
+    BOOST_CHECK_EQUAL(hist.vCount[CHistogram::BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(hist.nCount, 8U);
+    BOOST_CHECK_EQUAL(hist.nSum, 25U + (uint64_t(1) << 40));
+
+    CHistogram histTotal;
+    histTotal.Add(5);
+    histTotal.Add(hist);
+    BOOST_CHECK_EQUAL(histTotal.vCount[3], 3U);
+    BOOST_CHECK_EQUAL(histTotal.nCount, 9U);
+}
+
+BOOST_AUTO_TEST_CASE(msg_stats_unknown_commands)
+{
+    // Commands a peer makes up are all counted as NET_MESSAGE_COMMAND_OTHER
+    CNetMsgStats statsPeer1, statsPeer2;
+    for (unsigned int i = 0; i < 100; i++) {
+        statsPeer1.Get(strprintf("a%u", i)).nRecvMsgs++;
+        statsPeer2.Get(strprintf("b%u", i)).nRecvMsgs++;
+    }
+    statsPeer1.Get("inv").nRecvMsgs++;
+    statsPeer2.Get("mnb").nSentMsgs++;
+    BOOST_CHECK_EQUAL(statsPeer1.mapCommands.size(), 2U);
+    BOOST_CHECK_EQUAL(statsPeer1.mapCommands[NET_MESSAGE_COMMAND_OTHER].nRecvMsgs, 100U);
+    BOOST_CHECK_EQUAL(statsPeer1.mapCommands["inv"].nRecvMsgs, 1U);
+
+    // The totals stay bounded the same way, however many peers come and go
+    CNetMsgStats statsTotal;
+    for (int i = 0; i < 10; i++) {
+        statsTotal.Add(statsPeer1);
+        statsTotal.Add(statsPeer2);
+    }
+    BOOST_CHECK_EQUAL(statsTotal.mapCommands.size(), 3U);
+    BOOST_CHECK_EQUAL(statsTotal.mapCommands[NET_MESSAGE_COMMAND_OTHER].nRecvMsgs, 2000U);
+    BOOST_CHECK_EQUAL(statsTotal.mapCommands["inv"].nRecvMsgs, 10U);
+    BOOST_CHECK_EQUAL(statsTotal.mapCommands["mnb"].nSentMsgs, 10U);
+}
+
+/** Pass nBytes of pch to node as recv() in ThreadSocketHandler would, straight into the message buffer when it can */
+static void ReceiveChunk(CNode& node, const char* pch, unsigned int nBytes, bool& fDirect)
+{
+    LOCK(node.cs_vRecvMsg);
+    char* pchDirect = node.GetDirectRecvBuffer(nBytes);
+    fDirect = pchDirect != NULL;
+    if (fDirect) {
+        memcpy(pchDirect, pch, nBytes);
+        node.ReceivedDirectBytes(nBytes);
+    } else {
+        BOOST_CHECK(node.ReceiveMsgBytes(pch, nBytes));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(receive_large_message)
+{
+    CAddress addr(CService("127.0.0.1", 0));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    // A header and a payload well over one 64 KiB socket read
+    const unsigned int nPayload = 300000;
+    std::vector<char> vPayload(nPayload);
+    for (unsigned int i = 0; i < nPayload; i++)
+        vPayload[i] = (char)(i * 7 + i / 251);
+    CDataStream ssMsg(SER_NETWORK, PROTOCOL_VERSION);
+    ssMsg << CMessageHeader("block", nPayload);
+    BOOST_REQUIRE_EQUAL(ssMsg.size(), 24U);
+    ssMsg.write(&vPayload[0], nPayload);
+    std::string strMsg = ssMsg.str();
+
+    const char* pchBuffer = NULL;
+    for (int nRound = 0; nRound < 2; nRound++) {
+        uint64_t nHits, nMisses;
+        recvBufferPool.GetStats(nHits, nMisses);
+
+        // The header and the start of the payload through ReceiveMsgBytes,
+        // then 64 KiB chunks read directly while that much is missing, then
+        // the tail in smaller pieces
+        unsigned int nPos = 0;
+        unsigned int nDirect = 0;
+        bool fDirect;
+        ReceiveChunk(node, &strMsg[nPos], 1000, fDirect);
+        BOOST_CHECK(!fDirect);
+        nPos += 1000;
+        while (nPos < strMsg.size()) {
+            unsigned int nChunk = std::min((unsigned int)strMsg.size() - nPos, 0x10000U);
+            if (nChunk < 0x10000U)
+                nChunk = std::min(nChunk, 7000U);
+            ReceiveChunk(node, &strMsg[nPos], nChunk, fDirect);
+            if (fDirect)
+                nDirect++;
+            nPos += nChunk;
+        }
+        BOOST_CHECK_EQUAL(nDirect, (nPayload - 1000 + 24) / 0x10000);
+
+        LOCK(node.cs_vRecvMsg);
+        BOOST_REQUIRE_EQUAL(node.vRecvMsg.size(), 1U);
+        CNetMessage& msg = node.vRecvMsg.front();
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK_EQUAL(msg.hdr.GetCommand(), "block");
+        BOOST_REQUIRE_EQUAL(msg.vRecv.size(), nPayload);
+        BOOST_CHECK(memcmp(&msg.vRecv[0], &vPayload[0], nPayload) == 0);
+
+        // The second message is received into the buffer the first one released
+        uint64_t nHitsAfter, nMissesAfter;
+        recvBufferPool.GetStats(nHitsAfter, nMissesAfter);
+        if (nRound == 0) {
+            pchBuffer = &msg.vRecv[0];
+        } else {
+            BOOST_CHECK(&msg.vRecv[0] == pchBuffer);
+            BOOST_CHECK_EQUAL(nHitsAfter, nHits + 1);
+            BOOST_CHECK_EQUAL(nMissesAfter, nMisses);
+        }
+        recvBufferPool.Release(msg.vRecv);
+        node.vRecvMsg.pop_front();
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
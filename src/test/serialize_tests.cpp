@@ -161,4 +161,26 @@ BOOST_AUTO_TEST_CASE(insert_delete)
     BOOST_CHECK_EQUAL(ss.size(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, 0);
+    std::vector<int64_t> vIn;
+    for (int i = 0; i < 100; i++)
+        vIn.push_back(i * 1000003);
+    ss << vIn << std::string("tail");
+
+    // Reads the same values as the stream it was copied from
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, 0);
+    std::vector<int64_t> vOut;
+    std::string strTail;
+    reader >> vOut >> strTail;
+    BOOST_CHECK(vIn == vOut);
+    BOOST_CHECK_EQUAL(strTail, "tail");
+    BOOST_CHECK(reader.empty());
+
+    // Reading past the end of the memory fails
+    CMemoryReader reader2(&ss[0], &ss[0] + 4, SER_DISK, 0);
+    BOOST_CHECK_THROW(reader2 >> vOut, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 
 #include "main.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -38,6 +39,9 @@ struct TestingSetup {
         fCheckBlockIndex = true;
         SelectParams(CBaseChainParams::UNITTEST);
         noui_connect();
+        InitSignatureCache();
+        InitZerocoinSpendCache();
+        InitScriptExecutionCache();
 #ifdef ENABLE_WALLET
         bitdb.MakeMock();
 #endif
@@ -12,6 +12,7 @@
 #include "main.h"
 #include "script/script.h"
 #include "script/script_error.h"
+#include "script/sign.h"
 #include "core_io.h"
 
 #include <map>
@@ -316,6 +317,39 @@ BOOST_AUTO_TEST_CASE(test_Get)
     BOOST_CHECK(!AreInputsStandard(t1, coins));
 }
 
+BOOST_AUTO_TEST_CASE(test_CheckInputs_cacheStore)
+{
+    // ConnectBlock checks with cacheStore set only for TestBlockValidity, which
+    // must leave the cached results in place for the real connect to use
+    CBasicKeyStore keystore;
+    CCoinsView coinsDummy;
+    CCoinsViewCache coins(&coinsDummy);
+    coins.SetBestBlock(Params().GenesisBlock().GetHash());
+    std::vector<CMutableTransaction> dummyTransactions = SetupDummyInputs(keystore, coins);
+
+    CMutableTransaction t1;
+    t1.vin.resize(1);
+    t1.vin[0].prevout.hash = dummyTransactions[0].GetHash();
+    t1.vin[0].prevout.n = 0;
+    t1.vout.resize(1);
+    t1.vout[0].nValue = 10*CENT;
+    t1.vout[0].scriptPubKey << OP_1;
+    BOOST_CHECK(SignSignature(keystore, dummyTransactions[0], t1, 0));
+    CTransaction tx(t1);
+
+    CValidationState state;
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, BLOCK_SCRIPT_VERIFY_FLAGS, true));
+
+    // With the spent output made unspendable only a cached result lets tx pass
+    coins.ModifyCoins(dummyTransactions[0].GetHash())->vout[0].scriptPubKey = CScript() << OP_FALSE;
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, BLOCK_SCRIPT_VERIFY_FLAGS, true));
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, BLOCK_SCRIPT_VERIFY_FLAGS, true));
+
+    // ... until a check without cacheStore consumes it
+    BOOST_CHECK(CheckInputs(tx, state, coins, true, BLOCK_SCRIPT_VERIFY_FLAGS, false));
+    BOOST_CHECK(!CheckInputs(tx, state, coins, true, BLOCK_SCRIPT_VERIFY_FLAGS, false));
+}
+
 BOOST_AUTO_TEST_CASE(test_IsStandard)
 {
     LOCK(cs_main);
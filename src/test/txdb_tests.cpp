@@ -0,0 +1,83 @@
+// Copyright (c) 2018 The VELES developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "main.h"
+#include "random.h"
+#include "txdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txdb_tests)
+
+/** Write a chain of nBlocks block index entries on top of the genesis block, returning their hashes by height */
+static std::vector<uint256> WriteTestChain(CBlockTreeDB& db, int nBlocks)
+{
+    std::vector<uint256> vHashes;
+    uint256 hashPrev = Params().HashGenesisBlock();
+    for (int i = 1; i <= nBlocks; i++) {
+        CDiskBlockIndex diskindex;
+        diskindex.nVersion = 3;
+        diskindex.hashPrev = hashPrev;
+        diskindex.hashMerkleRoot = GetRandHash();
+        diskindex.nTime = 1500000000 + i * 60;
+        diskindex.nBits = 0x207fffff;
+        diskindex.nNonce = i;
+        diskindex.nHeight = i;
+        diskindex.nStatus = BLOCK_VALID_TREE;
+        BOOST_CHECK(db.WriteBlockIndex(diskindex));
+        hashPrev = diskindex.GetBlockHash();
+        vHashes.push_back(hashPrev);
+    }
+    return vHashes;
+}
+
+/** Check the entries of vHashes were loaded and linked, then remove them from mapBlockIndex */
+static void CheckAndUnloadTestChain(const std::vector<uint256>& vHashes)
+{
+    LOCK(cs_main);
+    const CBlockIndex* pindexPrev = mapBlockIndex[Params().HashGenesisBlock()];
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        BlockMap::iterator mi = mapBlockIndex.find(vHashes[i]);
+        BOOST_REQUIRE(mi != mapBlockIndex.end());
+        const CBlockIndex* pindex = mi->second;
+        BOOST_CHECK(pindex->GetBlockHash() == vHashes[i]);
+        BOOST_CHECK(pindex->pprev == pindexPrev);
+        BOOST_CHECK_EQUAL(pindex->nHeight, (int)i + 1);
+        BOOST_CHECK_EQUAL(pindex->nNonce, (unsigned int)i + 1);
+        BOOST_CHECK_EQUAL(pindex->nStatus, (unsigned int)BLOCK_VALID_TREE);
+        pindexPrev = pindex;
+    }
+    for (size_t i = 0; i < vHashes.size(); i++) {
+        BlockMap::iterator mi = mapBlockIndex.find(vHashes[i]);
+        delete mi->second;
+        mapBlockIndex.erase(mi);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(load_block_index)
+{
+    ModifiableParams()->setSkipProofOfWorkCheck(true);
+    int nScriptCheckThreadsSaved = nScriptCheckThreads;
+    size_t nBlockIndexSize = mapBlockIndex.size();
+
+    // Enough entries to land in most key range shards, loaded on one and on several threads
+    int vThreads[] = {1, 4};
+    for (unsigned int i = 0; i < sizeof(vThreads) / sizeof(vThreads[0]); i++) {
+        CBlockTreeDB db(1 << 20, true);
+        std::vector<uint256> vHashes = WriteTestChain(db, 500);
+        nScriptCheckThreads = vThreads[i];
+        {
+            LOCK(cs_main);
+            BOOST_CHECK(db.LoadBlockIndexGuts());
+            BOOST_CHECK_EQUAL(mapBlockIndex.size(), nBlockIndexSize + vHashes.size());
+        }
+        CheckAndUnloadTestChain(vHashes);
+    }
+
+    nScriptCheckThreads = nScriptCheckThreadsSaved;
+    ModifiableParams()->setSkipProofOfWorkCheck(false);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
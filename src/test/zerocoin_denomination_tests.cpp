@@ -69,6 +69,35 @@ BOOST_AUTO_TEST_CASE(denomination_to_value_test)
     BOOST_CHECK_MESSAGE(ZerocoinDenominationToAmount(denomination) == Value, "Wrong Value - should be 0");
 }
 
+BOOST_AUTO_TEST_CASE(zerocoin_supply_serialization_test)
+{
+    cout << "Running zerocoin_supply_serialization_test...\n";
+
+    // The inline supply table must keep the on-disk format of the map it replaced
+    std::map<CoinDenomination, int64_t> mapSupply;
+    CZerocoinSupply supply;
+    int64_t nSupply = 1;
+    for (auto& denom : zerocoinDenomList) {
+        mapSupply.insert(std::make_pair(denom, nSupply));
+        supply.at(denom) = nSupply;
+        nSupply *= 3;
+    }
+
+    CDataStream ssMap(SER_DISK, CLIENT_VERSION);
+    ssMap << mapSupply;
+    CDataStream ssSupply(SER_DISK, CLIENT_VERSION);
+    ssSupply << supply;
+    BOOST_CHECK_MESSAGE(ssMap.str() == ssSupply.str(), "Serialized supply differs from map format");
+    BOOST_CHECK(::GetSerializeSize(supply, SER_DISK, CLIENT_VERSION) == ssSupply.size());
+
+    CZerocoinSupply supplyRead;
+    ssMap >> supplyRead;
+    for (auto& denom : zerocoinDenomList)
+        BOOST_CHECK(supplyRead.at(denom) == mapSupply.at(denom));
+
+    BOOST_CHECK_THROW(supply.at(ZQ_ERROR), std::out_of_range);
+}
+
 BOOST_AUTO_TEST_CASE(zerocoin_spend_test241)
 {
     const int nMaxNumberOfSpends = 4;
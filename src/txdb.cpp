@@ -11,8 +11,11 @@
 #include "uint256.h"
 #include "accumulators.h"
 
+#include <deque>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -31,7 +34,7 @@ void static BatchWriteHashBestChain(CLevelDBBatch& batch, const uint256& hash)
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe)
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, "chainstate")
 {
 }
 
@@ -74,7 +77,7 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe)
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, "blockindex")
 {
 }
 
@@ -208,89 +211,221 @@ bool CBlockTreeDB::ReadInt(const std::string& name, int& nValue)
     return Read(std::make_pair('I', name), nValue);
 }
 
-bool CBlockTreeDB::LoadBlockIndexGuts()
-{
-    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
-
+/** Block index records decoded from one slice of the 'b' key range */
+struct CBlockIndexShard {
+    unsigned char nBegin;
+    unsigned int nEnd;
+    std::vector<std::pair<uint256, CDiskBlockIndex> > vIndex;
+    std::string strError;
+
+    CBlockIndexShard(unsigned char nBeginIn, unsigned int nEndIn) : nBegin(nBeginIn), nEnd(nEndIn) {}
+};
+
+/**
+ * Shards handed out to the loader threads and given back decoded, so the
+ * caller can link and release each one while the others are still read.
+ */
+struct CBlockIndexLoadQueue {
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::vector<CBlockIndexShard> vShards;
+    size_t nNext;
+    std::deque<CBlockIndexShard*> queueDone;
+    bool fAbort;
+
+    CBlockIndexLoadQueue() : nNext(0), fAbort(false) {}
+};
+
+/** Number of slices the 'b' key range is split into, one per first hash byte */
+static const int BLOCK_INDEX_SHARDS = 256;
+
+/**
+ * Read and deserialize every block index entry whose hash starts with a byte in
+ * [nBegin, nEnd). Block hashes are uniformly distributed, so splitting on the
+ * first key byte gives each slice an even share of the work.
+ */
+void static LoadBlockIndexShard(CBlockTreeDB* pdb, CBlockIndexShard* pshard)
+{
+    boost::scoped_ptr<leveldb::Iterator> pcursor(pdb->NewIterator());
+
+    uint256 hashStart;
+    *hashStart.begin() = pshard->nBegin;
     CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
-    ssKeySet << make_pair('b', uint256(0));
+    ssKeySet << make_pair('b', hashStart);
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    uint256 nPreviousCheckpoint;
     while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
         try {
             leveldb::Slice slKey = pcursor->key();
             CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'b') {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
-                pindexNew->nHeight = diskindex.nHeight;
-                pindexNew->nFile = diskindex.nFile;
-                pindexNew->nDataPos = diskindex.nDataPos;
-                pindexNew->nUndoPos = diskindex.nUndoPos;
-                pindexNew->nVersion = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime = diskindex.nTime;
-                pindexNew->nBits = diskindex.nBits;
-                pindexNew->nNonce = diskindex.nNonce;
-                pindexNew->nStatus = diskindex.nStatus;
-                pindexNew->nTx = diskindex.nTx;
-
-                //zerocoin
-                pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
-                pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
-                pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
-
-                //Proof Of Stake
-                pindexNew->nMint = diskindex.nMint;
-                pindexNew->nMoneySupply = diskindex.nMoneySupply;
-                pindexNew->nFlags = diskindex.nFlags;
-                pindexNew->nStakeModifier = diskindex.nStakeModifier;
-                pindexNew->prevoutStake = diskindex.prevoutStake;
-                pindexNew->nStakeTime = diskindex.nStakeTime;
-                pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
-
-                if (pindexNew->nHeight <= Params().LAST_POW_BLOCK()) {
-                    if (!CheckProofOfWork(pindexNew->GetBlockHash(), pindexNew->nBits))
-                        return error("LoadBlockIndex() : CheckProofOfWork failed: %s", pindexNew->ToString());
+            if (chType != 'b')
+                break;
+            uint256 hashKey;
+            ssKey >> hashKey;
+            if (*hashKey.begin() >= pshard->nEnd)
+                break;
+
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+            pshard->vIndex.push_back(make_pair(uint256(), CDiskBlockIndex()));
+            CDiskBlockIndex& diskindex = pshard->vIndex.back().second;
+            ssValue >> diskindex;
+            uint256& hashBlock = pshard->vIndex.back().first;
+            hashBlock = diskindex.GetBlockHash();
+
+            if (diskindex.nHeight <= Params().LAST_POW_BLOCK()) {
+                if (!CheckProofOfWork(hashBlock, diskindex.nBits)) {
+                    pshard->strError = strprintf("CheckProofOfWork failed: %s", diskindex.ToString());
+                    return;
                 }
-                // ppcoin: build setStakeSeen
-                if (pindexNew->IsProofOfStake())
-                    setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+            }
 
-                //populate accumulator checksum map in memory
-                if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
-                    //Don't load any checkpoints that exist before v2 zvls. The accumulator is invalid for v1 and not used.
-                    if (pindexNew->nHeight >= Params().Zerocoin_Block_V2_Start())
-                        LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
+            pcursor->Next();
+        } catch (std::exception& e) {
+            pshard->strError = strprintf("Deserialize or I/O error - %s", e.what());
+            return;
+        }
+    }
+}
 
-                    nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
-                }
+/** Loader thread: decode shards until none are left or the load was aborted */
+void static ThreadLoadBlockIndexShards(CBlockTreeDB* pdb, CBlockIndexLoadQueue* pqueue)
+{
+    while (true) {
+        CBlockIndexShard* pshard;
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            if (pqueue->fAbort || pqueue->nNext == pqueue->vShards.size())
+                return;
+            pshard = &pqueue->vShards[pqueue->nNext++];
+        }
+        LoadBlockIndexShard(pdb, pshard);
+        {
+            boost::unique_lock<boost::mutex> lock(pqueue->mutex);
+            pqueue->queueDone.push_back(pshard);
+        }
+        pqueue->cond.notify_one();
+    }
+}
 
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
+/** Add the decoded records of a shard to mapBlockIndex, then release them */
+void static LinkBlockIndexShard(CBlockIndexShard& shard, uint256& nPreviousCheckpoint)
+{
+    for (const PAIRTYPE(uint256, CDiskBlockIndex) & item : shard.vIndex) {
+        const CDiskBlockIndex& diskindex = item.second;
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(item.first);
+        pindexNew->pprev = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext = InsertBlockIndex(diskindex.hashNext);
+        pindexNew->nHeight = diskindex.nHeight;
+        pindexNew->nFile = diskindex.nFile;
+        pindexNew->nDataPos = diskindex.nDataPos;
+        pindexNew->nUndoPos = diskindex.nUndoPos;
+        pindexNew->nVersion = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime = diskindex.nTime;
+        pindexNew->nBits = diskindex.nBits;
+        pindexNew->nNonce = diskindex.nNonce;
+        pindexNew->nStatus = diskindex.nStatus;
+        pindexNew->nTx = diskindex.nTx;
+
+        //zerocoin
+        pindexNew->nAccumulatorCheckpoint = diskindex.nAccumulatorCheckpoint;
+        pindexNew->mapZerocoinSupply = diskindex.mapZerocoinSupply;
+        pindexNew->vMintDenominationsInBlock = diskindex.vMintDenominationsInBlock;
+
+        //Proof Of Stake
+        pindexNew->nMint = diskindex.nMint;
+        pindexNew->nMoneySupply = diskindex.nMoneySupply;
+        pindexNew->nFlags = diskindex.nFlags;
+        pindexNew->nStakeModifier = diskindex.nStakeModifier;
+        pindexNew->prevoutStake = diskindex.prevoutStake;
+        pindexNew->nStakeTime = diskindex.nStakeTime;
+        pindexNew->hashProofOfStake = diskindex.hashProofOfStake;
+
+        // ppcoin: build setStakeSeen
+        if (pindexNew->IsProofOfStake())
+            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
+
+        //populate accumulator checksum map in memory
+        if(pindexNew->nAccumulatorCheckpoint != 0 && pindexNew->nAccumulatorCheckpoint != nPreviousCheckpoint) {
+            //Don't load any checkpoints that exist before v2 zvls. The accumulator is invalid for v1 and not used.
+            if (pindexNew->nHeight >= Params().Zerocoin_Block_V2_Start())
+                LoadAccumulatorValuesFromDB(pindexNew->nAccumulatorCheckpoint);
+
+            nPreviousCheckpoint = pindexNew->nAccumulatorCheckpoint;
+        }
+    }
+    std::vector<std::pair<uint256, CDiskBlockIndex> >().swap(shard.vIndex);
+}
+
+bool CBlockTreeDB::LoadBlockIndexGuts()
+{
+    // Deserializing the entries and hashing the headers dominates; spread it
+    // over the script check threads and link each slice on this thread as soon
+    // as it is decoded, so only the slices in flight are held in memory.
+    int nThreads = std::max(1, std::min(nScriptCheckThreads, MAX_SCRIPTCHECK_THREADS));
+    CBlockIndexLoadQueue queue;
+    queue.vShards.reserve(BLOCK_INDEX_SHARDS);
+    for (int i = 0; i < BLOCK_INDEX_SHARDS; i++)
+        queue.vShards.push_back(CBlockIndexShard(i, i + 1));
+
+    uint256 nPreviousCheckpoint;
+    if (nThreads == 1) {
+        for (CBlockIndexShard& shard : queue.vShards) {
+            boost::this_thread::interruption_point();
+            LoadBlockIndexShard(this, &shard);
+            if (!shard.strError.empty())
+                return error("%s : %s", __func__, shard.strError);
+            LinkBlockIndexShard(shard, nPreviousCheckpoint);
+        }
+    } else {
+        boost::thread_group loaders;
+        for (int i = 0; i < nThreads; i++)
+            loaders.create_thread(boost::bind(&ThreadLoadBlockIndexShards, this, &queue));
+
+        std::string strError;
+        try {
+            for (size_t nLinked = 0; nLinked < queue.vShards.size() && strError.empty(); nLinked++) {
+                CBlockIndexShard* pshard;
+                {
+                    boost::unique_lock<boost::mutex> lock(queue.mutex);
+                    while (queue.queueDone.empty())
+                        queue.cond.wait(lock);
+                    pshard = queue.queueDone.front();
+                    queue.queueDone.pop_front();
+                }
+                if (!pshard->strError.empty())
+                    strError = pshard->strError;
+                else
+                    LinkBlockIndexShard(*pshard, nPreviousCheckpoint);
             }
-        } catch (std::exception& e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        } catch (...) {
+            // Interrupted while waiting; stop the loaders before unwinding
+            {
+                boost::unique_lock<boost::mutex> lock(queue.mutex);
+                queue.fAbort = true;
+            }
+            loaders.join_all();
+            throw;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            queue.fAbort = true;
         }
+        loaders.join_all();
+        if (!strError.empty())
+            return error("%s : %s", __func__, strError);
     }
 
+    LogPrintf("%s: loaded %u block index entries using %d threads\n", __func__, mapBlockIndex.size(), nThreads);
     return true;
 }
 
-CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe)
+CZerocoinDB::CZerocoinDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "zerocoin", nCacheSize, fMemory, fWipe, "zerocoin")
 {
 }
 
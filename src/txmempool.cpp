@@ -13,6 +13,8 @@
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <cmath>
+
 #include <boost/circular_buffer.hpp>
 
 using namespace std;
@@ -20,13 +22,23 @@ using namespace std;
 CTxMemPoolEntry::CTxMemPoolEntry() : nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0)
 {
     nHeight = MEMPOOL_HEIGHT;
+    ResetPackageState();
 }
 
-CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(MakeTransactionRef(_tx)), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
 {
-    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
 
-    nModSize = tx.CalculateModifiedSize(nTxSize);
+    nModSize = tx->CalculateModifiedSize(nTxSize);
+    ResetPackageState();
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight) : tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight)
+{
+    nTxSize = ::GetSerializeSize(*tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    nModSize = tx->CalculateModifiedSize(nTxSize);
+    ResetPackageState();
 }
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
@@ -37,12 +49,49 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTxMemPoolEntry& other)
 double
 CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
 {
-    CAmount nValueIn = tx.GetValueOut() + nFee;
+    CAmount nValueIn = tx->GetValueOut() + nFee;
     double deltaPriority = ((double)(currentHeight - nHeight) * nValueIn) / nModSize;
     double dResult = dPriority + deltaPriority;
     return dResult;
 }
 
+void CTxMemPoolEntry::ResetPackageState()
+{
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nSizeDelta, CAmount nFeeDelta, int64_t nCountDelta)
+{
+    nSizeWithAncestors += nSizeDelta;
+    nFeesWithAncestors += nFeeDelta;
+    nCountWithAncestors += nCountDelta;
+    assert(nCountWithAncestors > 0);
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nSizeDelta, CAmount nFeeDelta, int64_t nCountDelta)
+{
+    nSizeWithDescendants += nSizeDelta;
+    nFeesWithDescendants += nFeeDelta;
+    nCountWithDescendants += nCountDelta;
+    assert(nCountWithDescendants > 0);
+}
+
+CTxMemPoolFeeKey CTxMemPoolFeeKey::DescendantScore(const CTxMemPoolEntry& entry)
+{
+    CTxMemPoolFeeKey own(entry.GetFee(), entry.GetTxSize(), entry.GetTx().GetHash());
+    CTxMemPoolFeeKey package(entry.GetFeesWithDescendants(), entry.GetSizeWithDescendants(), own.hash);
+    return own < package ? package : own;
+}
+
+CTxMemPoolFeeKey CTxMemPoolFeeKey::AncestorScore(const CTxMemPoolEntry& entry)
+{
+    CTxMemPoolFeeKey own(entry.GetFee(), entry.GetTxSize(), entry.GetTx().GetHash());
+    CTxMemPoolFeeKey package(entry.GetFeesWithAncestors(), entry.GetSizeWithAncestors(), own.hash);
+    return package < own ? package : own;
+}
+
 /**
  * Keep track of fee/priority for transactions confirmed within N blocks
  */
@@ -356,7 +405,12 @@ public:
 
 
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) : nTransactionsUpdated(0),
-                                                       minRelayFee(_minRelayFee)
+                                                       minRelayFee(_minRelayFee),
+                                                       totalTxSize(0),
+                                                       lastRollingFeeUpdate(GetTime()),
+                                                       blockSinceLastRollingFeeBump(false),
+                                                       rollingMinimumFeeRate(0),
+                                                       fLoaded(false)
 {
     // Sanity checks off by default for performance, because otherwise
     // accepting transactions becomes O(N^2) where N is the number
@@ -402,25 +456,201 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
 }
 
 
+void CTxMemPool::IndexEntry(const CTxMemPoolEntry& entry)
+{
+    const uint256& hash = entry.GetTx().GetHash();
+    setEntriesByTime.insert(std::make_pair(entry.GetTime(), hash));
+    setEntriesByDescendantScore.insert(CTxMemPoolFeeKey::DescendantScore(entry));
+    setEntriesByAncestorScore.insert(CTxMemPoolFeeKey::AncestorScore(entry));
+}
+
+void CTxMemPool::UnindexEntry(const CTxMemPoolEntry& entry)
+{
+    const uint256& hash = entry.GetTx().GetHash();
+    setEntriesByTime.erase(std::make_pair(entry.GetTime(), hash));
+    setEntriesByDescendantScore.erase(CTxMemPoolFeeKey::DescendantScore(entry));
+    setEntriesByAncestorScore.erase(CTxMemPoolFeeKey::AncestorScore(entry));
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const
+{
+    AssertLockHeld(cs);
+    if (tx.IsZerocoinSpend())
+        return;
+    std::deque<const CTransaction*> queue;
+    queue.push_back(&tx);
+    while (!queue.empty()) {
+        const CTransaction* ptx = queue.front();
+        queue.pop_front();
+        BOOST_FOREACH (const CTxIn& txin, ptx->vin) {
+            std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it != mapTx.end() && setAncestors.insert(it->first).second)
+                queue.push_back(&it->second.GetTx());
+        }
+    }
+}
+
+void CTxMemPool::CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const
+{
+    AssertLockHeld(cs);
+    std::deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 hashParent = queue.front();
+        queue.pop_front();
+        std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.lower_bound(COutPoint(hashParent, 0));
+        for (; it != mapNextTx.end() && it->first.hash == hashParent; ++it) {
+            const uint256& hashChild = it->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                queue.push_back(hashChild);
+        }
+    }
+}
+
+bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, std::set<uint256>& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const
+{
+    AssertLockHeld(cs);
+    const CTransaction& tx = entry.GetTx();
+    if (tx.IsZerocoinSpend())
+        return true;
+    uint64_t nSizeWithAncestors = entry.GetTxSize();
+    std::deque<const CTransaction*> queue;
+    queue.push_back(&tx);
+    while (!queue.empty()) {
+        const CTransaction* ptx = queue.front();
+        queue.pop_front();
+        BOOST_FOREACH (const CTxIn& txin, ptx->vin) {
+            std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(txin.prevout.hash);
+            if (it == mapTx.end() || !setAncestors.insert(it->first).second)
+                continue;
+            const CTxMemPoolEntry& ancestor = it->second;
+            if (ancestor.GetCountWithDescendants() + 1 > limitDescendantCount) {
+                errString = strprintf("too many descendants for tx %s [limit: %u]", it->first.ToString(), limitDescendantCount);
+                return false;
+            }
+            if (ancestor.GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
+                errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", it->first.ToString(), limitDescendantSize);
+                return false;
+            }
+            nSizeWithAncestors += ancestor.GetTxSize();
+            if (setAncestors.size() + 1 > limitAncestorCount) {
+                errString = strprintf("too many unconfirmed ancestors [limit: %u]", limitAncestorCount);
+                return false;
+            }
+            if (nSizeWithAncestors > limitAncestorSize) {
+                errString = strprintf("exceeds ancestor size limit [limit: %u]", limitAncestorSize);
+                return false;
+            }
+            queue.push_back(&ancestor.GetTx());
+        }
+    }
+    return true;
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    LOCK(cs);
+    std::set<uint256> setAncestors;
+    CalculateMemPoolAncestors(entry.GetTx(), setAncestors);
+    return addUnchecked(hash, entry, setAncestors);
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const std::set<uint256>& setAncestors)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = entry;
-        const CTransaction& tx = mapTx[hash].GetTx();
+        std::map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it != mapTx.end())
+            removeUnchecked(it);
+
+        // A transaction disconnected from the chain can have spends still in
+        // the pool. Note which ancestors those descendants have before the new
+        // entry links them to the packages above it; usually there are none.
+        std::set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        std::map<uint256, std::set<uint256> > mapOldAncestors;
+        BOOST_FOREACH (const uint256& hashDescendant, setDescendants)
+            CalculateMemPoolAncestors(mapTx[hashDescendant].GetTx(), mapOldAncestors[hashDescendant]);
+
+        it = mapTx.insert(std::make_pair(hash, entry)).first;
+        CTxMemPoolEntry& newEntry = it->second;
+        newEntry.ResetPackageState();
+        const CTransaction& tx = newEntry.GetTx();
         if(!tx.IsZerocoinSpend()) {
             for (unsigned int i = 0; i < tx.vin.size(); i++)
                 mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
         }
+
+        // Entries leave the indexes while their statistics change
+        std::set<uint256> setTouched(setAncestors);
+        setTouched.insert(setDescendants.begin(), setDescendants.end());
+        BOOST_FOREACH (const uint256& hashTouched, setTouched)
+            UnindexEntry(mapTx[hashTouched]);
+
+        BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+            CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+            newEntry.UpdateAncestorState(ancestor.GetTxSize(), ancestor.GetFee(), 1);
+            ancestor.UpdateDescendantState(newEntry.GetTxSize(), newEntry.GetFee(), 1);
+        }
+        BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+            CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+            const std::set<uint256>& setOldAncestors = mapOldAncestors[hashDescendant];
+            newEntry.UpdateDescendantState(descendant.GetTxSize(), descendant.GetFee(), 1);
+            descendant.UpdateAncestorState(newEntry.GetTxSize(), newEntry.GetFee(), 1);
+            // Ancestors of the new entry the descendant was not already below
+            BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+                if (setOldAncestors.count(hashAncestor))
+                    continue;
+                CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+                descendant.UpdateAncestorState(ancestor.GetTxSize(), ancestor.GetFee(), 1);
+                ancestor.UpdateDescendantState(descendant.GetTxSize(), descendant.GetFee(), 1);
+            }
+        }
+
+        IndexEntry(newEntry);
+        BOOST_FOREACH (const uint256& hashTouched, setTouched)
+            IndexEntry(mapTx[hashTouched]);
+
         nTransactionsUpdated++;
-        totalTxSize += entry.GetTxSize();
+        totalTxSize += newEntry.GetTxSize();
     }
     return true;
 }
 
+void CTxMemPool::removeUnchecked(std::map<uint256, CTxMemPoolEntry>::iterator it)
+{
+    const uint256 hash = it->first;
+    const CTxMemPoolEntry& entry = it->second;
+    const CTransaction& tx = entry.GetTx();
+
+    std::set<uint256> setAncestors, setDescendants;
+    CalculateMemPoolAncestors(tx, setAncestors);
+    CalculateDescendants(hash, setDescendants);
+    BOOST_FOREACH (const uint256& hashAncestor, setAncestors) {
+        CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+        UnindexEntry(ancestor);
+        ancestor.UpdateDescendantState(-(int64_t)entry.GetTxSize(), -entry.GetFee(), -1);
+        IndexEntry(ancestor);
+    }
+    BOOST_FOREACH (const uint256& hashDescendant, setDescendants) {
+        CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+        UnindexEntry(descendant);
+        descendant.UpdateAncestorState(-(int64_t)entry.GetTxSize(), -entry.GetFee(), -1);
+        IndexEntry(descendant);
+    }
+
+    if (!tx.IsZerocoinSpend()) {
+        BOOST_FOREACH (const CTxIn& txin, tx.vin)
+            mapNextTx.erase(txin.prevout);
+    }
+    UnindexEntry(entry);
+    totalTxSize -= entry.GetTxSize();
+    mapTx.erase(it);
+    nTransactionsUpdated++;
+}
 
 void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
@@ -444,9 +674,10 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
         while (!txToRemove.empty()) {
             uint256 hash = txToRemove.front();
             txToRemove.pop_front();
-            if (!mapTx.count(hash))
+            std::map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.find(hash);
+            if (mi == mapTx.end())
                 continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
+            const CTransaction& tx = mi->second.GetTx();
             if (fRecursive) {
                 for (unsigned int i = 0; i < tx.vout.size(); i++) {
                     std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
@@ -455,13 +686,8 @@ void CTxMemPool::remove(const CTransaction& origTx, std::list<CTransaction>& rem
                     txToRemove.push_back(it->second.ptx->GetHash());
                 }
             }
-            BOOST_FOREACH (const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
             removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            removeUnchecked(mi);
         }
     }
 }
@@ -510,22 +736,26 @@ void CTxMemPool::removeConflicts(const CTransaction& tx, std::list<CTransaction>
 /**
  * Called when a block is connected. Removes from mempool and updates the miner fee estimator.
  */
-void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts)
+void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts)
 {
     LOCK(cs);
     std::vector<CTxMemPoolEntry> entries;
-    BOOST_FOREACH (const CTransaction& tx, vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, vtx) {
+        const CTransaction& tx = *ptx;
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
             entries.push_back(mapTx[hash]);
     }
     minerPolicyEstimator->seenBlock(entries, nBlockHeight, minRelayFee);
-    BOOST_FOREACH (const CTransaction& tx, vtx) {
+    BOOST_FOREACH (const CTransactionRef& ptx, vtx) {
+        const CTransaction& tx = *ptx;
         std::list<CTransaction> dummy;
         remove(tx, dummy, false);
         removeConflicts(tx, conflicts);
         ClearPrioritisation(tx.GetHash());
     }
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 
@@ -534,7 +764,13 @@ void CTxMemPool::clear()
     LOCK(cs);
     mapTx.clear();
     mapNextTx.clear();
+    setEntriesByTime.clear();
+    setEntriesByDescendantScore.clear();
+    setEntriesByAncestorScore.clear();
     totalTxSize = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -610,6 +846,127 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
     }
 
     assert(totalTxSize == checkTotal);
+
+    // Check the package statistics and that every entry is indexed under its current keys
+    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTxMemPoolEntry& entry = it->second;
+        std::set<uint256> setAncestors, setDescendants;
+        CalculateMemPoolAncestors(entry.GetTx(), setAncestors);
+        CalculateDescendants(it->first, setDescendants);
+        uint64_t nSizeWithAncestors = entry.GetTxSize(), nSizeWithDescendants = entry.GetTxSize();
+        CAmount nFeesWithAncestors = entry.GetFee(), nFeesWithDescendants = entry.GetFee();
+        BOOST_FOREACH (const uint256& hash, setAncestors) {
+            const CTxMemPoolEntry& ancestor = mapTx.find(hash)->second;
+            nSizeWithAncestors += ancestor.GetTxSize();
+            nFeesWithAncestors += ancestor.GetFee();
+        }
+        BOOST_FOREACH (const uint256& hash, setDescendants) {
+            const CTxMemPoolEntry& descendant = mapTx.find(hash)->second;
+            nSizeWithDescendants += descendant.GetTxSize();
+            nFeesWithDescendants += descendant.GetFee();
+        }
+        assert(entry.GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(entry.GetSizeWithAncestors() == nSizeWithAncestors);
+        assert(entry.GetFeesWithAncestors() == nFeesWithAncestors);
+        assert(entry.GetCountWithDescendants() == setDescendants.size() + 1);
+        assert(entry.GetSizeWithDescendants() == nSizeWithDescendants);
+        assert(entry.GetFeesWithDescendants() == nFeesWithDescendants);
+        assert(setEntriesByTime.count(std::make_pair(entry.GetTime(), it->first)));
+        assert(setEntriesByDescendantScore.count(CTxMemPoolFeeKey::DescendantScore(entry)));
+        assert(setEntriesByAncestorScore.count(CTxMemPoolFeeKey::AncestorScore(entry)));
+    }
+    assert(setEntriesByTime.size() == mapTx.size());
+    assert(setEntriesByDescendantScore.size() == mapTx.size());
+    assert(setEntriesByAncestorScore.size() == mapTx.size());
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+    std::vector<uint256> vExpired;
+    std::set<std::pair<int64_t, uint256> >::const_iterator it = setEntriesByTime.begin();
+    for (; it != setEntriesByTime.end() && it->first < time; ++it)
+        vExpired.push_back(it->second);
+
+    std::list<CTransaction> removed;
+    BOOST_FOREACH (const uint256& hash, vExpired) {
+        std::map<uint256, CTxMemPoolEntry>::const_iterator mi = mapTx.find(hash);
+        if (mi == mapTx.end())
+            continue; // already removed as a descendant of an earlier entry
+        CTransactionRef ptx = mi->second.GetSharedTx();
+        remove(*ptx, removed, true);
+    }
+    return removed.size();
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+void CTxMemPool::TrimToSize(size_t sizelimit)
+{
+    LOCK(cs);
+    unsigned int nTxnRemoved = 0;
+    CFeeRate maxFeeRateRemoved(0);
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        CTxMemPoolFeeKey key = *setEntriesByDescendantScore.begin();
+        // Require the fee rate of the evicted package plus the relay fee from
+        // new transactions, so they cannot take its place at the same rate
+        // without a block in between
+        CFeeRate removedRate(CFeeRate(key.nFee, key.nSize).GetFeePerK() + minRelayFee.GetFeePerK());
+        trackPackageRemoved(removedRate);
+        if (removedRate > maxFeeRateRemoved)
+            maxFeeRateRemoved = removedRate;
+
+        CTransactionRef ptx = mapTx[key.hash].GetSharedTx();
+        std::list<CTransaction> removed;
+        remove(*ptx, removed, true);
+        nTxnRemoved += removed.size();
+    }
+    if (nTxnRemoved > 0)
+        LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    int64_t time = GetTime();
+    if (time > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        size_t nUsage = DynamicMemoryUsage();
+        if (nUsage < sizelimit / 4)
+            halflife /= 4;
+        else if (nUsage < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (time - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = time;
+
+        if (rollingMinimumFeeRate < minRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minRelayFee);
+}
+
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Every std::map/std::set node carries three pointers and a colour word
+    static const size_t nNodeOverhead = 4 * sizeof(void*);
+    size_t nEntry = sizeof(std::pair<const uint256, CTxMemPoolEntry>) + sizeof(CTransaction) + nNodeOverhead +
+                    sizeof(std::pair<int64_t, uint256>) + 2 * sizeof(CTxMemPoolFeeKey) + 3 * nNodeOverhead;
+    size_t nNextTx = sizeof(std::pair<const COutPoint, CInPoint>) + nNodeOverhead;
+    return totalTxSize + mapTx.size() * nEntry + mapNextTx.size() * nNextTx;
 }
 
 void CTxMemPool::queryHashes(vector<uint256>& vtxid)
@@ -640,6 +997,15 @@ bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
     return true;
 }
 
+CTransactionRef CTxMemPool::get(const uint256& hash) const
+{
+    LOCK(cs);
+    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    if (i == mapTx.end())
+        return CTransactionRef();
+    return i->second.GetSharedTx();
+}
+
 CFeeRate CTxMemPool::estimateFee(int nBlocks) const
 {
     LOCK(cs);
@@ -718,9 +1084,9 @@ bool CCoinsViewMemPool::GetCoins(const uint256& txid, CCoins& coins) const
     // If an entry in the mempool exists, always return that one, as it's guaranteed to never
     // conflict with the underlying cache, and it cannot have pruned entries (as it contains full)
     // transactions. First checking the underlying cache risks returning a pruned entry instead.
-    CTransaction tx;
-    if (mempool.lookup(txid, tx)) {
-        coins = CCoins(tx, MEMPOOL_HEIGHT);
+    CTransactionRef ptx = mempool.get(txid);
+    if (ptx) {
+        coins = CCoins(*ptx, MEMPOOL_HEIGHT);
         return true;
     }
     return (base->GetCoins(txid, coins) && !coins.IsPruned());
@@ -8,6 +8,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -38,7 +39,7 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 class CTxMemPoolEntry
 {
 private:
-    CTransaction tx;
+    CTransactionRef tx;
     CAmount nFee;         //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize;       //! ... and avoid recomputing tx size
     size_t nModSize;      //! ... and modified size for priority
@@ -46,17 +47,69 @@ private:
     double dPriority;     //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
 
+    // Package statistics: totals over this transaction and its in-pool
+    // ancestors (resp. descendants), maintained by CTxMemPool
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nFeesWithAncestors;
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nFeesWithDescendants;
+
 public:
     CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
+    CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee, int64_t _nTime, double _dPriority, unsigned int _nHeight);
+    //! Only for std::map; the entry has no transaction until one is assigned
     CTxMemPoolEntry();
     CTxMemPoolEntry(const CTxMemPoolEntry& other);
 
-    const CTransaction& GetTx() const { return this->tx; }
+    const CTransaction& GetTx() const { return *this->tx; }
+    const CTransactionRef& GetSharedTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    /** Reset the package statistics to cover only this transaction */
+    void ResetPackageState();
+    void UpdateAncestorState(int64_t nSizeDelta, CAmount nFeeDelta, int64_t nCountDelta);
+    void UpdateDescendantState(int64_t nSizeDelta, CAmount nFeeDelta, int64_t nCountDelta);
+};
+
+/**
+ * Key of a mempool entry in the fee rate ordered indexes: a fee and a size
+ * whose ratio is compared, with the txid as tie-breaker so keys are unique.
+ */
+struct CTxMemPoolFeeKey
+{
+    CAmount nFee;
+    uint64_t nSize;
+    uint256 hash;
+
+    CTxMemPoolFeeKey(const CAmount& nFeeIn, uint64_t nSizeIn, const uint256& hashIn) : nFee(nFeeIn), nSize(nSizeIn), hash(hashIn) {}
+
+    bool operator<(const CTxMemPoolFeeKey& b) const
+    {
+        // Compare nFee / nSize with b.nFee / b.nSize without dividing
+        double f1 = (double)nFee * b.nSize;
+        double f2 = (double)b.nFee * nSize;
+        if (f1 != f2)
+            return f1 < f2;
+        return hash < b.hash;
+    }
+
+    /** Descendant score: the higher of the fee rates of the entry alone and with its descendants */
+    static CTxMemPoolFeeKey DescendantScore(const CTxMemPoolEntry& entry);
+    /** Ancestor score: the lower of the fee rates of the entry alone and with its ancestors */
+    static CTxMemPoolFeeKey AncestorScore(const CTxMemPoolEntry& entry);
 };
 
 class CMinerPolicyEstimator;
@@ -102,12 +155,35 @@ private:
     CFeeRate minRelayFee; //! Passed to constructor to avoid dependency on main
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
 
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
+    bool fLoaded; //! Set once LoadMempool has finished, or was skipped
+
+    void trackPackageRemoved(const CFeeRate& rate);
+
+    void IndexEntry(const CTxMemPoolEntry& entry);
+    void UnindexEntry(const CTxMemPoolEntry& entry);
+    /** Remove a single entry, updating the statistics of its remaining relatives */
+    void removeUnchecked(std::map<uint256, CTxMemPoolEntry>::iterator it);
+
 public:
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12; //! half-life of the rolling minimum fee, in seconds
+
     mutable CCriticalSection cs;
     std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+    /**
+     * Secondary orderings of mapTx, kept in step with it by addUnchecked and
+     * remove. All are ascending: the oldest entry, the package to evict
+     * first and the package to mine last come first.
+     */
+    std::set<std::pair<int64_t, uint256> > setEntriesByTime;
+    std::set<CTxMemPoolFeeKey> setEntriesByDescendantScore;
+    std::set<CTxMemPoolFeeKey> setEntriesByAncestorScore;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
@@ -121,11 +197,36 @@ public:
     void setSanityCheck(bool _fSanityCheck) { fSanityCheck = _fSanityCheck; }
 
     bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
+    /** Add an entry whose in-pool ancestors were already collected by CalculateMemPoolAncestors */
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, const std::set<uint256>& setAncestors);
     void remove(const CTransaction& tx, std::list<CTransaction>& removed, bool fRecursive = false);
     void removeCoinbaseSpends(const CCoinsViewCache* pcoins, unsigned int nMemPoolHeight);
     void removeConflicts(const CTransaction& tx, std::list<CTransaction>& removed);
-    void removeForBlock(const std::vector<CTransaction>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts);
+    void removeForBlock(const std::vector<CTransactionRef>& vtx, unsigned int nBlockHeight, std::list<CTransaction>& conflicts);
     void clear();
+
+    /** Collect the in-pool ancestors of tx, not including tx itself */
+    void CalculateMemPoolAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    /**
+     * Collect the in-pool ancestors of a prospective entry, stopping with
+     * errString set as soon as the entry would give itself or one of those
+     * ancestors a package above the given count or size (in bytes) limits.
+     */
+    bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, std::set<uint256>& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString) const;
+    /** Collect the in-pool descendants of the transaction hash, not including itself */
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+
+    /** Remove transactions that entered the pool before time, and their descendants. Returns the number removed. */
+    int Expire(int64_t time);
+    /** Evict the lowest descendant score packages until the pool uses at most sizelimit bytes */
+    void TrimToSize(size_t sizelimit);
+    /**
+     * The minimum fee rate to get into the pool: raised by TrimToSize above the
+     * rate of the packages it evicts, then decaying back to zero once blocks
+     * arrive, faster when the pool is well below sizelimit.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     void queryHashes(std::vector<uint256>& vtxid);
     void getTransactions(std::set<uint256>& setTxid);
     void pruneSpent(const uint256& hash, CCoins& coins);
@@ -147,6 +248,20 @@ public:
         LOCK(cs);
         return totalTxSize;
     }
+    /** Estimated memory held by the pool: the transactions plus the nodes of mapTx, mapNextTx and the indexes */
+    size_t DynamicMemoryUsage() const;
+
+    /** Whether the pool saved by the previous run has been loaded, so it may be saved again */
+    bool IsLoaded() const
+    {
+        LOCK(cs);
+        return fLoaded;
+    }
+    void SetIsLoaded(bool fLoadedIn)
+    {
+        LOCK(cs);
+        fLoaded = fLoadedIn;
+    }
 
     bool exists(uint256 hash)
     {
@@ -155,6 +270,8 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+    /** Shared reference to a pool transaction, or a null reference if it is not in the pool */
+    CTransactionRef get(const uint256& hash) const;
 
     /** Estimate fee rate needed to get into the next nBlocks */
     CFeeRate estimateFee(int nBlocks) const;
@@ -12,7 +12,7 @@
  * network protocol versioning
  */
 
-static const int PROTOCOL_VERSION = 70914;
+static const int PROTOCOL_VERSION = 70916;
 
 //! initial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -40,5 +40,11 @@ static const int MEMPOOL_GD_VERSION = 60002;
 //! "filter*" commands are disabled without NODE_BLOOM after and including this version
 static const int NO_BLOOM_VERSION = 70005;
 
+//! short-id-based block download (compact blocks) starts with this version
+static const int SHORT_IDS_BLOCKS_VERSION = 70915;
+
+//! "getheaders" is answered with "headers", and blocks are downloaded after their headers, starting with this version
+static const int HEADERS_FIRST_VERSION = 70916;
+
 
 #endif // BITCOIN_VERSION_H
@@ -1457,8 +1457,8 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
             CBlock block;
             ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH (CTransaction& tx, block.vtx) {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
+            BOOST_FOREACH (const CTransactionRef& ptx, block.vtx) {
+                if (AddToWalletIfInvolvingMe(*ptx, &block, fUpdate))
                     ret++;
             }
 
@@ -1473,7 +1473,8 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
                         pwalletMain->UpdateMint(m.GetValue(), pindex->nHeight, m.GetTxHash(), m.GetDenomination());
 
                         // Add the transaction to the wallet
-                        for (auto& tx : block.vtx) {
+                        for (const CTransactionRef& ptx : block.vtx) {
+                            const CTransaction& tx = *ptx;
                             uint256 txid = tx.GetHash();
                             if (setAddedToWallet.count(txid) || mapWallet.count(txid))
                                 continue;
@@ -4312,7 +4313,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock& block)
 
     // Locate the transaction
     for (nIndex = 0; nIndex < (int)block.vtx.size(); nIndex++)
-        if (block.vtx[nIndex] == *(CTransaction*)this)
+        if (*block.vtx[nIndex] == *(CTransaction*)this)
             break;
     if (nIndex == (int)block.vtx.size()) {
         vMerkleBranch.clear();
@@ -15,7 +15,8 @@
 
 bool BlockToMintValueVector(const CBlock& block, const libzerocoin::CoinDenomination denom, vector<CBigNum>& vValues)
 {
-    for (const CTransaction tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if(!tx.IsZerocoinMint())
             continue;
 
@@ -40,7 +41,8 @@ bool BlockToMintValueVector(const CBlock& block, const libzerocoin::CoinDenomina
 
 bool BlockToPubcoinList(const CBlock& block, std::list<libzerocoin::PublicCoin>& listPubcoins, bool fFilterInvalid)
 {
-    for (const CTransaction tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if(!tx.IsZerocoinMint())
             continue;
 
@@ -82,7 +84,8 @@ bool BlockToPubcoinList(const CBlock& block, std::list<libzerocoin::PublicCoin>&
 //return a list of zerocoin mints contained in a specific block
 bool BlockToZerocoinMintList(const CBlock& block, std::list<CZerocoinMint>& vMints, bool fFilterInvalid)
 {
-    for (const CTransaction& tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if(!tx.IsZerocoinMint())
             continue;
 
@@ -275,7 +278,8 @@ std::string ReindexZerocoinDB()
             return _("Reindexing zerocoin failed");
         }
 
-        for (const CTransaction& tx : block.vtx) {
+        for (const CTransactionRef& ptx : block.vtx) {
+            const CTransaction& tx = *ptx;
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 if (tx.IsCoinBase())
                     break;
@@ -371,7 +375,8 @@ bool TxOutToPublicCoin(const CTxOut& txout, libzerocoin::PublicCoin& pubCoin, CV
 std::list<libzerocoin::CoinDenomination> ZerocoinSpendListFromBlock(const CBlock& block, bool fFilterInvalid)
 {
     std::list<libzerocoin::CoinDenomination> vSpends;
-    for (const CTransaction tx : block.vtx) {
+    for (const CTransactionRef& ptx : block.vtx) {
+        const CTransaction& tx = *ptx;
         if (!tx.IsZerocoinSpend())
             continue;
 